@@ -0,0 +1,178 @@
+// [AsmJit/Contrib]
+// Memfd Context.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+#include <asmjit/core.h>
+#if defined(ASMJIT_POSIX) && defined(__linux__)
+
+#include "memfdcontext.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace AsmJit {
+
+// ============================================================================
+// [AsmJit::MemfdContext - Helpers]
+// ============================================================================
+
+// Functions are aligned to a cache line so two functions never share one.
+static const size_t kMemfdFunctionAlignment = 64;
+
+static int memfdCreate(const char* name)
+{
+  // memfd_create() wrapper is not available in older glibc.
+  return (int)::syscall(__NR_memfd_create, name, 0);
+}
+
+// ============================================================================
+// [AsmJit::MemfdContext - Construction / Destruction]
+// ============================================================================
+
+MemfdContext::MemfdContext(size_t capacity, const char* name) :
+  _fd(-1),
+  _execBase(NULL),
+  _writeBase(NULL),
+  _capacity(0),
+  _used(0),
+  _ownerPid(::getpid())
+{
+  size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+  capacity = (capacity + pageSize - 1) & ~(pageSize - 1);
+
+  _fd = memfdCreate(name);
+  if (_fd == -1)
+    return;
+
+  if (::ftruncate(_fd, (off_t)capacity) != 0)
+    goto _Fail;
+
+  // The read-execute view is the one inherited by forked workers.
+  _execBase = ::mmap(NULL, capacity, PROT_READ | PROT_EXEC, MAP_SHARED, _fd, 0);
+  if (_execBase == MAP_FAILED)
+  {
+    _execBase = NULL;
+    goto _Fail;
+  }
+
+  _writeBase = ::mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (_writeBase == MAP_FAILED)
+  {
+    ::munmap(_execBase, capacity);
+    _execBase = NULL;
+    _writeBase = NULL;
+    goto _Fail;
+  }
+
+  // Keep the writable view private to the coordinator - forked workers get
+  // only the read-execute one.
+  ::madvise(_writeBase, capacity, MADV_DONTFORK);
+
+  _capacity = capacity;
+  return;
+
+_Fail:
+  ::close(_fd);
+  _fd = -1;
+}
+
+MemfdContext::~MemfdContext()
+{
+  // Forked processes don't have the writable view, the range may hold an
+  // unrelated mapping there.
+  if (_writeBase != NULL && isOwner())
+    ::munmap(_writeBase, _capacity);
+  if (_execBase != NULL)
+    ::munmap(_execBase, _capacity);
+  if (_fd != -1)
+    ::close(_fd);
+}
+
+// ============================================================================
+// [AsmJit::MemfdContext - Generate]
+// ============================================================================
+
+uint32_t MemfdContext::generate(void** dest, Assembler* assembler)
+{
+  // Code is relocated for the read-execute view while it's written through
+  // the writable one, so it can't be emitted in place.
+  assembler->releaseReservedCode();
+
+  // Disallow empty code generation.
+  size_t codeSize = assembler->getCodeSize();
+  if (codeSize == 0)
+  {
+    *dest = NULL;
+    return kErrorNoFunction;
+  }
+
+  // The writable view is not inherited by forked workers (MADV_DONTFORK).
+  if (!isValid() || !isOwner())
+  {
+    *dest = NULL;
+    return kErrorNoVirtualMemory;
+  }
+
+  size_t offset;
+  {
+    AutoLock locked(_lock);
+
+    offset = (_used + kMemfdFunctionAlignment - 1) & ~(kMemfdFunctionAlignment - 1);
+    if (offset > _capacity || codeSize > _capacity - offset)
+    {
+      *dest = NULL;
+      return kErrorNoVirtualMemory;
+    }
+
+    _used = offset + codeSize;
+  }
+
+  uint8_t* execPtr = (uint8_t*)_execBase + offset;
+  uint8_t* writePtr = (uint8_t*)_writeBase + offset;
+
+  // Relocate directly into the shared segment. The unused tail of the block
+  // (if relocation made the code smaller) is simply left unused, the memory
+  // is allocated permanently.
+  assembler->relocCode(writePtr, (uintptr_t)execPtr);
+
+  *dest = execPtr;
+  return kErrorOk;
+}
+
+// ============================================================================
+// [AsmJit::MemfdContext - Attach]
+// ============================================================================
+
+void* MemfdContext::attach(int fd, void* execBase, size_t capacity)
+{
+  int flags = MAP_SHARED;
+#if defined(MAP_FIXED_NOREPLACE)
+  // Fail instead of silently replacing a mapping the worker already has.
+  flags |= MAP_FIXED_NOREPLACE;
+#endif // MAP_FIXED_NOREPLACE
+
+  void* p = ::mmap(execBase, capacity, PROT_READ | PROT_EXEC, flags, fd, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  // Without MAP_FIXED_NOREPLACE the address is only a hint.
+  if (p != execBase)
+  {
+    ::munmap(p, capacity);
+    return NULL;
+  }
+
+  return p;
+}
+
+void MemfdContext::detach(void* execBase, size_t capacity)
+{
+  ::munmap(execBase, capacity);
+}
+
+} // AsmJit namespace
+
+#endif // ASMJIT_POSIX && __linux__
@@ -0,0 +1,141 @@
+// [AsmJit/Contrib]
+// Memfd Context.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+// [Guard]
+#ifndef _ASMJIT_CONTRIB_MEMFDCONTEXT_H
+#define _ASMJIT_CONTRIB_MEMFDCONTEXT_H
+
+#include <asmjit/core.h>
+#if defined(ASMJIT_POSIX) && defined(__linux__)
+
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace AsmJit {
+
+// ============================================================================
+// [AsmJit::MemfdContext]
+// ============================================================================
+
+//! @brief MemfdContext generates code into a memfd-backed segment shared by
+//! several processes.
+//!
+//! The context is owned by a compile-coordinator process. The segment is
+//! mapped twice in the coordinator - writable, which is used to store the
+//! relocated code, and read-execute, which is the address the code is
+//! relocated for. Worker processes forked after the context was created
+//! inherit the read-execute mapping at the same address, other processes
+//! can receive the file descriptor (see @c getFd()) and map it by
+//! @c MemfdContext::attach(). Either way each worker sees every function
+//! the coordinator generates without compiling or copying it.
+//!
+//! Since the code contains absolute addresses the segment must be mapped at
+//! the same address in all processes. Workers never get a writable view.
+//!
+//! Memory is allocated permanently from the segment, functions can't be
+//! freed. Only the coordinator (the process that created the context) can
+//! generate code, @c generate() fails with @c kErrorNoVirtualMemory in
+//! forked workers, which don't have the writable view.
+struct MemfdContext : public Context
+{
+  // --------------------------------------------------------------------------
+  // [Construction / Destruction]
+  // --------------------------------------------------------------------------
+
+  //! @brief Create a @c MemfdContext with a segment of @a capacity bytes.
+  //!
+  //! Use @c isValid() to check whether the segment was created.
+  MemfdContext(size_t capacity, const char* name = "asmjit");
+  //! @brief Destroy the @c MemfdContext instance, unmapping the segment.
+  //!
+  //! Processes that still have the segment mapped are not affected.
+  virtual ~MemfdContext();
+
+  // --------------------------------------------------------------------------
+  // [Accessors]
+  // --------------------------------------------------------------------------
+
+  //! @brief Get whether the segment was created and mapped.
+  inline bool isValid() const
+  { return _execBase != NULL; }
+
+  //! @brief Get whether the calling process created the context (and so
+  //! has the writable view).
+  inline bool isOwner() const
+  { return ::getpid() == _ownerPid; }
+
+  //! @brief Get the memfd file descriptor (pass it to workers which were not
+  //! forked from the coordinator).
+  inline int getFd() const
+  { return _fd; }
+
+  //! @brief Get the address of the read-execute mapping.
+  inline void* getExecBase() const
+  { return _execBase; }
+
+  //! @brief Get the segment capacity.
+  inline size_t getCapacity() const
+  { return _capacity; }
+
+  //! @brief Get the count of bytes used by generated functions.
+  inline size_t getUsedBytes() const
+  { return _used; }
+
+  //! @brief Get the offset of function @a fn inside the segment.
+  inline size_t getOffset(const void* fn) const
+  { return (size_t)((const uint8_t*)fn - (const uint8_t*)_execBase); }
+
+  //! @brief Get the function at @a offset inside the segment.
+  inline void* getFunction(size_t offset) const
+  { return (uint8_t*)_execBase + offset; }
+
+  // --------------------------------------------------------------------------
+  // [Interface]
+  // --------------------------------------------------------------------------
+
+  virtual uint32_t generate(void** dest, Assembler* assembler);
+
+  // --------------------------------------------------------------------------
+  // [Attach]
+  // --------------------------------------------------------------------------
+
+  //! @brief Map segment @a fd of @a capacity bytes read-execute at
+  //! @a execBase in the calling (worker) process.
+  //!
+  //! The address must be the coordinator's @c getExecBase(). Returns
+  //! @a execBase on success or @c NULL if the range is not available.
+  static void* attach(int fd, void* execBase, size_t capacity);
+
+  //! @brief Unmap a segment previously mapped by @c attach().
+  static void detach(void* execBase, size_t capacity);
+
+  // --------------------------------------------------------------------------
+  // [Members]
+  // --------------------------------------------------------------------------
+
+  //! @brief Memfd file descriptor.
+  int _fd;
+  //! @brief Read-execute mapping (shared with workers).
+  void* _execBase;
+  //! @brief Writable mapping (coordinator only).
+  void* _writeBase;
+  //! @brief Segment capacity.
+  size_t _capacity;
+  //! @brief Used bytes.
+  size_t _used;
+  //! @brief Process that created the context.
+  pid_t _ownerPid;
+  //! @brief Lock.
+  Lock _lock;
+
+  ASMJIT_NO_COPY(MemfdContext)
+};
+
+} // AsmJit namespace
+
+// [Guard]
+#endif // ASMJIT_POSIX && __linux__
+#endif // _ASMJIT_CONTRIB_MEMFDCONTEXT_H
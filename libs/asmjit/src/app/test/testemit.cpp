@@ -0,0 +1,302 @@
+// [AsmJit]
+// Complete JIT Assembler for C++ Language.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+// X86Assembler throughput benchmark.
+//
+// Encodes blocks of instructions into a cleared assembler and reports
+// instructions encoded per second for several instruction mixes - scalar and
+// packed SSE2 arithmetic in register and memory forms (the bulk of code
+// generated for floating point expressions) and general purpose arithmetic
+// as a reference. The code size of each mix is printed as well, so encoder
+// changes can be checked for unchanged output.
+//
+// Before timing, every instruction handled by the SSE fast path is encoded
+// with each register and memory operand form both by the fast path and by
+// the generic encoder (used when a logger is attached) and the bytes are
+// compared. The test fails if any encoding differs.
+//
+// Usage: testemit [rounds]
+
+// [Dependencies - AsmJit]
+#include <asmjit/asmjit.h>
+
+// [Dependencies - C]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ASMJIT_WINDOWS)
+# include <windows.h>
+#else
+# include <time.h>
+#endif // ASMJIT_WINDOWS
+
+using namespace AsmJit;
+
+// ============================================================================
+// [Timer]
+// ============================================================================
+
+static double getSeconds()
+{
+#if defined(ASMJIT_WINDOWS)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+
+  return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif // ASMJIT_WINDOWS
+}
+
+// ============================================================================
+// [Fast SSE Verification]
+// ============================================================================
+
+// Assembler with a logger discarding everything, which keeps instructions
+// off the fast path.
+struct NullLogger : public Logger
+{
+  virtual void logString(const char* buf, size_t len) {}
+};
+
+#if defined(ASMJIT_X64)
+static const uint32_t kRegCount = 16;
+#else
+static const uint32_t kRegCount = 8;
+#endif // ASMJIT_X64
+
+static int verifyEncoding(X86Assembler& fast, X86Assembler& generic,
+  uint32_t code, const Operand& o0, const Operand& o1)
+{
+  fast.clear();
+  generic.clear();
+
+  fast._emitInstruction(code, &o0, &o1);
+  generic._emitInstruction(code, &o0, &o1);
+
+  if (fast.getError() == generic.getError() &&
+      fast.getCodeSize() == generic.getCodeSize() &&
+      memcmp(fast.getCode(), generic.getCode(), fast.getCodeSize()) == 0)
+  {
+    return 0;
+  }
+
+  printf("MISMATCH %-10s fast:", x86InstInfo[code].getName());
+  for (size_t i = 0; i < fast.getCodeSize(); i++)
+    printf(" %02X", fast.getCode()[i]);
+  printf("  generic:");
+  for (size_t i = 0; i < generic.getCodeSize(); i++)
+    printf(" %02X", generic.getCode()[i]);
+  printf("\n");
+
+  fast.setError(kErrorOk);
+  generic.setError(kErrorOk);
+  return 1;
+}
+
+// Memory operands covering the fast path's special cases (no displacement,
+// 8-bit and 32-bit displacements, xBP/R13 and xSP/R12 bases) and the forms
+// it hands to _emitMmu() (index, segment, absolute address).
+static void getMemOperands(Mem* mems, size_t* count)
+{
+  static const sysint_t disps[] = { 0, 1, -1, 127, 128, -128, -129, 4096, 0x7FFFFFF0 };
+  size_t n = 0;
+
+  for (uint32_t base = 0; base < kRegCount; base++)
+  {
+    for (size_t d = 0; d < ASMJIT_ARRAY_SIZE(disps); d++)
+      mems[n++] = ptr(gpz(base), disps[d]);
+
+    mems[n++] = ptr(gpz(base), gpz((base + 3) % kRegCount == 4 ? 5 : (base + 3) % kRegCount), kScale8Times, 16);
+    mems[n] = ptr(gpz(base), 8);
+    mems[n++].setSegment(fs);
+  }
+
+  mems[n++] = ptr_abs((void*)0x1000, 8);
+  *count = n;
+}
+
+static int verifyFastSse()
+{
+  X86Assembler fast;
+  X86Assembler generic;
+  NullLogger logger;
+  generic.setLogger(&logger);
+
+  Mem mems[kRegCount * 11 + 1];
+  size_t memCount;
+  getMemOperands(mems, &memCount);
+
+  int mismatches = 0;
+  int encodings = 0;
+
+  for (uint32_t code = 0; code < _kX86InstCount; code++)
+  {
+    const X86InstInfo& info = x86InstInfo[code];
+    if (!info.isFastSse())
+      continue;
+
+    for (uint32_t i = 0; i < kRegCount; i++)
+    {
+      for (uint32_t j = 0; j < kRegCount; j++)
+      {
+        mismatches += verifyEncoding(fast, generic, code, xmm(i), xmm(j));
+        encodings++;
+      }
+
+      for (size_t m = 0; m < memCount; m++)
+      {
+        mismatches += verifyEncoding(fast, generic, code, xmm(i), mems[m]);
+        encodings++;
+
+        if (info.getGroup() == kX86InstGroupMmuMov)
+        {
+          mismatches += verifyEncoding(fast, generic, code, mems[m], xmm(i));
+          encodings++;
+        }
+      }
+    }
+  }
+
+  printf("SSE fast path: %d encodings compared with the generic encoder, %d mismatches\n\n",
+    encodings, mismatches);
+  return mismatches;
+}
+
+// ============================================================================
+// [Mixes]
+// ============================================================================
+
+// Each mix emits 64 instructions.
+static const int kInstPerBlock = 64;
+
+static void emitSseRegReg(X86Assembler& a)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    a.movsd(xmm0, xmm1);
+    a.addsd(xmm0, xmm2);
+    a.mulsd(xmm3, xmm0);
+    a.subsd(xmm4, xmm3);
+    a.divsd(xmm5, xmm4);
+    a.addpd(xmm6, xmm7);
+    a.mulpd(xmm7, xmm6);
+    a.xorpd(xmm1, xmm1);
+  }
+}
+
+static void emitSseRegRegExt(X86Assembler& a)
+{
+  // Registers which need REX prefix in 64-bit mode.
+#if defined(ASMJIT_X64)
+  for (int i = 0; i < 8; i++)
+  {
+    a.movsd(xmm8, xmm1);
+    a.addsd(xmm0, xmm9);
+    a.mulsd(xmm10, xmm11);
+    a.subsd(xmm12, xmm3);
+    a.divsd(xmm5, xmm13);
+    a.addpd(xmm14, xmm15);
+    a.maxsd(xmm15, xmm8);
+    a.sqrtsd(xmm9, xmm9);
+  }
+#else
+  emitSseRegReg(a);
+#endif // ASMJIT_X64
+}
+
+static void emitSseRegMem(X86Assembler& a)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    a.movsd(xmm0, qword_ptr(zsi, 8));
+    a.addsd(xmm0, qword_ptr(zsi, 16));
+    a.mulsd(xmm1, qword_ptr(zsi, 1024));
+    a.subsd(xmm2, qword_ptr(zsi, zdx, kScale8Times));
+    a.divsd(xmm3, qword_ptr(zsp, 24));
+    a.addpd(xmm4, dqword_ptr(zdi));
+    a.movsd(qword_ptr(zdi, 8), xmm0);
+    a.movapd(dqword_ptr(zdi, 16), xmm4);
+  }
+}
+
+static void emitGpArith(X86Assembler& a)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    a.mov(zax, zcx);
+    a.add(zax, zdx);
+    a.sub(zcx, 16);
+    a.and_(zdx, zax);
+    a.xor_(zsi, zsi);
+    a.imul(zax, zcx);
+    a.lea(zdi, ptr(zax, zcx, kScale8Times, 8));
+    a.cmp(zax, zdx);
+  }
+}
+
+struct Mix
+{
+  const char* name;
+  void (*emit)(X86Assembler& a);
+};
+
+static const Mix mixes[] =
+{
+  { "sse reg-reg"    , emitSseRegReg    },
+  { "sse reg-reg ext", emitSseRegRegExt },
+  { "sse reg-mem"    , emitSseRegMem    },
+  { "gp arith"       , emitGpArith      }
+};
+
+// ============================================================================
+// [Main]
+// ============================================================================
+
+int main(int argc, char* argv[])
+{
+  int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+  if (rounds < 1) rounds = 1;
+
+  if (verifyFastSse() != 0)
+    return 1;
+
+  printf("X86Assembler throughput - %d rounds of %d instructions\n\n", rounds, kInstPerBlock);
+
+  for (size_t m = 0; m < ASMJIT_ARRAY_SIZE(mixes); m++)
+  {
+    X86Assembler a;
+
+    // Warm up (grow the buffer).
+    mixes[m].emit(a);
+    size_t codeSize = a.getCodeSize();
+
+    double start = getSeconds();
+    for (int r = 0; r < rounds; r++)
+    {
+      a.clear();
+      mixes[m].emit(a);
+    }
+    double elapsed = getSeconds() - start;
+
+    double instCount = (double)rounds * (double)kInstPerBlock;
+    printf("%-16s %8.2f Minst/s  %6.2f ns/inst  %4d bytes/block%s\n",
+      mixes[m].name,
+      instCount / elapsed / 1e6,
+      elapsed * 1e9 / instCount,
+      (int)codeSize,
+      a.getError() ? "  ERROR" : "");
+  }
+
+  return 0;
+}
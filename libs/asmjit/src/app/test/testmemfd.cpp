@@ -0,0 +1,114 @@
+// [AsmJit]
+// Complete JIT Assembler for C++ Language.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+// MemfdContext fork test.
+//
+// The coordinator generates a function into a memfd segment and forks a
+// worker. The worker must be able to call the inherited function, and its
+// own generate() must fail cleanly, as the writable view is not inherited.
+
+// [Dependencies - AsmJit]
+#include <asmjit/asmjit.h>
+#include "memfdcontext.h"
+
+// [Dependencies - C]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace AsmJit;
+
+typedef int (*MyFn)(void);
+
+static MyFn makeConstant(Context* context, int value, uint32_t* error)
+{
+  X86Assembler a(context);
+  a.mov(eax, imm(value));
+  a.ret();
+
+  MyFn fn = asmjit_cast<MyFn>(a.make());
+  *error = a.getError();
+  return fn;
+}
+
+int main(int argc, char* argv[])
+{
+  MemfdContext context(65536);
+  if (!context.isValid())
+  {
+    printf("Status: Failure: memfd segment not created\n");
+    return 1;
+  }
+
+  uint32_t error;
+  MyFn fn = makeConstant(&context, 42, &error);
+  if (fn == NULL || fn() != 42)
+  {
+    printf("Status: Failure: coordinator can't generate (error %u)\n", (unsigned int)error);
+    return 1;
+  }
+
+  fflush(stdout);
+  pid_t pid = ::fork();
+  if (pid == -1)
+  {
+    printf("Status: Failure: fork failed\n");
+    return 1;
+  }
+
+  if (pid == 0)
+  {
+    // Worker. Bits of the exit status are the failed checks.
+    int failed = 0;
+
+    if (fn() != 42)
+      failed |= 1;
+    if (context.isOwner())
+      failed |= 2;
+
+    MyFn other = makeConstant(&context, 7, &error);
+    if (other != NULL || error != kErrorNoVirtualMemory)
+      failed |= 4;
+
+    ::_exit(failed);
+  }
+
+  int status = 0;
+  ::waitpid(pid, &status, 0);
+
+  int problems = 0;
+  if (!WIFEXITED(status))
+  {
+    printf("Worker crashed (status %d)\n", status);
+    problems++;
+  }
+  else
+  {
+    int failed = WEXITSTATUS(status);
+    if (failed & 1) { printf("Worker can't call the inherited function\n"); problems++; }
+    if (failed & 2) { printf("Worker thinks it owns the context\n"); problems++; }
+    if (failed & 4) { printf("Worker generate() didn't fail with kErrorNoVirtualMemory\n"); problems++; }
+  }
+
+  // The coordinator keeps generating after the fork.
+  MyFn second = makeConstant(&context, 7, &error);
+  if (second == NULL || second() != 7)
+  {
+    printf("Coordinator can't generate after fork (error %u)\n", (unsigned int)error);
+    problems++;
+  }
+
+  if (problems)
+    printf("Status: Failure: %d problems found\n", problems);
+  else
+    printf("Status: Success\n");
+
+  return problems ? 1 : 0;
+}
@@ -0,0 +1,432 @@
+// [AsmJit]
+// Complete JIT Assembler for C++ Language.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+// Multithreaded MemoryManager stress benchmark.
+//
+// Every thread keeps its own set of live blocks and replaces them randomly
+// (alloc, shrink, free) with sizes following a distribution of real function
+// sizes - mostly small functions, some large ones and a few huge ones. The
+// same workload is run with 1, 2, 4, ... threads, each run on a fresh
+// VirtualMemoryManager, and reported as throughput, latency percentiles per
+// operation and fragmentation (used vs. allocated bytes).
+//
+// The MemoryManager lock is internal so contention is not measured directly,
+// it's derived from how per-operation latency grows with the thread count
+// compared to the single-threaded run.
+//
+// Usage: testmemmt [maxThreads] [opsPerThread] [liveBlocksPerThread]
+
+// [Dependencies - AsmJit]
+#include <asmjit/asmjit.h>
+
+// [Dependencies - C]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ASMJIT_WINDOWS)
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <time.h>
+# include <unistd.h>
+#endif // ASMJIT_WINDOWS
+
+// ============================================================================
+// [Timer]
+// ============================================================================
+
+static uint64_t getNanoseconds()
+{
+#if defined(ASMJIT_WINDOWS)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+#endif // ASMJIT_WINDOWS
+}
+
+static int getCpuCount()
+{
+#if defined(ASMJIT_WINDOWS)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif // ASMJIT_WINDOWS
+}
+
+// ============================================================================
+// [Random]
+// ============================================================================
+
+// Per-thread xorshift generator, rand() is not thread-safe everywhere and
+// serializes threads where it is.
+static inline uint32_t nextRandom(uint32_t& state)
+{
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static inline size_t randomRange(uint32_t& state, size_t lo, size_t hi)
+{
+  return lo + (size_t)nextRandom(state) % (hi - lo);
+}
+
+// Size of a generated function - 50% small (32-256 bytes), 35% medium
+// (256-2048), 13% large (2-16kB) and 2% huge (16-64kB).
+static size_t randomCodeSize(uint32_t& state)
+{
+  uint32_t r = nextRandom(state) % 100;
+
+  if (r < 50) return randomRange(state, 32, 256);
+  if (r < 85) return randomRange(state, 256, 2048);
+  if (r < 98) return randomRange(state, 2048, 16384);
+  return randomRange(state, 16384, 65536);
+}
+
+// ============================================================================
+// [Worker]
+// ============================================================================
+
+enum
+{
+  kOpAlloc = 0,
+  kOpShrink = 1,
+  kOpFree = 2,
+  kOpCount = 3
+};
+
+static const char* opNames[kOpCount] = { "alloc", "shrink", "free" };
+
+struct Worker
+{
+  AsmJit::MemoryManager* memmgr;
+  int id;
+  size_t ops;
+  size_t liveCount;
+
+  // Output.
+  uint32_t* latency[kOpCount];
+  size_t latencyCount[kOpCount];
+  size_t failures;
+  uint64_t elapsed;
+
+  // Fragmentation samples (taken by the first worker only).
+  double usedRatioSum;
+  size_t usedRatioSamples;
+  size_t peakAllocated;
+};
+
+static volatile int startFlag;
+
+static void runWorker(Worker* w)
+{
+  AsmJit::MemoryManager* memmgr = w->memmgr;
+  uint32_t state = 0x9E3779B9U * (uint32_t)(w->id + 1);
+
+  void** live = (void**)calloc(w->liveCount, sizeof(void*));
+  size_t* liveSize = (size_t*)calloc(w->liveCount, sizeof(size_t));
+
+  while (!startFlag) {}
+
+  uint64_t start = getNanoseconds();
+
+  for (size_t i = 0; i < w->ops; i++)
+  {
+    size_t slot = (size_t)nextRandom(state) % w->liveCount;
+    uint32_t op;
+    uint64_t t0, t1;
+
+    if (live[slot] == NULL)
+    {
+      size_t size = randomCodeSize(state);
+
+      op = kOpAlloc;
+      t0 = getNanoseconds();
+      void* p = memmgr->alloc(size);
+      t1 = getNanoseconds();
+
+      if (p == NULL)
+      {
+        w->failures++;
+        continue;
+      }
+
+      // Touch the block like the code generator would.
+      ((uint8_t*)p)[0] = 0xC3;
+      ((uint8_t*)p)[size - 1] = 0xC3;
+
+      live[slot] = p;
+      liveSize[slot] = size;
+    }
+    // Relocated code is often smaller than the estimate, shrink one in four.
+    else if ((nextRandom(state) & 3) == 0 && liveSize[slot] > 64)
+    {
+      size_t size = liveSize[slot] - randomRange(state, 1, liveSize[slot] / 4);
+
+      op = kOpShrink;
+      t0 = getNanoseconds();
+      if (!memmgr->shrink(live[slot], size))
+        w->failures++;
+      t1 = getNanoseconds();
+
+      liveSize[slot] = size;
+    }
+    else
+    {
+      op = kOpFree;
+      t0 = getNanoseconds();
+      if (!memmgr->free(live[slot]))
+        w->failures++;
+      t1 = getNanoseconds();
+
+      live[slot] = NULL;
+    }
+
+    w->latency[op][w->latencyCount[op]++] = (uint32_t)(t1 - t0);
+
+    if (w->id == 0 && (i & 1023) == 0)
+    {
+      size_t used = memmgr->getUsedBytes();
+      size_t allocated = memmgr->getAllocatedBytes();
+
+      if (allocated != 0)
+      {
+        w->usedRatioSum += (double)used / (double)allocated;
+        w->usedRatioSamples++;
+      }
+      if (allocated > w->peakAllocated)
+        w->peakAllocated = allocated;
+    }
+  }
+
+  w->elapsed = getNanoseconds() - start;
+
+  for (size_t i = 0; i < w->liveCount; i++)
+  {
+    if (live[i] != NULL)
+      memmgr->free(live[i]);
+  }
+
+  free(live);
+  free(liveSize);
+}
+
+#if defined(ASMJIT_WINDOWS)
+static DWORD WINAPI workerEntry(LPVOID arg)
+{
+  runWorker(static_cast<Worker*>(arg));
+  return 0;
+}
+#else
+static void* workerEntry(void* arg)
+{
+  runWorker(static_cast<Worker*>(arg));
+  return NULL;
+}
+#endif // ASMJIT_WINDOWS
+
+// ============================================================================
+// [Statistics]
+// ============================================================================
+
+static int compareLatency(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t count, double p)
+{
+  if (count == 0)
+    return 0;
+
+  size_t i = (size_t)(p * (double)(count - 1));
+  return sorted[i];
+}
+
+struct RunResult
+{
+  double opsPerSecond;
+  double meanLatency;
+};
+
+static RunResult run(int threadCount, size_t ops, size_t liveCount)
+{
+  AsmJit::VirtualMemoryManager memmgr;
+  Worker* workers = (Worker*)calloc((size_t)threadCount, sizeof(Worker));
+  int i, op;
+
+  for (i = 0; i < threadCount; i++)
+  {
+    workers[i].memmgr = &memmgr;
+    workers[i].id = i;
+    workers[i].ops = ops;
+    workers[i].liveCount = liveCount;
+
+    for (op = 0; op < kOpCount; op++)
+      workers[i].latency[op] = (uint32_t*)malloc(ops * sizeof(uint32_t));
+  }
+
+  startFlag = 0;
+
+#if defined(ASMJIT_WINDOWS)
+  HANDLE* threads = (HANDLE*)malloc((size_t)threadCount * sizeof(HANDLE));
+  for (i = 0; i < threadCount; i++)
+    threads[i] = CreateThread(NULL, 0, workerEntry, &workers[i], 0, NULL);
+
+  startFlag = 1;
+  WaitForMultipleObjects((DWORD)threadCount, threads, TRUE, INFINITE);
+
+  for (i = 0; i < threadCount; i++)
+    CloseHandle(threads[i]);
+#else
+  pthread_t* threads = (pthread_t*)malloc((size_t)threadCount * sizeof(pthread_t));
+  for (i = 0; i < threadCount; i++)
+    pthread_create(&threads[i], NULL, workerEntry, &workers[i]);
+
+  startFlag = 1;
+
+  for (i = 0; i < threadCount; i++)
+    pthread_join(threads[i], NULL);
+#endif // ASMJIT_WINDOWS
+
+  free(threads);
+
+  // Merge.
+  uint64_t elapsed = 0;
+  uint64_t latencySum = 0;
+  size_t totalOps = 0;
+  size_t failures = 0;
+
+  for (i = 0; i < threadCount; i++)
+  {
+    if (workers[i].elapsed > elapsed)
+      elapsed = workers[i].elapsed;
+    failures += workers[i].failures;
+  }
+
+  printf("-- %d thread(s)\n", threadCount);
+
+  for (op = 0; op < kOpCount; op++)
+  {
+    size_t count = 0;
+    for (i = 0; i < threadCount; i++)
+      count += workers[i].latencyCount[op];
+
+    uint32_t* all = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    size_t pos = 0;
+
+    for (i = 0; i < threadCount; i++)
+    {
+      memcpy(all + pos, workers[i].latency[op], workers[i].latencyCount[op] * sizeof(uint32_t));
+      pos += workers[i].latencyCount[op];
+    }
+
+    for (size_t j = 0; j < count; j++)
+      latencySum += all[j];
+    totalOps += count;
+
+    qsort(all, count, sizeof(uint32_t), compareLatency);
+    printf("   %-6s %9d ops  p50 %6u ns  p90 %6u ns  p99 %7u ns  p99.9 %8u ns  max %9u ns\n",
+      opNames[op], (int)count,
+      percentile(all, count, 0.5),
+      percentile(all, count, 0.9),
+      percentile(all, count, 0.99),
+      percentile(all, count, 0.999),
+      count ? all[count - 1] : 0);
+
+    free(all);
+  }
+
+  RunResult result;
+  result.opsPerSecond = elapsed ? (double)totalOps * 1e9 / (double)elapsed : 0.0;
+  result.meanLatency = totalOps ? (double)latencySum / (double)totalOps : 0.0;
+
+  printf("   throughput %.2f Mops/s, mean latency %.0f ns\n",
+    result.opsPerSecond / 1e6, result.meanLatency);
+
+  if (workers[0].usedRatioSamples)
+  {
+    printf("   fragmentation: used/allocated %.1f%% average, peak allocated %d kB\n",
+      100.0 * workers[0].usedRatioSum / (double)workers[0].usedRatioSamples,
+      (int)(workers[0].peakAllocated / 1024));
+  }
+
+  if (failures)
+    printf("   FAILURES: %d\n", (int)failures);
+
+  if (memmgr.getUsedBytes() != 0)
+    printf("   LEAK: %d bytes still used\n", (int)memmgr.getUsedBytes());
+
+  for (i = 0; i < threadCount; i++)
+  {
+    for (op = 0; op < kOpCount; op++)
+      free(workers[i].latency[op]);
+  }
+
+  free(workers);
+  return result;
+}
+
+// ============================================================================
+// [Main]
+// ============================================================================
+
+int main(int argc, char* argv[])
+{
+  int maxThreads = argc > 1 ? atoi(argv[1]) : getCpuCount();
+  size_t ops = argc > 2 ? (size_t)atol(argv[2]) : 200000;
+  size_t liveCount = argc > 3 ? (size_t)atol(argv[3]) : 2048;
+
+  if (maxThreads < 1) maxThreads = 1;
+  if (ops < 1) ops = 1;
+  if (liveCount < 1) liveCount = 1;
+
+  printf("MemoryManager stress test - up to %d thread(s), %d ops and %d live blocks per thread\n\n",
+    maxThreads, (int)ops, (int)liveCount);
+
+  RunResult base = run(1, ops, liveCount);
+  printf("\n");
+
+  for (int threadCount = 2; ; threadCount *= 2)
+  {
+    if (threadCount > maxThreads)
+    {
+      if (threadCount / 2 == maxThreads)
+        break;
+      threadCount = maxThreads;
+    }
+
+    RunResult r = run(threadCount, ops, liveCount);
+
+    // Per-operation latency growth over the single-threaded run is time spent
+    // waiting for the MemoryManager lock (and cache-line transfers).
+    printf("   scaling %.2fx of %d, contention +%.0f ns/op (%.0f%% of latency)\n\n",
+      r.opsPerSecond / base.opsPerSecond, threadCount,
+      r.meanLatency - base.meanLatency,
+      r.meanLatency > 0.0 ? 100.0 * (r.meanLatency - base.meanLatency) / r.meanLatency : 0.0);
+
+    if (threadCount == maxThreads)
+      break;
+  }
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+// [AsmJit]
+// Complete JIT Assembler for C++ Language.
+//
+// [License]
+// Zlib - See COPYING file in this package.
+
+// [Dependencies - AsmJit]
+#include <asmjit/asmjit.h>
+
+// [Dependencies - C]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int problems = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("Failed: %s\n", what);
+    problems++;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  AsmJit::VirtualMemoryManager memmgr;
+
+  size_t i;
+  size_t count = 3000;
+
+  printf("Slab alloc/free/reuse/shrink test\n\n");
+
+  // Alloc and free of one small block reuses the block and keeps the chunk.
+  void* first = memmgr.alloc(64);
+  check(first != NULL, "alloc of a small block");
+  size_t chunkSize = memmgr.getAllocatedBytes();
+  check(chunkSize > 0, "small block allocates a chunk");
+  check(memmgr.getUsedBytes() == 64, "used bytes of one 64 byte block");
+
+  for (i = 0; i < 1000; i++)
+  {
+    check(memmgr.free(first), "free of a small block");
+    check(memmgr.getAllocatedBytes() == chunkSize, "empty chunk is kept as a spare");
+
+    void* again = memmgr.alloc(64);
+    check(again == first, "freed block is reused");
+    first = again;
+  }
+
+  // Blocks of different size classes live on different pages.
+  void* a = memmgr.alloc(20);
+  void* b = memmgr.alloc(200);
+  check(a != NULL && b != NULL, "alloc of two size classes");
+  check((size_t)a / 4096 != (size_t)b / 4096, "size classes use different pages");
+  check(memmgr.getUsedBytes() == 64 + 32 + 224, "used bytes are rounded to size classes");
+
+  memset(a, 0xAA, 20);
+  memset(b, 0x55, 200);
+  check(((unsigned char*)a)[19] == 0xAA && ((unsigned char*)b)[199] == 0x55, "blocks are writable");
+
+  // Shrinking a small block keeps it (and its size class).
+  check(memmgr.shrink(b, 10), "shrink of a small block");
+  check(memmgr.getUsedBytes() == 64 + 32 + 224, "shrink keeps the size class");
+  check(((unsigned char*)b)[199] == 0x55, "shrunk block keeps its content");
+
+  check(memmgr.free(a), "free of the 32 byte block");
+  check(memmgr.free(b), "free of the shrunk block");
+  check(!memmgr.free(b), "double free is rejected");
+  check(memmgr.free(first), "free of the 64 byte block");
+  check(memmgr.getUsedBytes() == 0, "no used bytes after free");
+  check(memmgr.getAllocatedBytes() == chunkSize, "one spare chunk after free");
+
+  // Fill more than one chunk, then free everything; only the spare remains.
+  void** blocks = (void**)malloc(sizeof(void*) * count);
+  if (!blocks) return 1;
+
+  for (i = 0; i < count; i++)
+  {
+    blocks[i] = memmgr.alloc(32);
+    check(blocks[i] != NULL, "alloc while filling chunks");
+    memset(blocks[i], (int)(i & 0xFF), 32);
+  }
+  check(memmgr.getAllocatedBytes() > chunkSize, "blocks span more than one chunk");
+
+  for (i = 0; i < count; i++)
+  {
+    check(((unsigned char*)blocks[i])[31] == (unsigned char)(i & 0xFF), "block content is preserved");
+    check(memmgr.free(blocks[i]), "free while emptying chunks");
+  }
+  check(memmgr.getUsedBytes() == 0, "no used bytes after emptying chunks");
+  check(memmgr.getAllocatedBytes() == chunkSize, "emptied chunks are released except the spare");
+
+  free(blocks);
+
+  // freeAll() releases the spare as well.
+  memmgr.freeAll();
+  check(memmgr.getAllocatedBytes() == 0, "freeAll releases the spare chunk");
+
+  if (problems)
+    printf("Status: Failure: %d problems found\n", problems);
+  else
+    printf("Status: Success\n");
+
+  return problems ? 1 : 0;
+}
@@ -34,6 +34,8 @@ Assembler::Assembler(Context* context) :
   _properties(0),
   _emitOptions(0),
   _trampolineSize(0),
+  _reservedCode(NULL),
+  _reservedSize(0),
   _inlineComment(NULL),
   _unusedLinks(NULL)
 {
@@ -41,6 +43,49 @@ Assembler::Assembler(Context* context) :
 
 Assembler::~Assembler()
 {
+  releaseReservedCode();
+}
+
+// ============================================================================
+// [AsmJit::Assembler - Reserved Code]
+// ============================================================================
+
+bool Assembler::reserveCode(size_t size)
+{
+  ASMJIT_ASSERT(getOffset() == 0);
+  releaseReservedCode();
+
+  void* p = _context->reserve(size);
+  if (p == NULL)
+    return false;
+
+  _reservedCode = p;
+  _reservedSize = size;
+  _buffer.setExternal(reinterpret_cast<uint8_t*>(p), size);
+  return true;
+}
+
+void Assembler::releaseReservedCode()
+{
+  if (_reservedCode == NULL)
+    return;
+
+  // Don't keep emitting into released memory.
+  if (isEmittingInPlace())
+    _buffer.reset();
+
+  _context->release(_reservedCode);
+  _reservedCode = NULL;
+  _reservedSize = 0;
+}
+
+void* Assembler::takeReservedCode()
+{
+  void* p = _reservedCode;
+
+  _reservedCode = NULL;
+  _reservedSize = 0;
+  return p;
 }
 
 // ============================================================================
@@ -119,6 +164,7 @@ void Assembler::clear()
 
 void Assembler::reset()
 {
+  releaseReservedCode();
   _purge();
 
   _zoneMemory.reset();
@@ -134,6 +180,10 @@ void Assembler::reset()
 void Assembler::_purge()
 {
   _zoneMemory.clear();
+
+  // Code made in place now belongs to the caller.
+  if (_buffer.isExternal() && _reservedCode == NULL)
+    _buffer.reset();
   _buffer.clear();
  
   _emitOptions = 0;
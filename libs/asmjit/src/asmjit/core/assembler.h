@@ -198,6 +198,35 @@ struct Assembler
   inline size_t getCodeSize() const
   { return _buffer.getOffset() + getTrampolineSize(); }
 
+  // --------------------------------------------------------------------------
+  // [Reserved Code]
+  // --------------------------------------------------------------------------
+
+  //! @brief Reserve @a size bytes at the final code location through
+  //! @c Context::reserve() and emit directly into them.
+  //!
+  //! @c make() then relocates the code in place instead of allocating memory
+  //! and copying the code. If more than @a size bytes are emitted the code
+  //! moves to an internal buffer and @c make() falls back to the copy. Must
+  //! be called before anything is emitted.
+  //!
+  //! @return @c false if the context can't reserve memory.
+  ASMJIT_API bool reserveCode(size_t size);
+
+  //! @brief Release reserved memory not taken by @c make().
+  ASMJIT_API void releaseReservedCode();
+
+  //! @brief Take the reserved memory (used by @c Context::generate()).
+  ASMJIT_API void* takeReservedCode();
+
+  //! @brief Get size of the reserved memory.
+  inline size_t getReservedSize() const
+  { return _reservedSize; }
+
+  //! @brief Get whether code is still emitted into the reserved memory.
+  inline bool isEmittingInPlace() const
+  { return _reservedCode != NULL && _buffer.getData() == _reservedCode; }
+
   // --------------------------------------------------------------------------
   // [TakeCode]
   // --------------------------------------------------------------------------
@@ -477,6 +506,11 @@ struct Assembler
   //! @brief Size of possible trampolines.
   uint32_t _trampolineSize;
 
+  //! @brief Memory reserved by @c reserveCode(), NULL if none.
+  void* _reservedCode;
+  //! @brief Size of @c _reservedCode.
+  size_t _reservedSize;
+
   //! @brief Inline comment that will be logged by the next instruction and
   //! set to NULL.
   const char* _inlineComment;
@@ -39,7 +39,17 @@ bool Buffer::realloc(size_t to)
     size_t len = getOffset();
     uint8_t *newdata;
 
-    if (_data != NULL)
+    if (_external)
+    {
+      // Move out of the external memory.
+      newdata = (uint8_t*)ASMJIT_MALLOC(to);
+      if (newdata != NULL)
+      {
+        memcpy(newdata, _data, len);
+        _external = false;
+      }
+    }
+    else if (_data != NULL)
       newdata = (uint8_t*)ASMJIT_REALLOC(_data, to);
     else
       newdata = (uint8_t*)ASMJIT_MALLOC(to);
@@ -76,12 +86,14 @@ void Buffer::reset()
 {
   if (_data == NULL)
     return;
-  ASMJIT_FREE(_data);
+  if (!_external)
+    ASMJIT_FREE(_data);
 
   _data = NULL;
   _cur = NULL;
   _max = NULL;
   _capacity = 0;
+  _external = false;
 }
 
 uint8_t* Buffer::take()
@@ -92,10 +104,23 @@ uint8_t* Buffer::take()
   _cur = NULL;
   _max = NULL;
   _capacity = 0;
+  _external = false;
 
   return data;
 }
 
+void Buffer::setExternal(uint8_t* data, size_t capacity)
+{
+  reset();
+
+  _data = data;
+  _cur = data;
+  _max = data + capacity;
+  _max -= (capacity >= kBufferGrow) ? kBufferGrow : capacity;
+  _capacity = capacity;
+  _external = true;
+}
+
 } // AsmJit namespace
 
 // [Api-End]
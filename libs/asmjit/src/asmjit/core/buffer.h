@@ -74,13 +74,14 @@ struct Buffer
     _data(NULL),
     _cur(NULL),
     _max(NULL),
-    _capacity(0)
+    _capacity(0),
+    _external(false)
   {
   }
 
   inline ~Buffer()
   {
-    if (_data) ASMJIT_FREE(_data);
+    if (_data && !_external) ASMJIT_FREE(_data);
   }
 
   //! @brief Get start of buffer.
@@ -98,6 +99,10 @@ struct Buffer
   //! @brief Get capacity of buffer.
   inline size_t getCapacity() const { return _capacity; }
 
+  //! @brief Get whether the buffer uses memory it doesn't own (see
+  //! @c setExternal()).
+  inline bool isExternal() const { return _external; }
+
   //! @brief Ensure space for next instruction
   inline bool ensureSpace() { return (_cur >= _max) ? grow() : true; }
 
@@ -133,8 +138,17 @@ struct Buffer
   ASMJIT_API void reset();
 
   //! @brief Take ownership of the buffer data and purge @c Buffer instance.
+  //!
+  //! External memory is returned as well, but it's still owned by its
+  //! original owner.
   ASMJIT_API uint8_t* take();
 
+  //! @brief Use @a data of @a capacity bytes, owned by the caller, as buffer.
+  //!
+  //! Current content is discarded. If the buffer has to grow, the content
+  //! is moved to memory owned by the buffer and @a data is no longer used.
+  ASMJIT_API void setExternal(uint8_t* data, size_t capacity);
+
   // --------------------------------------------------------------------------
   // [Emit]
   // --------------------------------------------------------------------------
@@ -336,6 +350,9 @@ struct Buffer
 
   //! @brief Buffer capacity (in bytes).
   size_t _capacity;
+
+  //! @brief Whether @c _data is owned by someone else.
+  bool _external;
 };
 
 //! @}
@@ -22,6 +22,17 @@ namespace AsmJit {
 Context::Context() {}
 Context::~Context() {}
 
+void* Context::reserve(size_t size)
+{
+  ASMJIT_UNUSED(size);
+  return NULL;
+}
+
+void Context::release(void* p)
+{
+  ASMJIT_UNUSED(p);
+}
+
 // ============================================================================
 // [AsmJit::JitContext - Construction / Destruction]
 // ============================================================================
@@ -57,18 +68,35 @@ uint32_t JitContext::generate(void** dest, Assembler* assembler)
   if (memmgr == NULL)
     memmgr = MemoryManager::getGlobal();
 
-  void* p = memmgr->alloc(codeSize, getAllocType());
-  if (p == NULL)
+  void* p;
+  // Size of the allocated block, the reservation is usually larger than the
+  // code.
+  size_t allocatedSize = codeSize;
+
+  // Code emitted directly into reserved memory is relocated in place,
+  // otherwise the reservation is released and code copied as usual.
+  if (assembler->isEmittingInPlace() && codeSize <= assembler->getReservedSize())
   {
-    *dest = NULL;
-    return kErrorNoVirtualMemory;
+    allocatedSize = assembler->getReservedSize();
+    p = assembler->takeReservedCode();
+  }
+  else
+  {
+    assembler->releaseReservedCode();
+
+    p = memmgr->alloc(codeSize, getAllocType());
+    if (p == NULL)
+    {
+      *dest = NULL;
+      return kErrorNoVirtualMemory;
+    }
   }
 
   // Relocate the code.
   size_t relocatedSize = assembler->relocCode(p);
 
   // Return unused memory to MemoryManager.
-  if (relocatedSize < codeSize)
+  if (relocatedSize < allocatedSize)
     memmgr->shrink(p, relocatedSize);
 
   // Mark memory if MemoryMarker provided.
@@ -80,6 +108,30 @@ uint32_t JitContext::generate(void** dest, Assembler* assembler)
   return kErrorOk;
 }
 
+// ============================================================================
+// [AsmJit::JitContext - Reserve / Release]
+// ============================================================================
+
+void* JitContext::reserve(size_t size)
+{
+  MemoryManager* memmgr = getMemoryManager();
+
+  if (memmgr == NULL)
+    memmgr = MemoryManager::getGlobal();
+
+  return memmgr->alloc(size, getAllocType());
+}
+
+void JitContext::release(void* p)
+{
+  MemoryManager* memmgr = getMemoryManager();
+
+  if (memmgr == NULL)
+    memmgr = MemoryManager::getGlobal();
+
+  memmgr->free(p);
+}
+
 // ============================================================================
 // [AsmJit::JitContext - GetGlobal]
 // ============================================================================
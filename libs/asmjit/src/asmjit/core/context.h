@@ -58,6 +58,16 @@ struct Context
   //!
   //! @retrurn Error value, see @c kError.
   virtual uint32_t generate(void** dest, Assembler* assembler) = 0;
+
+  //! @brief Reserve @a size bytes at the final code location, so the
+  //! assembler can emit directly into it (see @c Assembler::reserveCode()).
+  //!
+  //! Default implementation doesn't support it and returns @c NULL.
+  ASMJIT_API virtual void* reserve(size_t size);
+
+  //! @brief Release memory returned by @c reserve() that was not used by
+  //! @c generate().
+  ASMJIT_API virtual void release(void* p);
 };
 
 // ============================================================================
@@ -119,6 +129,8 @@ struct JitContext : public Context
   // --------------------------------------------------------------------------
 
   ASMJIT_API virtual uint32_t generate(void** dest, Assembler* assembler);
+  ASMJIT_API virtual void* reserve(size_t size);
+  ASMJIT_API virtual void release(void* p);
 
   // --------------------------------------------------------------------------
   // [Statics]
@@ -8,6 +8,7 @@
 
 // [Dependencies - AsmJit]
 #include "../core/assert.h"
+#include "../core/intutil.h"
 #include "../core/lock.h"
 #include "../core/memorymanager.h"
 #include "../core/virtualmemory.h"
@@ -46,6 +47,19 @@
 //   Bits array shows that there are 12 allocated blocks of 64 bytes, so total 
 //   allocated size is 768 bytes. Maximum count of continuous blocks is 12
 //   (see largest gap).
+//
+// - Small blocks (up to kSlabMaxSize bytes, which covers most generated
+//   functions) don't use memory nodes. They are rounded up to a multiple of
+//   32 bytes (a size class) and allocated from slab pages - 4kB pages that
+//   each hold blocks of one size class. Pages are carved from slab chunks
+//   allocated the same way as memory nodes. Each size class keeps a list of
+//   pages with free blocks, each page a small bit array of used blocks, and
+//   pages are found from an address through a hash table, so both alloc()
+//   and free() of small blocks take constant time and many small functions
+//   share cache lines and pages. A chunk whose pages are all unused is
+//   returned to the system, except one spare chunk that is kept so code that
+//   compiles and frees one small function at a time doesn't map and unmap a
+//   chunk on every alloc() / free() pair.
 
 namespace AsmJit {
 
@@ -229,6 +243,57 @@ struct PermanentNode
   inline size_t getAvailable() const { return size - used; }
 };
 
+// ============================================================================
+// [AsmJit::SlabPage / SlabChunk]
+// ============================================================================
+
+enum
+{
+  // Size of a slab page (also its alignment, used by the page hash table).
+  kSlabPageSize = 4096,
+  // Size class granularity, also alignment of small blocks.
+  kSlabGranularity = 32,
+  // Largest block allocated from slabs.
+  kSlabMaxSize = 256,
+  // Count of size classes.
+  kSlabClassCount = kSlabMaxSize / kSlabGranularity,
+  // Count of 32-bit words in a page bit array.
+  kSlabBitWords = kSlabPageSize / kSlabGranularity / 32,
+  // Size class of a page not assigned to any class.
+  kSlabNoClass = 0xFFFFFFFF
+};
+
+struct SlabChunk;
+
+//! @brief Slab page, holds blocks of one size class.
+struct SlabPage
+{
+  uint8_t* mem;            // Page address.
+  SlabChunk* chunk;        // Chunk containing this page.
+  SlabPage* hashNext;      // Next page in the same hash bucket.
+  SlabPage* prev;          // Prev page in the class or free list.
+  SlabPage* next;          // Next page in the class or free list.
+
+  uint32_t sizeClass;      // Size class index or kSlabNoClass.
+  uint32_t blockSize;      // Size of one block.
+  uint32_t blocks;         // How many blocks are here.
+  uint32_t used;           // How many blocks are used.
+
+  uint32_t baUsed[kSlabBitWords]; // Contains bits about used blocks.
+};
+
+//! @brief Slab chunk, virtual memory split into slab pages.
+struct SlabChunk
+{
+  uint8_t* mem;            // Base pointer (virtual memory address).
+  size_t size;             // Count of bytes allocated.
+  size_t pageCount;        // Count of pages.
+  size_t pagesUsed;        // Count of pages assigned to a size class.
+  SlabPage* pages;         // Page descriptors.
+  SlabChunk* prev;         // Prev chunk.
+  SlabChunk* next;         // Next chunk.
+};
+
 // ============================================================================
 // [AsmJit::MemoryManagerPrivate]
 // ============================================================================
@@ -259,6 +324,38 @@ struct MemoryManagerPrivate
   bool shrink(void* address, size_t used);
   void freeAll(bool keepVirtualMemory);
 
+  // --------------------------------------------------------------------------
+  // [Slabs]
+  // --------------------------------------------------------------------------
+
+  void* allocSlab(size_t vsize);
+  bool freeSlab(SlabPage* page, void* address);
+
+  SlabPage* newSlabPage(uint32_t sizeClass);
+  SlabChunk* createSlabChunk();
+  void releaseSlabChunk(SlabChunk* chunk, bool keepVirtualMemory);
+
+  SlabPage* findSlabPage(void* address);
+  bool reserveSlabHash(size_t count);
+  void insertSlabHash(SlabPage* page);
+  void removeSlabHash(SlabPage* page);
+
+  static inline void listInsert(SlabPage** list, SlabPage* page)
+  {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list) (*list)->prev = page;
+    *list = page;
+  }
+
+  static inline void listRemove(SlabPage** list, SlabPage* page)
+  {
+    if (page->prev) page->prev->next = page->next; else *list = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = NULL;
+    page->next = NULL;
+  }
+
   // Helpers to avoid ifdefs in the code.
   inline uint8_t* allocVirtualMemory(size_t size, size_t* vsize)
   {
@@ -313,6 +410,16 @@ struct MemoryManagerPrivate
   // Permanent memory.
   PermanentNode* _permanent;
 
+  // Slabs.
+  size_t _slabChunkSize;                    // Default slab chunk size.
+  SlabChunk* _slabChunks;                   // List of slab chunks.
+  SlabPage* _slabPartial[kSlabClassCount];  // Pages with free blocks, per class.
+  SlabPage* _slabFree;                      // Pages not assigned to a class.
+  SlabChunk* _slabSpare;                    // Unused chunk kept for reuse.
+  SlabPage** _slabHash;                     // Page hash table, key is page address.
+  size_t _slabHashSize;                     // Count of buckets (power of 2).
+  size_t _slabHashCount;                    // Count of pages in the hash table.
+
   // Whether to keep virtual memory after destroy.
   bool _keepVirtualMemory;
 };
@@ -336,8 +443,16 @@ MemoryManagerPrivate::MemoryManagerPrivate(HANDLE hProcess) :
   _last(NULL),
   _optimal(NULL),
   _permanent(NULL),
+  _slabChunkSize(65536),
+  _slabChunks(NULL),
+  _slabFree(NULL),
+  _slabSpare(NULL),
+  _slabHash(NULL),
+  _slabHashSize(0),
+  _slabHashCount(0),
   _keepVirtualMemory(false)
 {
+  memset(_slabPartial, 0, sizeof(_slabPartial));
 }
 
 MemoryManagerPrivate::~MemoryManagerPrivate()
@@ -470,6 +585,11 @@ void* MemoryManagerPrivate::allocFreeable(size_t vsize)
   if (vsize == 0) return NULL;
 
   AutoLock locked(_lock);
+
+  // Small blocks come from slabs.
+  if (vsize <= kSlabMaxSize)
+    return allocSlab(vsize);
+
   MemNode* node = _optimal;
 
   minVSize = _newChunkSize;
@@ -585,6 +705,10 @@ bool MemoryManagerPrivate::free(void* address)
 
   AutoLock locked(_lock);
 
+  SlabPage* page = findSlabPage(address);
+  if (page != NULL)
+    return freeSlab(page, address);
+
   MemNode* node = findPtr((uint8_t*)address);
   if (node == NULL)
     return false;
@@ -671,6 +795,10 @@ bool MemoryManagerPrivate::shrink(void* address, size_t used)
 
   AutoLock locked(_lock);
 
+  // Small blocks keep their size class.
+  if (findSlabPage(address) != NULL)
+    return true;
+
   MemNode* node = findPtr((uint8_t*)address);
   if (node == NULL)
     return false;
@@ -759,6 +887,14 @@ void MemoryManagerPrivate::freeAll(bool keepVirtualMemory)
     node = next;
   }
 
+  while (_slabChunks)
+    releaseSlabChunk(_slabChunks, keepVirtualMemory);
+
+  ASMJIT_FREE(_slabHash);
+  _slabHash = NULL;
+  _slabHashSize = 0;
+  _slabHashCount = 0;
+
   _allocated = 0;
   _used = 0;
 
@@ -768,6 +904,274 @@ void MemoryManagerPrivate::freeAll(bool keepVirtualMemory)
   _optimal = NULL;
 }
 
+// ============================================================================
+// [AsmJit::MemoryManagerPrivate - Slabs]
+// ============================================================================
+
+// Allocates a block of vsize bytes (a multiple of kSlabGranularity) from
+// the first page of its size class that has a free block.
+void* MemoryManagerPrivate::allocSlab(size_t vsize)
+{
+  uint32_t sizeClass = (uint32_t)(vsize / kSlabGranularity) - 1;
+
+  SlabPage* page = _slabPartial[sizeClass];
+  if (page == NULL)
+  {
+    page = newSlabPage(sizeClass);
+    if (page == NULL) return NULL;
+  }
+
+  uint32_t i = 0;
+  while (page->baUsed[i] == 0xFFFFFFFF) i++;
+
+  uint32_t bitpos = IntUtil::findFirstBit(~page->baUsed[i]);
+  uint32_t index = i * 32 + bitpos;
+  ASMJIT_ASSERT(index < page->blocks);
+
+  page->baUsed[i] |= (uint32_t)1 << bitpos;
+  if (++page->used == page->blocks)
+    listRemove(&_slabPartial[sizeClass], page);
+
+  // Update statistics.
+  _used += page->blockSize;
+
+  return page->mem + index * page->blockSize;
+}
+
+bool MemoryManagerPrivate::freeSlab(SlabPage* page, void* address)
+{
+  if (page->sizeClass == kSlabNoClass)
+    return false;
+
+  size_t offset = (size_t)((uint8_t*)address - page->mem);
+  if (offset % page->blockSize != 0)
+    return false;
+
+  uint32_t index = (uint32_t)(offset / page->blockSize);
+  uint32_t bit = (uint32_t)1 << (index % 32);
+  uint32_t* bits = &page->baUsed[index / 32];
+
+  if ((*bits & bit) == 0)
+    return false;
+
+  *bits &= ~bit;
+
+  // Statistics.
+  _used -= page->blockSize;
+
+  // Full page has free block again.
+  if (page->used-- == page->blocks)
+    listInsert(&_slabPartial[page->sizeClass], page);
+
+  // Unused page goes back to the free list. When all pages of the chunk
+  // are unused the chunk is kept as a spare or, if there already is one,
+  // returned to the system.
+  if (page->used == 0)
+  {
+    SlabChunk* chunk = page->chunk;
+
+    listRemove(&_slabPartial[page->sizeClass], page);
+    page->sizeClass = kSlabNoClass;
+    listInsert(&_slabFree, page);
+
+    if (--chunk->pagesUsed == 0)
+    {
+      if (_slabSpare == NULL)
+        _slabSpare = chunk;
+      else
+        releaseSlabChunk(chunk, false);
+    }
+  }
+
+  return true;
+}
+
+// Assigns a free page (allocating new chunk if there is none) to a size
+// class.
+SlabPage* MemoryManagerPrivate::newSlabPage(uint32_t sizeClass)
+{
+  if (_slabFree == NULL && createSlabChunk() == NULL)
+    return NULL;
+
+  SlabPage* page = _slabFree;
+  listRemove(&_slabFree, page);
+
+  page->sizeClass = sizeClass;
+  page->blockSize = (sizeClass + 1) * kSlabGranularity;
+  page->blocks = kSlabPageSize / page->blockSize;
+  page->used = 0;
+  memset(page->baUsed, 0, sizeof(page->baUsed));
+
+  if (page->chunk->pagesUsed++ == 0 && page->chunk == _slabSpare)
+    _slabSpare = NULL;
+  listInsert(&_slabPartial[sizeClass], page);
+
+  return page;
+}
+
+SlabChunk* MemoryManagerPrivate::createSlabChunk()
+{
+  size_t vsize;
+  uint8_t* vmem = allocVirtualMemory(_slabChunkSize, &vsize);
+
+  // Out of memory.
+  if (vmem == NULL) return NULL;
+
+  size_t pageCount = vsize / kSlabPageSize;
+
+  SlabChunk* chunk = reinterpret_cast<SlabChunk*>(ASMJIT_MALLOC(sizeof(SlabChunk)));
+  SlabPage* pages = reinterpret_cast<SlabPage*>(ASMJIT_MALLOC(pageCount * sizeof(SlabPage)));
+
+  // Out of memory.
+  if (chunk == NULL || pages == NULL || !reserveSlabHash(_slabHashCount + pageCount))
+  {
+    freeVirtualMemory(vmem, vsize);
+    if (chunk) ASMJIT_FREE(chunk);
+    if (pages) ASMJIT_FREE(pages);
+    return NULL;
+  }
+
+  chunk->mem = vmem;
+  chunk->size = vsize;
+  chunk->pageCount = pageCount;
+  chunk->pagesUsed = 0;
+  chunk->pages = pages;
+
+  chunk->prev = NULL;
+  chunk->next = _slabChunks;
+  if (_slabChunks) _slabChunks->prev = chunk;
+  _slabChunks = chunk;
+
+  for (size_t i = 0; i < pageCount; i++)
+  {
+    SlabPage* page = &pages[i];
+
+    page->mem = vmem + i * kSlabPageSize;
+    page->chunk = chunk;
+    page->sizeClass = kSlabNoClass;
+
+    insertSlabHash(page);
+    listInsert(&_slabFree, page);
+  }
+
+  // Statistics.
+  _allocated += vsize;
+
+  return chunk;
+}
+
+void MemoryManagerPrivate::releaseSlabChunk(SlabChunk* chunk, bool keepVirtualMemory)
+{
+  for (size_t i = 0; i < chunk->pageCount; i++)
+  {
+    SlabPage* page = &chunk->pages[i];
+
+    if (page->sizeClass == kSlabNoClass)
+    {
+      listRemove(&_slabFree, page);
+    }
+    else
+    {
+      // Only reached from freeAll(), blocks are still in use.
+      _used -= page->used * page->blockSize;
+      if (page->used != page->blocks)
+        listRemove(&_slabPartial[page->sizeClass], page);
+    }
+
+    removeSlabHash(page);
+  }
+
+  if (chunk == _slabSpare)
+    _slabSpare = NULL;
+
+  if (chunk->prev) chunk->prev->next = chunk->next; else _slabChunks = chunk->next;
+  if (chunk->next) chunk->next->prev = chunk->prev;
+
+  if (!keepVirtualMemory)
+    freeVirtualMemory(chunk->mem, chunk->size);
+
+  // Statistics.
+  _allocated -= chunk->size;
+
+  ASMJIT_FREE(chunk->pages);
+  ASMJIT_FREE(chunk);
+}
+
+// ============================================================================
+// [AsmJit::MemoryManagerPrivate - Slab Page Hash]
+// ============================================================================
+
+static inline size_t slabHashIndex(const void* address, size_t hashSize)
+{
+  return ((size_t)address / kSlabPageSize) & (hashSize - 1);
+}
+
+SlabPage* MemoryManagerPrivate::findSlabPage(void* address)
+{
+  if (_slabHashCount == 0)
+    return NULL;
+
+  uint8_t* mem = (uint8_t*)((size_t)address & ~(size_t)(kSlabPageSize - 1));
+  SlabPage* page = _slabHash[slabHashIndex(mem, _slabHashSize)];
+
+  while (page && page->mem != mem)
+    page = page->hashNext;
+  return page;
+}
+
+// Grows the hash table to at least count buckets, keeping chains short.
+bool MemoryManagerPrivate::reserveSlabHash(size_t count)
+{
+  if (count <= _slabHashSize)
+    return true;
+
+  size_t newSize = _slabHashSize ? _slabHashSize : 64;
+  while (newSize < count) newSize *= 2;
+
+  SlabPage** newHash = reinterpret_cast<SlabPage**>(ASMJIT_MALLOC(newSize * sizeof(SlabPage*)));
+  if (newHash == NULL) return false;
+  memset(newHash, 0, newSize * sizeof(SlabPage*));
+
+  for (size_t i = 0; i < _slabHashSize; i++)
+  {
+    SlabPage* cur = _slabHash[i];
+    while (cur)
+    {
+      SlabPage* next = cur->hashNext;
+      size_t index = slabHashIndex(cur->mem, newSize);
+
+      cur->hashNext = newHash[index];
+      newHash[index] = cur;
+      cur = next;
+    }
+  }
+
+  ASMJIT_FREE(_slabHash);
+  _slabHash = newHash;
+  _slabHashSize = newSize;
+  return true;
+}
+
+// Table must have been reserved by reserveSlabHash().
+void MemoryManagerPrivate::insertSlabHash(SlabPage* page)
+{
+  size_t index = slabHashIndex(page->mem, _slabHashSize);
+  page->hashNext = _slabHash[index];
+  _slabHash[index] = page;
+  _slabHashCount++;
+}
+
+void MemoryManagerPrivate::removeSlabHash(SlabPage* page)
+{
+  SlabPage** prev = &_slabHash[slabHashIndex(page->mem, _slabHashSize)];
+
+  while (*prev != page)
+    prev = &(*prev)->hashNext;
+
+  *prev = page->hashNext;
+  _slabHashCount--;
+}
+
 // ============================================================================
 // [AsmJit::MemoryManagerPrivate - NodeList RB-Tree]
 // ============================================================================
@@ -832,12 +1236,15 @@ void MemoryManagerPrivate::insertNode(MemNode* node)
   }
   else
   {
-    // False tree root.
-    RbNode<MemNode> head = {0};
+    // False tree root. It's accessed through MemNode pointers, so it must
+    // be a MemNode - a plain RbNode accessed that way is aliasing violation
+    // and the optimizer is free to miss the writes to it.
+    MemNode head;
+    memset(&head, 0, sizeof(MemNode));
 
     // Grandparent & parent.
     MemNode* g = NULL;
-    MemNode* t = reinterpret_cast<MemNode*>(&head);
+    MemNode* t = &head;
 
     // Iterator & parent.
     MemNode* p = NULL;
@@ -908,11 +1315,12 @@ void MemoryManagerPrivate::insertNode(MemNode* node)
 
 MemNode* MemoryManagerPrivate::removeNode(MemNode* node)
 {
-  // False tree root.
-  RbNode<MemNode> head = {0}; 
+  // False tree root (a MemNode, see insertNode()).
+  MemNode head;
+  memset(&head, 0, sizeof(MemNode));
 
   // Helpers.
-  MemNode* q = reinterpret_cast<MemNode*>(&head);
+  MemNode* q = &head;
   MemNode* p = NULL;
   MemNode* g = NULL;
   // Found item.
@@ -977,8 +1385,8 @@ MemNode* MemoryManagerPrivate::removeNode(MemNode* node)
 
   // Replace and remove.
   ASMJIT_ASSERT(f != NULL);
-  ASMJIT_ASSERT(f != reinterpret_cast<MemNode*>(&head));
-  ASMJIT_ASSERT(q != reinterpret_cast<MemNode*>(&head));
+  ASMJIT_ASSERT(f != &head);
+  ASMJIT_ASSERT(q != &head);
 
   if (f != q) f->fillData(q);
   p->node[p->node[1] == q] = q->node[q->node[0] == NULL];
@@ -448,6 +448,93 @@ void X86Assembler::_emitMmu(uint32_t opCode, uint8_t rexw, uint8_t opReg,
     _emitModM(opReg, reinterpret_cast<const Mem&>(src), immSize);
 }
 
+bool X86Assembler::_emitFastSse(const X86InstInfo* id, const Operand& o0, const Operand& o1)
+{
+  uint32_t opCode;
+  uint8_t opReg;
+  const Operand* rm;
+
+  // XMM <- XMM|Mem (opcode0).
+  if (o0.isRegType(kX86RegTypeXmm) && (o1.isRegType(kX86RegTypeXmm) || o1.isMem()))
+  {
+    opCode = id->_opCode[0];
+    opReg = (uint8_t)reinterpret_cast<const Reg&>(o0).getRegCode();
+    rm = &o1;
+  }
+  // Mem <- XMM (opcode1, moves only).
+  else if (o0.isMem() && o1.isRegType(kX86RegTypeXmm) && id->getGroup() == kX86InstGroupMmuMov)
+  {
+    opCode = id->_opCode[1];
+    opReg = (uint8_t)reinterpret_cast<const Reg&>(o1).getRegCode();
+    rm = &o0;
+  }
+  else
+  {
+    return false;
+  }
+
+  // Check for buffer space (and grow if needed).
+  if (!canEmit())
+    return true;
+
+  // Register code or memory base, there is no segment prefix, no SIB index
+  // and no REX.W so only the REX.R and REX.B bits can be set. Other memory
+  // operands are encoded by _emitMmu().
+  uint8_t rmReg;
+  sysint_t disp = 0;
+
+  if (rm->isMem())
+  {
+    const Mem& mem = reinterpret_cast<const Mem&>(*rm);
+
+    if (mem.getMemType() != kOperandMemNative || !mem.hasBase() || mem.hasIndex() ||
+        mem.getSegment() < kX86RegNumSeg)
+    {
+      _emitMmu(opCode, 0, opReg, mem, 0);
+      return true;
+    }
+
+    rmReg = (uint8_t)mem.getBase();
+    disp = mem.getDisplacement();
+  }
+  else
+  {
+    rmReg = (uint8_t)reinterpret_cast<const Reg*>(rm)->getRegCode();
+  }
+
+  if (opCode & 0xFF000000) _emitByte((uint8_t)((opCode & 0xFF000000) >> 24));
+
+#if defined(ASMJIT_X64)
+  uint8_t rex = (uint8_t)(((opReg & 0x08) >> 1) | ((rmReg & 0x08) >> 3));
+  if (rex) _emitByte((uint8_t)(rex | 0x40));
+#endif // ASMJIT_X64
+
+  if (opCode & 0x00FF0000) _emitByte((uint8_t)((opCode & 0x00FF0000) >> 16));
+  _emitByte((uint8_t)((opCode & 0x0000FF00) >> 8));
+  _emitByte((uint8_t)((opCode & 0x000000FF)));
+
+  if (rm->isReg())
+  {
+    _emitModR(opReg, rmReg);
+    return true;
+  }
+
+  // [base + displacement], EBP/RBP/R13 (5) always needs a displacement and
+  // ESP/RSP/R12 (4) a SIB byte, see _emitModM().
+  uint8_t mod = (disp == 0 && (rmReg & 0x07) != 5) ? 0 : IntUtil::isInt8(disp) ? 1 : 2;
+
+  _emitMod(mod, opReg, rmReg);
+  if ((rmReg & 0x07) == 4)
+    _emitSib(0, 4, 4);
+
+  if (mod == 1)
+    _emitByte((int8_t)disp);
+  else if (mod == 2)
+    _emitInt32((int32_t)disp);
+
+  return true;
+}
+
 X86Assembler::LabelLink* X86Assembler::_emitDisplacement(
   LabelData& l_data, sysint_t inlinedDisplacement, int size)
 {
@@ -860,6 +947,19 @@ void X86Assembler::_emitInstruction(uint32_t code, const Operand* o0, const Oper
   ASMJIT_ASSERT(o1 != NULL);
   ASMJIT_ASSERT(o2 != NULL);
 
+  // Fast path for SSE arithmetic, compares and moves, which are most of the
+  // floating point code. These need only the operand type checks done by
+  // _emitFastSse(), logging and emit options are left to the generic path.
+  if (code < _kX86InstCount && x86InstInfo[code].isFastSse() &&
+      _logger == NULL && _emitOptions == 0 && o2->isNone())
+  {
+    if (_emitFastSse(&x86InstInfo[code], *o0, *o1))
+    {
+      _inlineComment = NULL;
+      return;
+    }
+  }
+
   const Operand* _loggerOperands[3];
 
   uint32_t bLoHiUsed = 0;
@@ -2662,7 +2762,9 @@ size_t X86Assembler::relocCode(void* _dst, sysuint_t addressBase) const
 
   // We are copying the exact size of the generated code. Extra code for trampolines
   // is generated on-the-fly by relocator (this code doesn't exist at the moment).
-  memcpy(dst, _buffer.getData(), coff);
+  // Code emitted in place (see reserveCode()) is already there.
+  if (dst != _buffer.getData())
+    memcpy(dst, _buffer.getData(), coff);
 
 #if defined(ASMJIT_X64)
   // Trampoline pointer.
@@ -488,6 +488,12 @@ struct X86Assembler : public Assembler
   //! @brief Emit MMX/SSE instruction.
   ASMJIT_API void _emitMmu(uint32_t opCode, uint8_t rexw, uint8_t opReg, const Operand& src, sysint_t immSize);
 
+  //! @brief Emit SSE instruction marked by @c kX86InstFlagFastSse.
+  //!
+  //! Returns @c false if operands are not XMM <- XMM|Mem or Mem <- XMM (move
+  //! only), the instruction must be emitted by the generic path then.
+  ASMJIT_API bool _emitFastSse(const X86InstInfo* id, const Operand& o0, const Operand& o1);
+
   //! @brief Emit displacement.
   ASMJIT_API LabelLink* _emitDisplacement(LabelData& l_data, sysint_t inlinedDisplacement, int size);
 
@@ -3671,17 +3677,17 @@ struct X86Assembler : public Assembler
 
   //! @brief Packed SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtps(const XmmReg& dst, const XmmReg& src)
-  { _emitInstruction(kX86InstSqrtPS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtPS, &dst, &src); }
   //! @brief Packed SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtps(const XmmReg& dst, const Mem& src)
-  { _emitInstruction(kX86InstSqrtPS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtPS, &dst, &src); }
 
   //! @brief Scalar SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtss(const XmmReg& dst, const XmmReg& src)
-  { _emitInstruction(kX86InstSqrtSS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtSS, &dst, &src); }
   //! @brief Scalar SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtss(const XmmReg& dst, const Mem& src)
-  { _emitInstruction(kX86InstSqrtSS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtSS, &dst, &src); }
 
   //! @brief Store fence (SSE).
   inline void sfence()
@@ -669,6 +669,9 @@ void* X86Compiler::make()
   x86Asm._properties = _properties;
   x86Asm.setLogger(_logger);
 
+  if (getProperty(kX86PropertyEmitInPlace))
+    x86Asm.reserveCode(getCodeSizeEstimate());
+
   serialize(x86Asm);
 
   if (this->getError())
@@ -693,6 +696,21 @@ void* X86Compiler::make()
   return result;
 }
 
+size_t X86Compiler::getCodeSizeEstimate() const
+{
+  // Prolog, epilog and a margin for instructions added by register
+  // allocation.
+  size_t size = 128;
+
+  for (CompilerItem* item = getFirstItem(); item != NULL; item = item->getNext())
+  {
+    int maxSize = item->getMaxSize();
+    size += maxSize >= 0 ? (size_t)maxSize : 15;
+  }
+
+  return size;
+}
+
 void X86Compiler::serialize(Assembler& a)
 {
   X86CompilerContext x86Context(this);
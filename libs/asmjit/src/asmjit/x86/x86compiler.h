@@ -1302,6 +1302,10 @@ struct X86Compiler : public Compiler
   //! @brief Method that will emit everything to @c Assembler instance @a a.
   ASMJIT_API virtual void serialize(Assembler& a);
 
+  //! @brief Estimate the size of serialized code, used to reserve memory
+  //! when @ref kX86PropertyEmitInPlace is set.
+  ASMJIT_API size_t getCodeSizeEstimate() const;
+
   // --------------------------------------------------------------------------
   // [Data]
   // --------------------------------------------------------------------------
@@ -4057,17 +4061,17 @@ struct X86Compiler : public Compiler
 
   //! @brief Packed SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtps(const XmmVar& dst, const XmmVar& src)
-  { _emitInstruction(kX86InstSqrtPS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtPS, &dst, &src); }
   //! @brief Packed SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtps(const XmmVar& dst, const Mem& src)
-  { _emitInstruction(kX86InstSqrtPS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtPS, &dst, &src); }
 
   //! @brief Scalar SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtss(const XmmVar& dst, const XmmVar& src)
-  { _emitInstruction(kX86InstSqrtSS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtSS, &dst, &src); }
   //! @brief Scalar SP-FP Square Root Reciprocal (SSE).
   inline void rsqrtss(const XmmVar& dst, const Mem& src)
-  { _emitInstruction(kX86InstSqrtSS, &dst, &src); }
+  { _emitInstruction(kX86InstRSqrtSS, &dst, &src); }
 
   //! @brief Store fence (SSE).
   inline void sfence()
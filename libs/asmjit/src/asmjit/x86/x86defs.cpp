@@ -1202,10 +1202,10 @@ const X86InstInfo x86InstInfo[] =
   INST(kInstNone                , ""                 , G(None)          , F(None)          , 0                   , 0                   , 0, 0         , 0),
   INST(kX86InstAdc              , "adc"              , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 2, 0x00000010, 0x00000080),
   INST(kX86InstAdd              , "add"              , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 0, 0x00000000, 0x00000080),
-  INST(kX86InstAddPD            , "addpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F58, 0),
-  INST(kX86InstAddPS            , "addps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F58, 0),
-  INST(kX86InstAddSD            , "addsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F58, 0),
-  INST(kX86InstAddSS            , "addss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F58, 0),
+  INST(kX86InstAddPD            , "addpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F58, 0),
+  INST(kX86InstAddPS            , "addps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F58, 0),
+  INST(kX86InstAddSD            , "addsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F58, 0),
+  INST(kX86InstAddSS            , "addss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F58, 0),
   INST(kX86InstAddSubPD         , "addsubpd"         , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000FD0, 0),
   INST(kX86InstAddSubPS         , "addsubps"         , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000FD0, 0),
   INST(kX86InstAmdPrefetch      , "amd_prefetch"     , G(Mem)           , F(None)          , O(Mem)              , 0                   , 0, 0x00000F0D, 0),
@@ -1213,8 +1213,8 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstAnd              , "and"              , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 4, 0x00000020, 0x00000080),
   INST(kX86InstAndnPD           , "andnpd"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F55, 0),
   INST(kX86InstAndnPS           , "andnps"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F55, 0),
-  INST(kX86InstAndPD            , "andpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F54, 0),
-  INST(kX86InstAndPS            , "andps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F54, 0),
+  INST(kX86InstAndPD            , "andpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F54, 0),
+  INST(kX86InstAndPS            , "andps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F54, 0),
   INST(kX86InstBlendPD          , "blendpd"          , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3A0D, 0),
   INST(kX86InstBlendPS          , "blendps"          , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3A0C, 0),
   INST(kX86InstBlendVPD         , "blendvpd"         , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3815, 0),
@@ -1272,8 +1272,8 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstCmpXCHG          , "cmpxchg"          , G(RmReg)         , F(Special)|F(Lockable), 0              , 0                   , 0, 0x00000FB0, 0),
   INST(kX86InstCmpXCHG16B       , "cmpxchg16b"       , G(Mem)           , F(Special)       , O(Mem)              , 0                   , 1, 0x00000FC7, 1 /* RexW */),
   INST(kX86InstCmpXCHG8B        , "cmpxchg8b"        , G(Mem)           , F(Special)       , O(Mem)              , 0                   , 1, 0x00000FC7, 0),
-  INST(kX86InstComISD           , "comisd"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F2F, 0),
-  INST(kX86InstComISS           , "comiss"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F2F, 0),
+  INST(kX86InstComISD           , "comisd"           , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F2F, 0),
+  INST(kX86InstComISS           , "comiss"           , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F2F, 0),
   INST(kX86InstCpuId            , "cpuid"            , G(Emit)          , F(Special)       , 0                   , 0                   , 0, 0x00000FA2, 0),
   INST(kX86InstCqo              , "cqo"              , G(Emit)          , F(Special)       , 0                   , 0                   , 0, 0x48000099, 0), // TODO, set RexW bit instead?
   INST(kX86InstCrc32            , "crc32"            , G(Crc32)         , F(None)          , O(Gqd)              , O(GqdwbMem)         , 0, 0xF20F38F0, 0),
@@ -1305,10 +1305,10 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstDas              , "das"              , G(Emit)          , F(Special)       , 0                   , 0                   , 0, 0x0000002F, 0),
   INST(kX86InstDec              , "dec"              , G(IncDec)        , F(Lockable)      , O(GqdwbMem)         , 0                   , 1, 0x00000048, 0x000000FE),
   INST(kX86InstDiv              , "div"              , G(Rm)            , F(Special)       , 0                   , 0                   , 6, 0x000000F6, 0),
-  INST(kX86InstDivPD            , "divpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5E, 0),
-  INST(kX86InstDivPS            , "divps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5E, 0),
-  INST(kX86InstDivSD            , "divsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5E, 0),
-  INST(kX86InstDivSS            , "divss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5E, 0),
+  INST(kX86InstDivPD            , "divpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5E, 0),
+  INST(kX86InstDivPS            , "divps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5E, 0),
+  INST(kX86InstDivSD            , "divsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5E, 0),
+  INST(kX86InstDivSS            , "divss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5E, 0),
   INST(kX86InstDpPD             , "dppd"             , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3A41, 0),
   INST(kX86InstDpPS             , "dpps"             , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3A40, 0),
   INST(kX86InstEmms             , "emms"             , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x00000F77, 0),
@@ -1457,19 +1457,19 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstLFence           , "lfence"           , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x000FAEE8, 0),
   INST(kX86InstMaskMovDQU       , "maskmovdqu"       , G(MmuRmI)        , F(Special)       , O(Xmm)              , O(Xmm)              , 0, 0x66000F57, 0),
   INST(kX86InstMaskMovQ         , "maskmovq"         , G(MmuRmI)        , F(Special)       , O(Mm)               , O(Mm)               , 0, 0x00000FF7, 0),
-  INST(kX86InstMaxPD            , "maxpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5F, 0),
-  INST(kX86InstMaxPS            , "maxps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5F, 0),
-  INST(kX86InstMaxSD            , "maxsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5F, 0),
-  INST(kX86InstMaxSS            , "maxss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5F, 0),
+  INST(kX86InstMaxPD            , "maxpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5F, 0),
+  INST(kX86InstMaxPS            , "maxps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5F, 0),
+  INST(kX86InstMaxSD            , "maxsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5F, 0),
+  INST(kX86InstMaxSS            , "maxss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5F, 0),
   INST(kX86InstMFence           , "mfence"           , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x000FAEF0, 0),
-  INST(kX86InstMinPD            , "minpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5D, 0),
-  INST(kX86InstMinPS            , "minps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5D, 0),
-  INST(kX86InstMinSD            , "minsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5D, 0),
-  INST(kX86InstMinSS            , "minss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5D, 0),
+  INST(kX86InstMinPD            , "minpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5D, 0),
+  INST(kX86InstMinPS            , "minps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5D, 0),
+  INST(kX86InstMinSD            , "minsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5D, 0),
+  INST(kX86InstMinSS            , "minss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5D, 0),
   INST(kX86InstMonitor          , "monitor"          , G(Emit)          , F(Special)       , 0                   , 0                   , 0, 0x000F01C8, 0),
   INST(kX86InstMov              , "mov"              , G(Mov)           , F(Mov)           , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 0, 0         , 0),
-  INST(kX86InstMovAPD           , "movapd"           , G(MmuMov)        , F(Mov)           , O(XmmMem)           , O(XmmMem)           , 0, 0x66000F28, 0x66000F29),
-  INST(kX86InstMovAPS           , "movaps"           , G(MmuMov)        , F(Mov)           , O(XmmMem)           , O(XmmMem)           , 0, 0x00000F28, 0x00000F29),
+  INST(kX86InstMovAPD           , "movapd"           , G(MmuMov)        , F(Mov)|F(FastSse), O(XmmMem)           , O(XmmMem)           , 0, 0x66000F28, 0x66000F29),
+  INST(kX86InstMovAPS           , "movaps"           , G(MmuMov)        , F(Mov)|F(FastSse), O(XmmMem)           , O(XmmMem)           , 0, 0x00000F28, 0x00000F29),
   INST(kX86InstMovBE            , "movbe"            , G(MovBE)         , F(Mov)           , O(Gqdw)|O(Mem)      , O(Gqdw)|O(Mem)      , 0, 0x000F38F0, 0x000F38F1),
   INST(kX86InstMovD             , "movd"             , G(MmuMovD)       , F(Mov)           , O(Gd)|O(MmXmmMem)   , O(Gd)|O(MmXmmMem)   , 0, 0         , 0),
   INST(kX86InstMovDDup          , "movddup"          , G(MmuMov)        , F(Mov)           , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F12, 0),
@@ -1492,29 +1492,29 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstMovNTQ           , "movntq"           , G(MmuMov)        , F(None)          , O(Mem)              , O(Mm)               , 0, 0         , 0x00000FE7),
   INST(kX86InstMovQ             , "movq"             , G(MmuMovQ)       , F(Mov)           , O(Gq)|O(MmXmmMem)   , O(Gq)|O(MmXmmMem)   , 0, 0         , 0),
   INST(kX86InstMovQ2DQ          , "movq2dq"          , G(MmuRmI)        , F(Mov)           , O(Xmm)              , O(Mm)               , 0, 0xF3000FD6, 0),
-  INST(kX86InstMovSD            , "movsd"            , G(MmuMov)        , F(None)          , O(XmmMem)           , O(XmmMem)           , 0, 0xF2000F10, 0xF2000F11),
+  INST(kX86InstMovSD            , "movsd"            , G(MmuMov)        , F(FastSse)       , O(XmmMem)           , O(XmmMem)           , 0, 0xF2000F10, 0xF2000F11),
   INST(kX86InstMovSHDup         , "movshdup"         , G(MmuRmI)        , F(Mov)           , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F16, 0),
   INST(kX86InstMovSLDup         , "movsldup"         , G(MmuRmI)        , F(Mov)           , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F12, 0),
-  INST(kX86InstMovSS            , "movss"            , G(MmuMov)        , F(None)          , O(XmmMem)           , O(XmmMem)           , 0, 0xF3000F10, 0xF3000F11),
+  INST(kX86InstMovSS            , "movss"            , G(MmuMov)        , F(FastSse)       , O(XmmMem)           , O(XmmMem)           , 0, 0xF3000F10, 0xF3000F11),
   INST(kX86InstMovSX            , "movsx"            , G(MovSxMovZx)    , F(None)          , O(Gqdw)             , O(GwbMem)           , 0, 0x00000FBE, 0),
   INST(kX86InstMovSXD           , "movsxd"           , G(MovSxD)        , F(None)          , O(Gq)               , O(GdMem)            , 0, 0         , 0),
-  INST(kX86InstMovUPD           , "movupd"           , G(MmuMov)        , F(Mov)           , O(XmmMem)           , O(XmmMem)           , 0, 0x66000F10, 0x66000F11),
-  INST(kX86InstMovUPS           , "movups"           , G(MmuMov)        , F(Mov)           , O(XmmMem)           , O(XmmMem)           , 0, 0x00000F10, 0x00000F11),
+  INST(kX86InstMovUPD           , "movupd"           , G(MmuMov)        , F(Mov)|F(FastSse), O(XmmMem)           , O(XmmMem)           , 0, 0x66000F10, 0x66000F11),
+  INST(kX86InstMovUPS           , "movups"           , G(MmuMov)        , F(Mov)|F(FastSse), O(XmmMem)           , O(XmmMem)           , 0, 0x00000F10, 0x00000F11),
   INST(kX86InstMovZX            , "movzx"            , G(MovSxMovZx)    , F(Mov)           , O(Gqdw)             , O(GwbMem)           , 0, 0x00000FB6, 0),
   INST(kX86InstMovPtr           , "mov_ptr"          , G(MovPtr)        , F(Mov)|F(Special), O(Gqdwb)            , O(Imm)              , 0, 0         , 0),
   INST(kX86InstMPSADBW          , "mpsadbw"          , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x660F3A42, 0),
   INST(kX86InstMul              , "mul"              , G(Rm)            , F(Special)       , 0                   , 0                   , 4, 0x000000F6, 0),
-  INST(kX86InstMulPD            , "mulpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F59, 0),
-  INST(kX86InstMulPS            , "mulps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F59, 0),
-  INST(kX86InstMulSD            , "mulsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F59, 0),
-  INST(kX86InstMulSS            , "mulss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F59, 0),
+  INST(kX86InstMulPD            , "mulpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F59, 0),
+  INST(kX86InstMulPS            , "mulps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F59, 0),
+  INST(kX86InstMulSD            , "mulsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F59, 0),
+  INST(kX86InstMulSS            , "mulss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F59, 0),
   INST(kX86InstMWait            , "mwait"            , G(Emit)          , F(Special)       , 0                   , 0                   , 0, 0x000F01C9, 0),
   INST(kX86InstNeg              , "neg"              , G(Rm)            , F(Lockable)      , O(GqdwbMem)         , 0                   , 3, 0x000000F6, 0),
   INST(kX86InstNop              , "nop"              , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x00000090, 0),
   INST(kX86InstNot              , "not"              , G(Rm)            , F(Lockable)      , O(GqdwbMem)         , 0                   , 2, 0x000000F6, 0),
   INST(kX86InstOr               , "or"               , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 1, 0x00000008, 0x00000080),
-  INST(kX86InstOrPD             , "orpd"             , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F56, 0),
-  INST(kX86InstOrPS             , "orps"             , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F56, 0),
+  INST(kX86InstOrPD             , "orpd"             , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F56, 0),
+  INST(kX86InstOrPS             , "orps"             , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F56, 0),
   INST(kX86InstPAbsB            , "pabsb"            , G(MmuRmI)        , F(None)          , O(MmXmm)            , O(MmXmmMem)         , 0, 0x000F381C, 0),
   INST(kX86InstPAbsD            , "pabsd"            , G(MmuRmI)        , F(None)          , O(MmXmm)            , O(MmXmmMem)         , 0, 0x000F381E, 0),
   INST(kX86InstPAbsW            , "pabsw"            , G(MmuRmI)        , F(None)          , O(MmXmm)            , O(MmXmmMem)         , 0, 0x000F381D, 0),
@@ -1753,21 +1753,21 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstShrd             , "shrd"             , G(ShldShrd)      , F(Special)       , O(GqdwbMem)         , O(Gqdwb)            , 0, 0x00000FAC, 0),
   INST(kX86InstShufPD           , "shufpd"           , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000FC6, 0),
   INST(kX86InstShufPS           , "shufps"           , G(MmuRmImm8)     , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000FC6, 0),
-  INST(kX86InstSqrtPD           , "sqrtpd"           , G(MmuRmI)        , F(Mov)           , O(Xmm)              , O(XmmMem)           , 0, 0x66000F51, 0),
-  INST(kX86InstSqrtPS           , "sqrtps"           , G(MmuRmI)        , F(Mov)           , O(Xmm)              , O(XmmMem)           , 0, 0x00000F51, 0),
-  INST(kX86InstSqrtSD           , "sqrtsd"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F51, 0),
-  INST(kX86InstSqrtSS           , "sqrtss"           , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F51, 0),
+  INST(kX86InstSqrtPD           , "sqrtpd"           , G(MmuRmI)        , F(Mov)|F(FastSse), O(Xmm)              , O(XmmMem)           , 0, 0x66000F51, 0),
+  INST(kX86InstSqrtPS           , "sqrtps"           , G(MmuRmI)        , F(Mov)|F(FastSse), O(Xmm)              , O(XmmMem)           , 0, 0x00000F51, 0),
+  INST(kX86InstSqrtSD           , "sqrtsd"           , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F51, 0),
+  INST(kX86InstSqrtSS           , "sqrtss"           , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F51, 0),
   INST(kX86InstStc              , "stc"              , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x000000F9, 0),
   INST(kX86InstStd              , "std"              , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x000000FD, 0),
   INST(kX86InstStMXCSR          , "stmxcsr"          , G(Mem)           , F(None)          , O(Mem)              , 0                   , 3, 0x00000FAE, 0),
   INST(kX86InstSub              , "sub"              , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 5, 0x00000028, 0x00000080),
-  INST(kX86InstSubPD            , "subpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5C, 0),
-  INST(kX86InstSubPS            , "subps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5C, 0),
-  INST(kX86InstSubSD            , "subsd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5C, 0),
-  INST(kX86InstSubSS            , "subss"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5C, 0),
+  INST(kX86InstSubPD            , "subpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F5C, 0),
+  INST(kX86InstSubPS            , "subps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F5C, 0),
+  INST(kX86InstSubSD            , "subsd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF2000F5C, 0),
+  INST(kX86InstSubSS            , "subss"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0xF3000F5C, 0),
   INST(kX86InstTest             , "test"             , G(Test)          , F(None)          , O(GqdwbMem)         , O(Gqdwb)|O(Imm)     , 0, 0         , 0),
-  INST(kX86InstUComISD          , "ucomisd"          , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F2E, 0),
-  INST(kX86InstUComISS          , "ucomiss"          , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F2E, 0),
+  INST(kX86InstUComISD          , "ucomisd"          , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F2E, 0),
+  INST(kX86InstUComISS          , "ucomiss"          , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F2E, 0),
   INST(kX86InstUd2              , "ud2"              , G(Emit)          , F(None)          , 0                   , 0                   , 0, 0x00000F0B, 0),
   INST(kX86InstUnpckHPD         , "unpckhpd"         , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F15, 0),
   INST(kX86InstUnpckHPS         , "unpckhps"         , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F15, 0),
@@ -1776,8 +1776,8 @@ const X86InstInfo x86InstInfo[] =
   INST(kX86InstXadd             , "xadd"             , G(RmReg)         , F(Lockable)      , O(GqdwbMem)         , O(Gqdwb)            , 0, 0x00000FC0, 0),
   INST(kX86InstXchg             , "xchg"             , G(Xchg)          , F(Lockable)      , O(GqdwbMem)         , O(Gqdwb)            , 0, 0         , 0),
   INST(kX86InstXor              , "xor"              , G(Arith)         , F(Lockable)      , O(GqdwbMem)         , O(GqdwbMem)|O(Imm)  , 6, 0x00000030, 0x00000080),
-  INST(kX86InstXorPD            , "xorpd"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x66000F57, 0),
-  INST(kX86InstXorPS            , "xorps"            , G(MmuRmI)        , F(None)          , O(Xmm)              , O(XmmMem)           , 0, 0x00000F57, 0)
+  INST(kX86InstXorPD            , "xorpd"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x66000F57, 0),
+  INST(kX86InstXorPS            , "xorps"            , G(MmuRmI)        , F(FastSse)       , O(Xmm)              , O(XmmMem)           , 0, 0x00000F57, 0)
 };
 
 #undef G
@@ -118,7 +118,14 @@ enum kX86Property
   //! @brief Emit hints added to jcc() instructions.
   //!
   //! Default: @c true.
-  kX86PropertyJumpHints = 1
+  kX86PropertyJumpHints = 1,
+
+  //! @brief Make @ref X86Compiler emit directly into executable memory
+  //! reserved from an estimate of the code size (see
+  //! @c Assembler::reserveCode()), avoiding the final copy.
+  //!
+  //! Default: @c false.
+  kX86PropertyEmitInPlace = 2
 };
 
 // ============================================================================
@@ -1478,7 +1485,13 @@ enum kX86InstFlags
   //! This flag is always combined with @c kX86InstFlagSpecial and signalizes
   //! that there is an implicit address which is accessed (usually EDI/RDI or
   //! ESI/EDI).
-  kX86InstFlagSpecialMem = 0x20
+  kX86InstFlagSpecialMem = 0x20,
+
+  //! @brief Instruction is SSE arithmetic, compare or move which the
+  //! @c X86Assembler encodes by its fast path if all operands are XMM
+  //! registers or a memory operand (see @c kX86InstGroupMmuRmI and
+  //! @c kX86InstGroupMmuMov).
+  kX86InstFlagFastSse = 0x40
 };
 
 // ============================================================================
@@ -1600,6 +1613,10 @@ struct X86InstInfo
   inline bool isSpecialMem() const
   { return (_flags & kX86InstFlagSpecialMem) != 0; }
 
+  //! @brief Get whether the instruction can be encoded by the SSE fast path.
+  inline bool isFastSse() const
+  { return (_flags & kX86InstFlagFastSse) != 0; }
+
   // --------------------------------------------------------------------------
   // [Members]
   // --------------------------------------------------------------------------
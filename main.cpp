@@ -11,13 +11,36 @@
 #include <list>
 #include <iostream>
 #include <map>
+#include <set>
 #include <functional>
 #include <algorithm>
 #include <cctype>
 #include <cstdlib>
 #include <cmath>
 #include <stdexcept>
+#include <exception>
 #include <chrono>
+#include <memory>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <deque>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+
+#include <xmmintrin.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 #include <asmjit/asmjit.h>
 
@@ -56,7 +79,10 @@ public:
     Visitor(){
     }
 
-    EvalReturn eval(const Cell &c){
+    virtual ~Visitor(){
+    }
+
+    virtual EvalReturn eval(const Cell &c){
         switch(c.type){
             case Cell::Number:{
                 return numberHandler(c.val.c_str());
@@ -95,6 +121,7 @@ public:
         functionMap["-"] = [](const std::vector<double> &d){return d[0] - d[1];};
         functionMap["/"] = [](const std::vector<double> &d){return d[0] / d[1];};
         functionMap["*"] = [](const std::vector<double> &d){return d[0] * d[1];};
+        functionMap["sqrt"] = [](const std::vector<double> &d){return std::sqrt(d[0]);};
 
         numberHandler = [](const std::string &number){
             return std::atof(number.c_str());
@@ -102,18 +129,204 @@ public:
     }
 };
 
+// Records timed events from any thread and writes them as Chrome
+// trace-event JSON (viewable in chrome://tracing or Perfetto) when the
+// process exits. Each thread appends to its own buffer, so recording only
+// takes a lock on a thread's first event. Disabled until start() is called.
+class Tracer{
+private:
+    struct Event{
+        const char *name;
+        const char *category;
+        uint64_t begin; // ns since the tracer was created.
+        uint64_t end;
+    };
+
+    struct ThreadBuffer{
+        size_t thread;
+        std::vector<Event> events;
+    };
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::atomic<bool> enabled;
+    std::string path;
+    std::chrono::steady_clock::time_point origin;
+
+    Tracer() : enabled(false), origin(std::chrono::steady_clock::now()) {}
+
+    ThreadBuffer &threadBuffer(){
+        static thread_local ThreadBuffer *buffer = nullptr;
+        if(!buffer){
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+            buffer = buffers.back().get();
+            buffer->thread = buffers.size();
+        }
+        return *buffer;
+    }
+
+public:
+    static Tracer &global(){
+        static Tracer tracer;
+        return tracer;
+    }
+
+    ~Tracer(){
+        if(!path.empty()){
+            std::ofstream out(path);
+            write(out);
+        }
+    }
+
+    // Start recording; the trace is written to path at exit.
+    void start(const std::string &path){
+        this->path = path;
+        enabled = true;
+    }
+
+    // Stop recording; events recorded so far are kept.
+    void stop(){
+        enabled = false;
+    }
+
+    bool isEnabled() const { return enabled; }
+
+    uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // name and category must be string literals (they are not copied).
+    void record(const char *name, const char *category, uint64_t begin, uint64_t end){
+        Event e = {name, category, begin, end};
+        threadBuffer().events.push_back(e);
+    }
+
+    // Call once recording threads are idle. Times are in microseconds with
+    // all nanosecond digits, so nesting survives long runs.
+    void write(std::ostream &out){
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(3);
+        out << "{\"traceEvents\":[";
+        const char *separator = "\n";
+        for(const std::unique_ptr<ThreadBuffer> &b : buffers){
+            for(const Event &e : b->events){
+                out << separator << "{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category
+                    << "\",\"ph\":\"X\",\"ts\":" << e.begin / 1000.0
+                    << ",\"dur\":" << (e.end - e.begin) / 1000.0
+                    << ",\"pid\":1,\"tid\":" << b->thread << "}";
+                separator = ",\n";
+            }
+        }
+        out << "\n]}\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+};
+
+// Records the enclosing scope as one trace event.
+class TraceScope{
+private:
+    const char *name;
+    const char *category;
+    uint64_t begin;
+    bool active;
+public:
+    TraceScope(const char *name, const char *category)
+        : name(name), category(category), begin(0), active(Tracer::global().isEnabled()){
+        if(active)
+            begin = Tracer::global().now();
+    }
+
+    ~TraceScope(){
+        if(active)
+            Tracer::global().record(name, category, begin, Tracer::global().now());
+    }
+};
+
+// Floating point options shared by the interpreter and code generators.
+struct CompileOptions{
+    // Flush denormal results to zero and treat denormal inputs as zero (the
+    // FTZ and DAZ bits of MXCSR) while the function runs. Denormal operands
+    // make mulsd/divsd microcoded and up to 100x slower.
+    bool flushDenormals;
+    // Replace division and square root with single precision rcp/rsqrt
+    // estimates (about 11 bits) refined by fastMathRefinements Newton-Raphson
+    // steps, each doubling the correct bits (2 steps: ~44 bits, 3: ~full
+    // double). Also reassociates division chains into one division.
+    // Operands beyond float range act as their float conversion (0 or
+    // infinity). The interpreter stays exact.
+    bool fastMath;
+    int fastMathRefinements;
+    // Scalar JIT only: evaluate pairs of identically shaped subtrees, e.g.
+    // the two products in (+ (* a b) (* c d)), in the two lanes of one
+    // register. Results are bit identical to unpaired code. Off by default:
+    // it only shortens latency when both subtrees are long enough to hide
+    // the lane shuffles.
+    bool vectorizeSubtrees;
+    // Instrument generated code with per-thread counters (see KernelProfile):
+    // call counts only, or also rdtsc cycle counts for one call in every
+    // profileSamplePeriod (a power of two).
+    enum ProfileMode {ProfileOff, ProfileCalls, ProfileCycles};
+    ProfileMode profile;
+    unsigned int profileSamplePeriod;
+    // Scalar JIT only: record which sub-expression produced each
+    // instruction (see SourceMap).
+    bool sourceMap;
+    // Assemble straight into executable memory reserved from an upper bound
+    // of the code size, saving a buffer and a copy per compilation. Code
+    // outgrowing the reservation is copied as usual. Reservations are too
+    // large for the small block slabs, so turn this off when packing many
+    // tiny functions matters more than compile time.
+    bool emitInPlace;
+
+    CompileOptions() : flushDenormals(false), fastMath(false), fastMathRefinements(2),
+                       vectorizeSubtrees(false), profile(ProfileOff), profileSamplePeriod(64),
+                       sourceMap(false), emitInPlace(true) {}
+};
+
+static const unsigned int mxcsrFlushDenormals = 0x8040; // FTZ | DAZ
+static const unsigned int mxcsrRoundingMask = 0x6000;   // RC
+static const unsigned int mxcsrRoundUp = 0x4000;        // RC = toward +inf
+static const unsigned int mxcsrExceptionFlags = 0x3f;   // IE DE ZE OE UE PE
+
+// Sets FTZ/DAZ for its lifetime if enabled (the interpreter's equivalent of
+// the generated MXCSR prologue/epilogue).
+class ScopedFloatMode{
+private:
+    bool enabled;
+    unsigned int saved;
+public:
+    explicit ScopedFloatMode(const CompileOptions &options) : enabled(options.flushDenormals), saved(0){
+        if(enabled){
+            saved = _mm_getcsr();
+            _mm_setcsr(saved | mxcsrFlushDenormals);
+        }
+    }
+    ~ScopedFloatMode(){
+        if(enabled)
+            _mm_setcsr(saved);
+    }
+};
+
 // Extend calculator above into function evaluator.
 class CalculatorFunction : public Calculator{
 private:
     std::map<std::string, int> argNameToIndex;
     Cell cell;
+    CompileOptions options;
 public:
-    CalculatorFunction(const std::vector<std::string> &names, const Cell &c) : cell(c){
+    CalculatorFunction(const std::vector<std::string> &names, const Cell &c,
+                       const CompileOptions &options = CompileOptions()) : cell(c), options(options){
         for(size_t i = 0; i < names.size(); ++i)
             argNameToIndex[names[i]] = i;
     }
 
     double operator()(const std::vector<double> &args){
+        ScopedFloatMode floatMode(options);
         symbolHandler = [&](const std::string &name) -> double{
             return args[this->argNameToIndex[name]];	
         };
@@ -121,6 +334,579 @@ public:
     }
 };
 
+// Stack machine version of CalculatorFunction: the tree is flattened once
+// into postfix instructions, so evaluation avoids the interpreter's map
+// lookups, std::function calls and vector allocations without paying for
+// machine code generation.
+class BytecodeFunction{
+private:
+    enum Opcode {PushArg, PushConst, Add, Sub, Mul, Div, Sqrt};
+    struct Instruction{
+        Opcode op;
+        size_t arg;
+        double value;
+    };
+
+    std::vector<Instruction> code;
+    size_t maxDepth;
+    CompileOptions options;
+
+public:
+    BytecodeFunction(const std::vector<std::string> &names, const Cell &c,
+                     const CompileOptions &options = CompileOptions()) : maxDepth(0), options(options){
+        std::map<std::string, size_t> argNameToIndex;
+        for(size_t i = 0; i < names.size(); ++i)
+            argNameToIndex[names[i]] = i;
+        size_t depth = 0;
+        compile(c, argNameToIndex, depth);
+    }
+
+    double operator()(const std::vector<double> &args) const {
+        ScopedFloatMode floatMode(options);
+        // Only the result slot is initialised; the rest is written before
+        // it is read and clearing it would cost more than the evaluation.
+        double local[32];
+        local[0] = 0;
+        std::vector<double> heap;
+        double *stack = local;
+        if(maxDepth > 32){
+            heap.resize(maxDepth);
+            stack = &heap[0];
+        }
+
+        size_t top = 0;
+        for(const Instruction &i : code){
+            switch(i.op){
+                case PushArg: stack[top++] = args[i.arg]; break;
+                case PushConst: stack[top++] = i.value; break;
+                case Add: --top; stack[top-1] += stack[top]; break;
+                case Sub: --top; stack[top-1] -= stack[top]; break;
+                case Mul: --top; stack[top-1] *= stack[top]; break;
+                case Div: --top; stack[top-1] /= stack[top]; break;
+                case Sqrt: stack[top-1] = std::sqrt(stack[top-1]); break;
+            }
+        }
+        return stack[0];
+    }
+
+private:
+    void compile(const Cell &c, const std::map<std::string, size_t> &argNameToIndex, size_t &depth){
+        Instruction i = {PushConst, 0, 0.0};
+        switch(c.type){
+            case Cell::Number:
+                i.value = std::atof(c.val.c_str());
+                break;
+            case Cell::Symbol:
+                if(argNameToIndex.find(c.val) == argNameToIndex.end())
+                    throw std::runtime_error("Cannot handle symbol: " + c.val);
+                i.op = PushArg;
+                i.arg = argNameToIndex.at(c.val);
+                break;
+            case Cell::List:{
+                const std::string &op = c.list[0].val;
+                size_t arity = op == "sqrt" ? 1 : 2;
+                if(c.list.size() != arity + 1 ||
+                   (op != "+" && op != "-" && op != "*" && op != "/" && op != "sqrt"))
+                    throw std::runtime_error("Could not handle procedure: " + op);
+                for(size_t a = 1; a < c.list.size(); ++a)
+                    compile(c.list[a], argNameToIndex, depth);
+                i.op = op == "+" ? Add : op == "-" ? Sub : op == "*" ? Mul : op == "/" ? Div : Sqrt;
+                code.push_back(i);
+                depth -= arity - 1;
+                return;
+            }
+        }
+        code.push_back(i);
+        maxDepth = std::max(maxDepth, ++depth);
+    }
+};
+
+// Emit code clearing then setting bits of MXCSR. Returns a variable holding
+// the caller's MXCSR for emitRestoreMxcsr. Both slots are only ever accessed
+// as memory: the register allocator does not write back a register copy
+// before a .m32() use.
+AsmJit::GpVar emitUpdateMxcsr(AsmJit::X86Compiler &c, unsigned int clear, unsigned int set){
+    using namespace AsmJit;
+    GpVar saved(c.newGpVar(kX86VarTypeGpd));
+    GpVar mode(c.newGpVar(kX86VarTypeGpd));
+    GpVar tmp(c.newGpVar(kX86VarTypeGpd));
+    c.stmxcsr(saved.m32());
+    c.mov(tmp, saved.m32());
+    if(clear)
+        c.and_(tmp, imm(~sysint_t(clear)));
+    c.or_(tmp, imm(set));
+    c.mov(mode.m32(), tmp);
+    c.unuse(tmp);
+    c.ldmxcsr(mode.m32());
+    return saved;
+}
+
+// Emit code setting FTZ/DAZ in MXCSR.
+AsmJit::GpVar emitFlushDenormals(AsmJit::X86Compiler &c){
+    return emitUpdateMxcsr(c, 0, mxcsrFlushDenormals);
+}
+
+// Restore the saved MXCSR, keeping the exception flags raised since: they
+// are sticky for the caller.
+void emitRestoreMxcsr(AsmJit::X86Compiler &c, const AsmJit::GpVar &saved){
+    using namespace AsmJit;
+    GpVar mode(c.newGpVar(kX86VarTypeGpd));
+    GpVar tmp(c.newGpVar(kX86VarTypeGpd));
+    c.stmxcsr(mode.m32());
+    c.mov(tmp, mode.m32());
+    c.and_(tmp, imm(mxcsrExceptionFlags));
+    c.or_(tmp, saved.m32());
+    c.mov(mode.m32(), tmp);
+    c.unuse(tmp);
+    c.ldmxcsr(mode.m32());
+}
+
+// Counters written by instrumented generated code, one cache line per
+// thread so threads never share a line. rows is only counted by batch
+// kernels.
+struct KernelCounters{
+    uint64_t calls;
+    uint64_t rows;
+    uint64_t sampledCalls;
+    uint64_t cycles;
+    uint64_t padding[4];
+};
+
+// Totals over all threads' KernelCounters.
+struct ProfileSnapshot{
+    uint64_t calls;
+    uint64_t rows;
+    uint64_t sampledCalls;
+    uint64_t cycles;
+
+    // Cycles over all calls, extrapolated from the sampled ones.
+    double estimatedCycles() const {
+        return sampledCalls ? double(cycles) * calls / sampledCalls : 0.0;
+    }
+};
+
+// Per-function counter slots. Each thread writes its own slot without
+// atomics; with more threads than slots some share a slot and counts
+// become approximate.
+class KernelProfile{
+private:
+    static const size_t slotCount = 64;
+    KernelCounters *slots;
+
+    KernelProfile(const KernelProfile &);
+    KernelProfile &operator=(const KernelProfile &);
+public:
+    KernelProfile() : slots(nullptr){
+        void *p = nullptr;
+        if(posix_memalign(&p, 64, slotCount * sizeof(KernelCounters)) != 0)
+            throw std::bad_alloc();
+        slots = static_cast<KernelCounters *>(p);
+        reset();
+    }
+
+    ~KernelProfile(){
+        std::free(slots);
+    }
+
+    KernelCounters *slot() const {
+        static std::atomic<size_t> nextThread(0);
+        static thread_local size_t thread = nextThread++;
+        return &slots[thread % slotCount];
+    }
+
+    ProfileSnapshot snapshot() const {
+        ProfileSnapshot total = {0, 0, 0, 0};
+        for(size_t i = 0; i < slotCount; ++i){
+            total.calls += slots[i].calls;
+            total.rows += slots[i].rows;
+            total.sampledCalls += slots[i].sampledCalls;
+            total.cycles += slots[i].cycles;
+        }
+        return total;
+    }
+
+    void reset(){
+        std::fill(reinterpret_cast<char *>(slots), reinterpret_cast<char *>(slots + slotCount), 0);
+    }
+};
+
+// Mask of the call counter bits that select one call in every
+// profileSamplePeriod for timing.
+unsigned int profileSampleMask(const CompileOptions &options){
+    unsigned int period = options.profileSamplePeriod;
+    if(period == 0 || (period & (period - 1)) != 0)
+        throw std::runtime_error("profileSamplePeriod must be a power of two, not " + std::to_string(period));
+    return period - 1;
+}
+
+// Emit the counting prologue. Returns the start timestamp for
+// emitProfileLeave, which is only meaningful on sampled calls.
+AsmJit::GpVar emitProfileEnter(AsmJit::X86Compiler &c, const AsmJit::GpVar &slot,
+                               const CompileOptions &options){
+    using namespace AsmJit;
+    GpVar start(c.newGpVar());
+    c.add(qword_ptr(slot, offsetof(KernelCounters, calls)), imm(1));
+    if(options.profile != CompileOptions::ProfileCycles)
+        return start;
+
+    Label L_NoSample(c.newLabel());
+    GpVar high(c.newGpVar());
+    c.xor_(start, start);
+    c.test(qword_ptr(slot, offsetof(KernelCounters, calls)), imm(profileSampleMask(options)));
+    c.jnz(L_NoSample);
+    c.rdtsc(high, start);
+    c.shl(high, imm(32));
+    c.or_(start, high);
+    c.bind(L_NoSample);
+    c.unuse(high);
+    return start;
+}
+
+// Emit the counting epilogue; rows may be an invalid variable for scalar
+// functions.
+void emitProfileLeave(AsmJit::X86Compiler &c, const AsmJit::GpVar &slot, const AsmJit::GpVar &start,
+                      const AsmJit::GpVar *rows, const CompileOptions &options){
+    using namespace AsmJit;
+    if(rows)
+        c.add(qword_ptr(slot, offsetof(KernelCounters, rows)), *rows);
+    if(options.profile != CompileOptions::ProfileCycles)
+        return;
+
+    Label L_NoSample(c.newLabel());
+    GpVar high(c.newGpVar());
+    GpVar low(c.newGpVar());
+    c.test(qword_ptr(slot, offsetof(KernelCounters, calls)), imm(profileSampleMask(options)));
+    c.jnz(L_NoSample);
+    c.rdtsc(high, low);
+    c.shl(high, imm(32));
+    c.or_(low, high);
+    c.sub(low, start);
+    c.add(qword_ptr(slot, offsetof(KernelCounters, cycles)), low);
+    c.add(qword_ptr(slot, offsetof(KernelCounters, sampledCalls)), imm(1));
+    c.bind(L_NoSample);
+    c.unuse(high);
+    c.unuse(low);
+}
+
+// Print a cell back in lisp syntax.
+std::string formatCell(const Cell &c){
+    if(c.type != Cell::List)
+        return c.val;
+    std::string s = "(";
+    for(size_t i = 0; i < c.list.size(); ++i)
+        s += (i ? " " : "") + formatCell(c.list[i]);
+    return s + ")";
+}
+
+// Maps generated code back to the sub-expressions that produced it. Nodes
+// are numbered in evaluation order; code emitted for a node outside its
+// children's code (the operator itself, spills) belongs to that node.
+class SourceMap{
+public:
+    struct Node{
+        std::string expr;
+        size_t depth;
+    };
+
+    // One line of the disassembly; instructions cover [begin, end).
+    struct Line{
+        size_t begin;
+        size_t end;
+        int node;
+        std::string text;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Line> lines;
+    const char *code;
+    size_t codeSize;
+
+    SourceMap() : code(nullptr), codeSize(0) {}
+
+    // The node whose code contains offset, or -1.
+    int nodeAt(size_t offset) const {
+        for(const Line &l : lines)
+            if(offset >= l.begin && offset < l.end)
+                return l.node;
+        return -1;
+    }
+
+    // Sample counts per node from instruction addresses (for example the
+    // ip field of "perf script" output). Addresses outside the code are
+    // ignored.
+    std::vector<uint64_t> attribute(const std::vector<uint64_t> &addresses) const {
+        std::vector<uint64_t> samples(nodes.size(), 0);
+        uint64_t base = reinterpret_cast<uint64_t>(code);
+        for(uint64_t a : addresses){
+            int node = a >= base ? nodeAt(size_t(a - base)) : -1;
+            if(node >= 0)
+                ++samples[node];
+        }
+        return samples;
+    }
+
+    // Disassembly with each run of instructions headed by the expression it
+    // computes. With samples (see attribute) each header also shows the
+    // node's share of them.
+    std::string annotate(const std::vector<uint64_t> &samples = std::vector<uint64_t>()) const {
+        uint64_t total = 0;
+        for(uint64_t n : samples)
+            total += n;
+
+        std::ostringstream out;
+        int current = -2;
+        for(const Line &l : lines){
+            if(l.node != current && l.node >= 0){
+                const Node &n = nodes[l.node];
+                out << std::string(2 * n.depth, ' ') << "; " << n.expr;
+                if(total)
+                    out << "  [" << std::fixed << std::setprecision(1)
+                        << 100.0 * samples[l.node] / total << "%]";
+                out << "\n";
+            }
+            current = l.node;
+            out << std::hex << std::setw(6) << std::setfill('0') << l.begin
+                << std::dec << std::setfill(' ') << "  " << l.text << "\n";
+        }
+        return out.str();
+    }
+
+    // Append the code range to /tmp/perf-<pid>.map so perf can symbolize
+    // samples in it.
+    void writePerfMap(const std::string &name) const {
+#ifdef __linux__
+        std::ofstream map("/tmp/perf-" + std::to_string(getpid()) + ".map", std::ios::app);
+        map << std::hex << reinterpret_cast<uint64_t>(code) << " " << codeSize << std::dec << " " << name << "\n";
+#endif
+    }
+};
+
+// Receives the assembler's listing and fills in a SourceMap. Node
+// boundaries arrive as "; @node N" and "; @end" comments; each
+// instruction's extent is the assembler offset before and after it was
+// logged.
+class SourceMapLogger : public AsmJit::Logger{
+private:
+    SourceMap &map;
+    const AsmJit::Assembler &assembler;
+    std::vector<int> stack;
+    std::string pending;
+    size_t offset;
+
+    void line(const std::string &text){
+        int node;
+        if(std::sscanf(text.c_str(), "; @node %d", &node) == 1){
+            stack.push_back(node);
+        }else if(text.compare(0, 6, "; @end") == 0){
+            stack.pop_back();
+        }else{
+            SourceMap::Line l = {offset, assembler.getOffset(), stack.empty() ? -1 : stack.back(), text};
+            map.lines.push_back(l);
+            offset = assembler.getOffset();
+        }
+    }
+
+public:
+    SourceMapLogger(SourceMap &map, const AsmJit::Assembler &assembler)
+        : map(map), assembler(assembler), offset(0) {}
+
+    void logString(const char *buf, size_t len){
+        pending.append(buf, len == AsmJit::kInvalidSize ? std::strlen(buf) : len);
+        size_t newline;
+        while((newline = pending.find('\n')) != std::string::npos){
+            line(pending.substr(0, newline));
+            pending.erase(0, newline + 1);
+        }
+    }
+};
+
+// X86Compiler::make() that also reports the code size and, if map is
+// given, records a SourceMap of the result.
+void *makeFunction(AsmJit::X86Compiler &compiler, size_t &codeSize, SourceMap *map = nullptr){
+    using namespace AsmJit;
+    X86Assembler a(compiler.getContext());
+    a.setProperty(kX86PropertyOptimizedAlign, compiler.getProperty(kX86PropertyOptimizedAlign));
+    a.setProperty(kX86PropertyJumpHints, compiler.getProperty(kX86PropertyJumpHints));
+    a.setProperty(kX86PropertyEmitInPlace, compiler.getProperty(kX86PropertyEmitInPlace));
+    if(compiler.getProperty(kX86PropertyEmitInPlace))
+        a.reserveCode(compiler.getCodeSizeEstimate());
+    std::unique_ptr<SourceMapLogger> logger;
+    if(map){
+        logger.reset(new SourceMapLogger(*map, a));
+        a.setLogger(logger.get());
+    }
+    compiler.serialize(a);
+    if(compiler.getError() || a.getError())
+        return nullptr;
+    void *code = a.make();
+    codeSize = a.getCodeSize();
+    if(map){
+        map->code = static_cast<const char *>(code);
+        map->codeSize = codeSize;
+    }
+    return code;
+}
+
+// Fast-math helpers shared by the scalar and packed code generators.
+// ConstantFactory returns a fresh variable holding its argument in every
+// lane; all variables are modified in place like the other operators.
+typedef std::function<AsmJit::XmmVar (double)> ConstantFactory;
+
+// Rewrite (/ (/ a b) c) as (/ a (* b c)) throughout, trading a division
+// for a multiplication.
+Cell reassociateDivisions(const Cell &c){
+    if(c.type != Cell::List)
+        return c;
+    Cell result(c);
+    for(size_t i = 1; i < result.list.size(); ++i)
+        result.list[i] = reassociateDivisions(result.list[i]);
+    if(result.list.size() == 3 && result.list[0].val == "/" &&
+       result.list[1].type == Cell::List && result.list[1].list.size() == 3 &&
+       result.list[1].list[0].val == "/"){
+        Cell product(Cell::List);
+        product.list.push_back(Cell(Cell::Symbol, "*"));
+        product.list.push_back(result.list[1].list[2]);
+        product.list.push_back(result.list[2]);
+        Cell numerator(result.list[1].list[1]);
+        result.list[1] = numerator;
+        result.list[2] = product;
+    }
+    return result;
+}
+
+// mask = all ones in lanes where |v| is not infinite (NaNs included).
+void emitNotInfinite(AsmJit::X86Compiler &c, const AsmJit::XmmVar &mask, const AsmJit::XmmVar &v,
+                     bool packed, const ConstantFactory &constant){
+    using namespace AsmJit;
+    XmmVar infinity(constant(INFINITY));
+    XmmVar sign(constant(-0.0));
+    c.movapd(mask, sign);
+    c.andnpd(mask, v); // |v|
+    if(packed) c.cmppd(mask, infinity, imm(4)); // NEQ
+    else c.cmpsd(mask, infinity, imm(4));
+    c.unuse(infinity);
+    c.unuse(sign);
+}
+
+// a/b as a * rcp(b), with x' = x*(2 - b*x) refinement steps. Operands
+// beyond float range act as their float conversion: a tiny b divides like
+// zero and a huge one gives 0.
+AsmJit::XmmVar emitFastDivide(AsmJit::X86Compiler &c, const AsmJit::XmmVar &a, const AsmJit::XmmVar &b,
+                              bool packed, int refinements, const ConstantFactory &constant){
+    using namespace AsmJit;
+    XmmVar x(c.newXmmVar());
+    if(packed){
+        c.cvtpd2ps(x, b);
+        c.rcpps(x, x);
+        c.cvtps2pd(x, x);
+    }else{
+        c.cvtsd2ss(x, b);
+        c.rcpss(x, x);
+        c.cvtss2sd(x, x);
+    }
+    // Infinite and zero estimates turn into NaN when refined (b*x is
+    // inf*0), those lanes keep the estimate.
+    XmmVar estimate(c.newXmmVar());
+    XmmVar refined(c.newXmmVar());
+    if(refinements > 0){
+        XmmVar nonZero(c.newXmmVar());
+        c.movapd(estimate, x);
+        emitNotInfinite(c, refined, x, packed, constant);
+        c.xorpd(nonZero, nonZero);
+        if(packed) c.cmppd(nonZero, x, imm(4)); // NEQ
+        else c.cmpsd(nonZero, x, imm(4));
+        c.andpd(refined, nonZero);
+        c.unuse(nonZero);
+    }
+    for(int i = 0; i < refinements; ++i){
+        XmmVar bx(c.newXmmVar());
+        XmmVar two(constant(2.0));
+        c.movapd(bx, b);
+        if(packed){
+            c.mulpd(bx, x);
+            c.subpd(two, bx);
+            c.mulpd(x, two);
+        }else{
+            c.mulsd(bx, x);
+            c.subsd(two, bx);
+            c.mulsd(x, two);
+        }
+        c.unuse(bx);
+        c.unuse(two);
+    }
+    if(refinements > 0){
+        c.andpd(x, refined);
+        c.andnpd(refined, estimate);
+        c.orpd(x, refined);
+    }
+    c.unuse(estimate);
+    c.unuse(refined);
+    if(packed) c.mulpd(a, x);
+    else c.mulsd(a, x);
+    c.unuse(x);
+    return a;
+}
+
+// sqrt(a) as a * rsqrt(a), with y' = y*(1.5 - 0.5*a*y*y) refinement steps.
+// rsqrt is infinite for zero (and for inputs too small for a float), so
+// those lanes are masked back to zero; inputs too large for a float have a
+// zero rsqrt and give infinity.
+AsmJit::XmmVar emitFastSqrt(AsmJit::X86Compiler &c, const AsmJit::XmmVar &a,
+                            bool packed, int refinements, const ConstantFactory &constant){
+    using namespace AsmJit;
+    XmmVar y(c.newXmmVar());
+    if(packed){
+        c.cvtpd2ps(y, a);
+        c.rsqrtps(y, y);
+        c.cvtps2pd(y, y);
+    }else{
+        c.cvtsd2ss(y, a);
+        c.rsqrtss(y, y);
+        c.cvtss2sd(y, y);
+    }
+    XmmVar finite(c.newXmmVar());
+    XmmVar overflow(c.newXmmVar());
+    emitNotInfinite(c, finite, y, packed, constant);
+    c.xorpd(overflow, overflow);
+    if(packed) c.cmppd(overflow, y, imm(0)); // EQ
+    else c.cmpsd(overflow, y, imm(0));
+    for(int i = 0; i < refinements; ++i){
+        XmmVar t(c.newXmmVar());
+        XmmVar half(constant(0.5));
+        XmmVar threeHalves(constant(1.5));
+        c.movapd(t, y);
+        if(packed){
+            c.mulpd(t, y);
+            c.mulpd(t, a);
+            c.mulpd(t, half);
+            c.subpd(threeHalves, t);
+            c.mulpd(y, threeHalves);
+        }else{
+            c.mulsd(t, y);
+            c.mulsd(t, a);
+            c.mulsd(t, half);
+            c.subsd(threeHalves, t);
+            c.mulsd(y, threeHalves);
+        }
+        c.unuse(t);
+        c.unuse(half);
+        c.unuse(threeHalves);
+    }
+    if(packed) c.mulpd(a, y);
+    else c.mulsd(a, y);
+    c.andpd(a, finite);
+    XmmVar infinity(constant(INFINITY));
+    c.andpd(infinity, overflow);
+    c.andnpd(overflow, a);
+    c.movapd(a, overflow);
+    c.orpd(a, infinity);
+    c.unuse(y);
+    c.unuse(finite);
+    c.unuse(overflow);
+    c.unuse(infinity);
+    return a;
+}
+
 
 // JIT version of CalculatorFunction class.
 // Expressions return AsmJit SSE "registers"/variables.
@@ -128,11 +914,18 @@ class CodeGenCalculatorFunction : public Visitor<AsmJit::XmmVar>{
 private:
     AsmJit::X86Compiler compiler;
     std::map<std::string, int> argNameToIndex;
+    CompileOptions options;
+    KernelProfile profile;
+    SourceMap sourceMap;
+    size_t depth;
+    size_t codeSize;
 
-    typedef double (*FuncPtrType)(const double * args);
+    // counters is this thread's profile slot, unused without profiling.
+    typedef double (*FuncPtrType)(const double * args, KernelCounters *counters);
     FuncPtrType generatedFunction;
 public:
-    CodeGenCalculatorFunction(const std::vector<std::string> &names, const Cell &cell){
+    CodeGenCalculatorFunction(const std::vector<std::string> &names, const Cell &cell,
+                              const CompileOptions &options = CompileOptions()) : options(options), depth(0), codeSize(0){
         using namespace AsmJit;
 
         // Map operators to assembly instructions
@@ -151,11 +944,29 @@ public:
             return args[0];
         };
 
-        functionMap["/"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+        // Constants needed by the fast-math sequences.
+        ConstantFactory constant = [&](double d) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            SetXmmVar(compiler, v, d);
+            return v;
+        };
+
+        functionMap["/"] = [=](const std::vector<XmmVar> &args) -> XmmVar{
+            if(this->options.fastMath)
+                return emitFastDivide(compiler, args[0], args[1], false,
+                                      this->options.fastMathRefinements, constant);
             compiler.divsd(args[0], args[1]);
             return args[0];
         };
 
+        functionMap["sqrt"] = [=](const std::vector<XmmVar> &args) -> XmmVar{
+            if(this->options.fastMath)
+                return emitFastSqrt(compiler, args[0], false,
+                                    this->options.fastMathRefinements, constant);
+            compiler.sqrtsd(args[0], args[0]);
+            return args[0];
+        };
+
         // Convert numbers into AsmJit vars.
         numberHandler = [&](const std::string &number) -> XmmVar{
             double x = std::atof(number.c_str());
@@ -183,31 +994,170 @@ public:
     }
 
     FuncPtrType generate(const Cell &c){
+        TraceScope trace("compile scalar", "compiler");
+        compiler.setProperty(AsmJit::kX86PropertyEmitInPlace, options.emitInPlace);
         compiler.newFunc(AsmJit::kX86FuncConvDefault, 
-                AsmJit::FuncBuilder1<double, const double *>());
-        AsmJit::XmmVar retVar = eval(c);
+                AsmJit::FuncBuilder2<double, const double *, KernelCounters *>());
+        AsmJit::GpVar counters(compiler.getGpArg(1));
+        AsmJit::GpVar start;
+        if(options.profile != CompileOptions::ProfileOff)
+            start = emitProfileEnter(compiler, counters, options);
+        AsmJit::GpVar savedMxcsr;
+        if(options.flushDenormals)
+            savedMxcsr = emitFlushDenormals(compiler);
+        AsmJit::XmmVar retVar = eval(options.fastMath ? reassociateDivisions(c) : c);
+        if(options.flushDenormals)
+            emitRestoreMxcsr(compiler, savedMxcsr);
+        if(options.profile != CompileOptions::ProfileOff)
+            emitProfileLeave(compiler, counters, start, nullptr, options);
         compiler.ret(retVar);
         compiler.endFunc();
-        return reinterpret_cast<FuncPtrType>(compiler.make());
-
+        TraceScope assemble("assemble", "compiler");
+        return reinterpret_cast<FuncPtrType>(
+            makeFunction(compiler, codeSize, options.sourceMap ? &sourceMap : nullptr));
     }
 
     double operator()(const std::vector<double> &args) const {
-        return generatedFunction(&args[0]); 
+        return generatedFunction(&args[0], options.profile ? profile.slot() : nullptr); 
     }
 
+    ProfileSnapshot snapshotProfile() const { return profile.snapshot(); }
+    void resetProfile() { profile.reset(); }
+
+    // Empty unless compiled with CompileOptions::sourceMap.
+    const SourceMap &getSourceMap() const { return sourceMap; }
+
+    // Bytes of executable memory holding the function.
+    size_t getCodeSize() const { return codeSize; }
+
     ~CodeGenCalculatorFunction(){
         AsmJit::MemoryManager::getGlobal()->free((void*)generatedFunction);
     }
 
+    AsmJit::XmmVar eval(const Cell &c){
+        if(!options.sourceMap)
+            return evalNode(c);
+        beginNode(formatCell(c));
+        AsmJit::XmmVar v = evalNode(c);
+        endNode();
+        return v;
+    }
+
 private:
+    void beginNode(const std::string &expr){
+        SourceMap::Node node = {expr, depth++};
+        sourceMap.nodes.push_back(node);
+        compiler.comment("@node %d", int(sourceMap.nodes.size() - 1));
+    }
+
+    void endNode(){
+        compiler.comment("@end");
+        --depth;
+    }
+
+    // A binary operator whose operands have the same shape evaluates both
+    // operands at once (see evalPair) and combines the two lanes with the
+    // scalar operator.
+    AsmJit::XmmVar evalNode(const Cell &c){
+        using namespace AsmJit;
+        if(options.vectorizeSubtrees && c.type == Cell::List && c.list.size() == 3 &&
+           c.list[1].type == Cell::List && isIsomorphic(c.list[1], c.list[2]) &&
+           functionMap.find(c.list[0].val) != functionMap.end()){
+            XmmVar pair = evalPair(c.list[1], c.list[2]);
+            XmmVar high(compiler.newXmmVar());
+            compiler.movapd(high, pair);
+            compiler.unpckhpd(high, high);
+            return functionMap.at(c.list[0].val)({pair, high});
+        }
+        return Visitor<XmmVar>::eval(c);
+    }
+
+    static bool isPackable(const std::string &op){
+        return op == "+" || op == "-" || op == "*" || op == "/" || op == "sqrt";
+    }
+
+    // Same operators at the same positions; leaves may differ.
+    static bool isIsomorphic(const Cell &a, const Cell &b){
+        if(a.type != Cell::List || b.type != Cell::List)
+            return a.type != Cell::List && b.type != Cell::List;
+        if(a.list[0].val != b.list[0].val || a.list.size() != b.list.size() || !isPackable(a.list[0].val))
+            return false;
+        for(size_t i = 1; i < a.list.size(); ++i)
+            if(!isIsomorphic(a.list[i], b.list[i]))
+                return false;
+        return true;
+    }
+
+    // Evaluate low into lane 0 and high into lane 1 of one register with
+    // packed instructions. Shapes that differ fall back to two scalar
+    // evaluations joined with unpcklpd. In the source map the pair is one
+    // node, "low | high".
+    AsmJit::XmmVar evalPair(const Cell &low, const Cell &high){
+        if(!options.sourceMap)
+            return evalPairNode(low, high);
+        beginNode(formatCell(low) + " | " + formatCell(high));
+        AsmJit::XmmVar v = evalPairNode(low, high);
+        endNode();
+        return v;
+    }
+
+    AsmJit::XmmVar evalPairNode(const Cell &low, const Cell &high){
+        using namespace AsmJit;
+        if(low.type == Cell::Symbol && high.type == Cell::Symbol){
+            GpVar args(compiler.getGpArg(0));
+            XmmVar v(compiler.newXmmVar());
+            compiler.movsd(v, Mem(args, argNameToIndex.at(low.val)*sizeof(double)));
+            compiler.movhpd(v, Mem(args, argNameToIndex.at(high.val)*sizeof(double)));
+            return v;
+        }
+
+        if(low.type == Cell::List && isIsomorphic(low, high)){
+            std::vector<XmmVar> args;
+            for(size_t i = 1; i < low.list.size(); ++i)
+                args.push_back(evalPair(low.list[i], high.list[i]));
+            return emitPacked(low.list[0].val, args);
+        }
+
+        XmmVar v = eval(low);
+        XmmVar h = eval(high);
+        compiler.unpcklpd(v, h);
+        compiler.unuse(h);
+        return v;
+    }
+
+    AsmJit::XmmVar emitPacked(const std::string &op, const std::vector<AsmJit::XmmVar> &args){
+        using namespace AsmJit;
+        ConstantFactory constant = [&](double d) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            SetXmmVar(compiler, v, d);
+            compiler.unpcklpd(v, v);
+            return v;
+        };
+        if(op == "+")
+            compiler.addpd(args[0], args[1]);
+        else if(op == "-")
+            compiler.subpd(args[0], args[1]);
+        else if(op == "*")
+            compiler.mulpd(args[0], args[1]);
+        else if(op == "/" && options.fastMath)
+            return emitFastDivide(compiler, args[0], args[1], true, options.fastMathRefinements, constant);
+        else if(op == "/")
+            compiler.divpd(args[0], args[1]);
+        else if(op == "sqrt" && options.fastMath)
+            return emitFastSqrt(compiler, args[0], true, options.fastMathRefinements, constant);
+        else if(op == "sqrt")
+            compiler.sqrtpd(args[0], args[0]);
+        return args[0];
+    }
+
     void SetXmmVar(AsmJit::X86Compiler &c, AsmJit::XmmVar &v, double d){
         using namespace AsmJit;
         // No immediates for SSE regs/doubles. So put into a general purpose reg
         // and then move into SSE - we could do better than this.
         GpVar gpreg(c.newGpVar());
-        uint64_t *i = reinterpret_cast<uint64_t*>(&d);
-        c.mov(gpreg, i[0]); 
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        c.mov(gpreg, bits);
         c.movq(v, gpreg); 
         c.unuse(gpreg);
     }
@@ -215,84 +1165,4102 @@ private:
 };
 
 
-// Convert given string to list of tokens.
-// originally from: 
-// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
-std::list<std::string> tokenize(const std::string & str){
-    std::list<std::string> tokens;
-    const char * s = str.c_str();
-    while (*s) {
-        while (*s == ' ')
-            ++s;
-        if (*s == '(' || *s == ')')
-            tokens.push_back(*s++ == '(' ? "(" : ")");
-        else {
-            const char * t = s;
-            while (*t && *t != ' ' && *t != '(' && *t != ')')
-                ++t;
-            tokens.push_back(std::string(s, t));
-            s = t;
-        }
-    }
-    return tokens;
+// Size in bytes of a cache of cpu0 as reported by sysfs, or fallback.
+// On x86 index0 is L1d, index2 L2 and index3 (if present) L3.
+size_t cacheSize(int index, size_t fallback){
+    std::ifstream f("/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/size");
+    size_t size = 0;
+    std::string unit;
+    if(!(f >> size) || size == 0)
+        return fallback;
+    std::getline(f, unit);
+    if(unit == "K")
+        size *= 1024;
+    else if(unit == "M")
+        size *= 1024*1024;
+    return size;
 }
 
-// Numbers become Numbers; every other token is a Symbol.
-// Originally from: 
-// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
-Cell atom(const std::string & token)
-{
-    if (std::isdigit(token[0]) || (token[0] == '-' && std::isdigit(token[1])))
-        return Cell(Cell::Number, token);
-    return Cell(Cell::Symbol, token);
+size_t lastLevelCacheSize(){
+    return cacheSize(3, cacheSize(2, 256*1024));
 }
 
-// Return the s-expression in the given tokens.
-// Originally from: 
-// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
-Cell readFrom(std::list<std::string> & tokens)
-{
-    const std::string token(tokens.front());
-    tokens.pop_front();
-    if (token == "(") {
-        Cell c(Cell::List);
-        while (tokens.front() != ")")
-            c.list.push_back(readFrom(tokens));
-        tokens.pop_front();
-        return c;
+// Code generation knobs for batch kernels. flushDenormals switches MXCSR
+// once around the whole loop rather than per row.
+struct BatchOptions : public CompileOptions{
+    // Row pairs evaluated per loop iteration. Each pair is an independent
+    // dependency chain, so more pairs keep more divides/multiplies in flight.
+    size_t unroll;
+    // prefetcht0 input columns this many rows ahead, 0 disables. Raises
+    // unroll until an iteration covers a whole cache line of input (see
+    // effectiveUnroll).
+    size_t prefetchDistance;
+    // Write results with movntpd, bypassing the caches. Only pays off when
+    // the output is larger than the last level cache.
+    bool nonTemporalStores;
+
+    BatchOptions() : unroll(1), prefetchDistance(0), nonTemporalStores(false) {}
+};
+
+// Input layout of batch kernels. The default (stride == 0) is one column
+// per argument. Otherwise rows are array-of-structs records: argument i of
+// row r is the double at base + r*stride + offsets[i] (bytes), e.g. for
+// struct Row { double x, y, z; } stride is sizeof(Row) and offsets are
+// offsetof(Row, x) etc.
+struct RowLayout{
+    size_t stride;
+    std::vector<size_t> offsets;
+
+    RowLayout() : stride(0) {}
+    RowLayout(size_t stride, const std::vector<size_t> &offsets) : stride(stride), offsets(offsets) {}
+    bool isColumns() const { return stride == 0; }
+};
+
+// Row pairs per loop iteration of a kernel compiled with options: prefetching
+// raises options.unroll until an iteration covers a cache line of input.
+size_t effectiveUnroll(const BatchOptions &options, const RowLayout &layout = RowLayout()){
+    size_t unroll = std::max<size_t>(options.unroll, 1);
+    if(options.prefetchDistance > 0){
+        size_t rowBytes = layout.isColumns() ? sizeof(double) : layout.stride;
+        unroll = std::max(unroll, (64 + 2*rowBytes - 1)/(2*rowBytes));
     }
-    else
-        return atom(token);
+    return unroll;
 }
 
-// Return the Lisp expression represented by the given string.
-// Originally from: 
-// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
+// Floating point exceptions raised while evaluating a batch, see
+// CodeGenBatchFunction::evaluateChecked. flags are MXCSR flag bits.
+struct FloatExceptions{
+    enum Flag {Invalid = 0x01, DivideByZero = 0x04, Overflow = 0x08};
+
+    unsigned int flags;
+    std::vector<size_t> rows; // Rows raising any of flags, ascending.
+
+    FloatExceptions() : flags(0) {}
+    bool any() const { return flags != 0; }
+};
+
+// Batch JIT version: evaluates the expression over whole columns of rows.
+// Argument i of row r is read from columns[i][r] (or a record, see
+// RowLayout) and the result is written to out[r]. Two rows are processed
+// per iteration in packed SSE2 registers (addpd etc.), with a scalar tail
+// for an odd final row.
+//
+// A kernel can also compute several outputs in one pass. Bindings are named
+// intermediate expressions, evaluated in order for each row pair and kept in
+// registers; later bindings and the outputs read them by name like columns.
+class CodeGenBatchFunction : public Visitor<AsmJit::XmmVar>{
+public:
+    typedef std::vector<std::pair<std::string, Cell>> Bindings;
+
+private:
+    AsmJit::X86Compiler compiler;
+    std::map<std::string, int> argNameToIndex;
+    BatchOptions options;
+    RowLayout layout;
+    Bindings bindings;
+    std::vector<Cell> outputs;
+
+    // Per-generation state used by the handlers below.
+    bool packed;
+    sysint_t rowOffset; // Row of the pair being evaluated in an unrolled body.
+    std::map<int, AsmJit::GpVar> columnVars;
+    AsmJit::GpVar rowVar;
+    AsmJit::GpVar recordVar; // Current record for array-of-structs input.
+    std::map<uint64_t, AsmJit::XmmVar> constants; // Keyed by bit pattern (0 and -0 differ).
+    std::map<std::string, AsmJit::XmmVar> boundVars; // Bindings of the current row pair.
+    std::vector<AsmJit::GpVar> outVars;
+
+    KernelProfile profile;
+
+    // input is the column pointer array, or the first record. outs has one
+    // pointer per output. counters is this thread's profile slot, unused
+    // without profiling.
+    typedef void (*FuncPtrType)(const void *input, double * const *outs, size_t rows, KernelCounters *counters);
+    FuncPtrType generatedFunction;
+public:
+    CodeGenBatchFunction(const std::vector<std::string> &names, const Cell &cell,
+                         const BatchOptions &options = BatchOptions(),
+                         const RowLayout &layout = RowLayout())
+        : CodeGenBatchFunction(names, Bindings(), std::vector<Cell>(1, cell), options, layout) {}
+
+    // Binding names must differ from the argument names.
+    CodeGenBatchFunction(const std::vector<std::string> &names, const Bindings &bindings,
+                         const std::vector<Cell> &outputs,
+                         const BatchOptions &options = BatchOptions(),
+                         const RowLayout &layout = RowLayout())
+        : options(options), layout(layout), bindings(bindings), outputs(outputs),
+          packed(false), rowOffset(0){
+        using namespace AsmJit;
+
+        functionMap["+"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            if(packed) compiler.addpd(args[0], args[1]);
+            else compiler.addsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["-"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            if(packed) compiler.subpd(args[0], args[1]);
+            else compiler.subsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["*"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            if(packed) compiler.mulpd(args[0], args[1]);
+            else compiler.mulsd(args[0], args[1]);
+            return args[0];
+        };
+
+        // Constants are materialised once before the loop (see generate), the
+        // operators clobber their first operand so hand out a copy.
+        ConstantFactory constant = [&](double d) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            compiler.movapd(v, constants.at(doubleBits(d)));
+            return v;
+        };
+
+        functionMap["/"] = [=](const std::vector<XmmVar> &args) -> XmmVar{
+            if(this->options.fastMath)
+                return emitFastDivide(compiler, args[0], args[1], packed,
+                                      this->options.fastMathRefinements, constant);
+            if(packed) compiler.divpd(args[0], args[1]);
+            else compiler.divsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["sqrt"] = [=](const std::vector<XmmVar> &args) -> XmmVar{
+            if(this->options.fastMath)
+                return emitFastSqrt(compiler, args[0], packed,
+                                    this->options.fastMathRefinements, constant);
+            if(packed) compiler.sqrtpd(args[0], args[0]);
+            else compiler.sqrtsd(args[0], args[0]);
+            return args[0];
+        };
+
+        numberHandler = [=](const std::string &number) -> XmmVar{
+            return constant(std::atof(number.c_str()));
+        };
+
+        for(size_t i = 0; i < names.size(); ++i)
+            argNameToIndex[names[i]] = i;
+
+        symbolHandler = [&](const std::string name) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            auto bound = boundVars.find(name);
+            if(bound != boundVars.end()){
+                compiler.movapd(v, bound->second);
+                return v;
+            }
+            int index = argNameToIndex.at(name);
+            if(layout.isColumns()){
+                Mem m(ptr(columnVars.at(index), rowVar, 3, rowOffset*sizeof(double)));
+                if(packed) compiler.movupd(v, m);
+                else compiler.movsd(v, m);
+            }else{
+                // Gather the field of two neighbouring records into the low
+                // and high lanes. movsd rather than movlpd for the low half
+                // as it writes the whole register (no false dependency).
+                sysint_t offset = rowOffset*layout.stride + layout.offsets.at(index);
+                compiler.movsd(v, ptr(recordVar, offset));
+                if(packed) compiler.movhpd(v, ptr(recordVar, offset + layout.stride));
+            }
+            return v;
+        };
+
+        for(const auto &b : bindings)
+            if(argNameToIndex.count(b.first))
+                throw std::runtime_error("Binding shadows argument: " + b.first);
+
+        generatedFunction = generate();
+    }
+
+    FuncPtrType generate(){
+        using namespace AsmJit;
+        TraceScope trace("compile batch", "compiler");
+        compiler.setProperty(kX86PropertyEmitInPlace, options.emitInPlace);
+        Bindings b(bindings);
+        std::vector<Cell> c(outputs);
+        if(options.fastMath){
+            for(auto &binding : b)
+                binding.second = reassociateDivisions(binding.second);
+            for(Cell &output : c)
+                output = reassociateDivisions(output);
+        }
+        compiler.newFunc(kX86FuncConvDefault,
+                FuncBuilder4<Void, const void *, double * const *, size_t, KernelCounters *>());
+
+        GpVar columns(compiler.getGpArg(0));
+        GpVar outs(compiler.getGpArg(1));
+        GpVar rows(compiler.getGpArg(2));
+        GpVar counters(compiler.getGpArg(3));
+
+        GpVar start;
+        if(options.profile != CompileOptions::ProfileOff)
+            start = emitProfileEnter(compiler, counters, options);
+
+        GpVar savedMxcsr;
+        if(options.flushDenormals)
+            savedMxcsr = emitFlushDenormals(compiler);
+
+        // Column base pointers of referenced arguments live in registers for
+        // the whole loop (the register allocator spills them for very wide
+        // expressions), and every constant is broadcast into both lanes once.
+        // Array-of-structs input walks a record pointer instead.
+        if(!layout.isColumns())
+            recordVar = columns;
+        for(const auto &binding : b)
+            hoistLoopInvariants(binding.second, layout.isColumns() ? columns : recordVar);
+        for(const Cell &output : c)
+            hoistLoopInvariants(output, layout.isColumns() ? columns : recordVar);
+
+        outVars.clear();
+        for(size_t i = 0; i < c.size(); ++i){
+            GpVar p(compiler.newGpVar());
+            compiler.mov(p, ptr(outs, i*sizeof(double *)));
+            outVars.push_back(p);
+        }
+
+        // Loop bounds are compared signed: "rows - (step - 1)" goes negative
+        // for short batches.
+        size_t unroll = effectiveUnroll(options, layout);
+        sysint_t step = 2*unroll;
+        rowVar = compiler.newGpVar();
+        GpVar limit(compiler.newGpVar());
+        compiler.xor_(rowVar, rowVar);
+
+        Label L_Pairs(compiler.newLabel());
+        Label L_Tail(compiler.newLabel());
+        Label L_Exit(compiler.newLabel());
+
+        // Main loop: unroll independent row pairs per iteration.
+        Label L_Loop(compiler.newLabel());
+        compiler.mov(limit, rows);
+        compiler.sub(limit, imm(step - 1));
+        compiler.cmp(rowVar, limit);
+        compiler.jge(L_Pairs);
+        compiler.bind(L_Loop);
+        packed = true;
+        emitPrefetches(step);
+        for(size_t i = 0; i < unroll; ++i){
+            rowOffset = i*2;
+            evalRow(b, c);
+        }
+        rowOffset = 0;
+        advance(step);
+        compiler.cmp(rowVar, limit);
+        compiler.jl(L_Loop);
+
+        // Remaining pairs one at a time.
+        compiler.bind(L_Pairs);
+        if(unroll > 1){
+            Label L_PairLoop(compiler.newLabel());
+            compiler.mov(limit, rows);
+            compiler.sub(limit, imm(1));
+            compiler.cmp(rowVar, limit);
+            compiler.jge(L_Tail);
+            compiler.bind(L_PairLoop);
+            evalRow(b, c);
+            advance(2);
+            compiler.cmp(rowVar, limit);
+            compiler.jl(L_PairLoop);
+        }
+
+        // Odd final row.
+        compiler.bind(L_Tail);
+        compiler.cmp(rowVar, rows);
+        compiler.jge(L_Exit);
+        packed = false;
+        evalRow(b, c);
+
+        compiler.bind(L_Exit);
+        if(options.nonTemporalStores)
+            compiler.sfence();
+        if(options.flushDenormals)
+            emitRestoreMxcsr(compiler, savedMxcsr);
+        if(options.profile != CompileOptions::ProfileOff)
+            emitProfileLeave(compiler, counters, start, &rows, options);
+        compiler.endFunc();
+        TraceScope assemble("assemble", "compiler");
+        return reinterpret_cast<FuncPtrType>(compiler.make());
+    }
+
+    // Column input.
+    void operator()(const double * const *columns, double *out, size_t rows) const {
+        evaluateOutputs(columns, &out, rows);
+    }
+
+    // Column input, one output array per output expression.
+    void evaluateOutputs(const double * const *columns, double * const *outs, size_t rows) const {
+        // movntpd needs 16 byte aligned output: peel one row through the
+        // scalar tail if it is not.
+        if(needsPeel(outs, rows)){
+            call(columns, outs, 1);
+            std::vector<const double *> rest(columns, columns + argNameToIndex.size());
+            for(const double *&c : rest)
+                ++c;
+            call(rest.data(), nextRow(outs).data(), rows - 1);
+        }else{
+            call(columns, outs, rows);
+        }
+    }
+
+    // Column input, also reporting invalid operations, divisions by zero and
+    // overflows. The MXCSR exception flags are cleared before the batch and
+    // read after it, so clean batches cost nothing extra. Only when a flag is
+    // raised is the batch bisected, rerunning the halves that raise it, to
+    // find up to maxRows offending rows. The caller's flags are kept.
+    // Fast-math kernels are refused: their float conversions and estimates
+    // raise flags for rows that have no real exception. Input columns that
+    // share memory with an output (an in-place batch) are copied first, as
+    // the reruns must see the original inputs.
+    FloatExceptions evaluateChecked(const double * const *columns, double * const *outs, size_t rows,
+                                    size_t maxRows = 64) const {
+        if(options.fastMath)
+            throw std::runtime_error("evaluateChecked needs a kernel compiled without fastMath");
+        std::vector<const double *> inputs(columns, columns + argNameToIndex.size());
+        std::vector<std::vector<double>> copies;
+        copies.reserve(inputs.size());
+        for(const double *&column : inputs)
+            if(overlapsOutput(column, outs, rows)){
+                copies.push_back(std::vector<double>(column, column + rows));
+                column = copies.back().data();
+            }
+        columns = inputs.data();
+
+        const unsigned int watched = FloatExceptions::Invalid | FloatExceptions::DivideByZero |
+                                     FloatExceptions::Overflow;
+        unsigned int saved = _mm_getcsr();
+        _mm_setcsr(saved & ~mxcsrExceptionFlags);
+        evaluateOutputs(columns, outs, rows);
+        unsigned int raised = _mm_getcsr() & mxcsrExceptionFlags;
+
+        FloatExceptions report;
+        report.flags = raised & watched;
+        if(report.flags && rows > 1 && maxRows > 0){
+            size_t half = rows / 2;
+            locateExceptions(columns, outs, 0, half, report.flags, maxRows, report.rows);
+            locateExceptions(columns, outs, half, rows, report.flags, maxRows, report.rows);
+        }else if(report.flags && maxRows > 0){
+            report.rows.push_back(0);
+        }
+        _mm_setcsr(saved | raised);
+        return report;
+    }
+
+    // Array-of-structs input, for functions compiled with a RowLayout.
+    void evaluateRecords(const void *records, double *out, size_t rows) const {
+        double * const *outs = &out;
+        if(needsPeel(outs, rows)){
+            call(records, outs, 1);
+            call(static_cast<const char *>(records) + layout.stride, nextRow(outs).data(), rows - 1);
+        }else{
+            call(records, outs, rows);
+        }
+    }
+
+    size_t getArgCount() const { return argNameToIndex.size(); }
+    size_t getOutputCount() const { return outputs.size(); }
+
+    ProfileSnapshot snapshotProfile() const { return profile.snapshot(); }
+    void resetProfile() { profile.reset(); }
+
+    const BatchOptions &getOptions() const { return options; }
+    const RowLayout &getLayout() const { return layout; }
+
+    ~CodeGenBatchFunction(){
+        AsmJit::MemoryManager::getGlobal()->free((void*)generatedFunction);
+    }
+
+private:
+    void call(const void *input, double * const *outs, size_t rows) const {
+        generatedFunction(input, outs, rows, options.profile ? profile.slot() : nullptr);
+    }
+
+    // Outputs are peeled together, so they must share their alignment.
+    bool needsPeel(double * const *outs, size_t rows) const {
+        if(!options.nonTemporalStores || rows < 2)
+            return false;
+        uintptr_t misaligned = reinterpret_cast<uintptr_t>(outs[0]) & 15;
+        for(size_t i = 1; i < outputs.size(); ++i)
+            if((reinterpret_cast<uintptr_t>(outs[i]) & 15) != misaligned)
+                throw std::runtime_error("Non-temporal outputs must share their 16 byte alignment");
+        return misaligned != 0;
+    }
+
+    bool overlapsOutput(const double *column, double * const *outs, size_t rows) const {
+        std::less<const double *> before;
+        for(size_t k = 0; k < outputs.size(); ++k)
+            if(before(column, outs[k] + rows) && before(outs[k], column + rows))
+                return true;
+        return false;
+    }
+
+    // Rerun rows [begin, end) and bisect down to the single rows raising flags.
+    void locateExceptions(const double * const *columns, double * const *outs, size_t begin, size_t end,
+                          unsigned int flags, size_t maxRows, std::vector<size_t> &found) const {
+        if(found.size() >= maxRows)
+            return;
+        std::vector<const double *> c(columns, columns + argNameToIndex.size());
+        std::vector<double *> o(outs, outs + outputs.size());
+        for(const double *&column : c)
+            column += begin;
+        for(double *&out : o)
+            out += begin;
+        _mm_setcsr(_mm_getcsr() & ~mxcsrExceptionFlags);
+        evaluateOutputs(c.data(), o.data(), end - begin);
+        if(!(_mm_getcsr() & flags))
+            return;
+        if(end - begin == 1){
+            found.push_back(begin);
+            return;
+        }
+        size_t mid = begin + (end - begin) / 2;
+        locateExceptions(columns, outs, begin, mid, flags, maxRows, found);
+        locateExceptions(columns, outs, mid, end, flags, maxRows, found);
+    }
+
+    std::vector<double *> nextRow(double * const *outs) const {
+        std::vector<double *> next(outs, outs + outputs.size());
+        for(double *&o : next)
+            ++o;
+        return next;
+    }
+
+    // Evaluate the bindings, then store every output, for the current row
+    // (pair) at rowOffset.
+    void evalRow(const Bindings &b, const std::vector<Cell> &c){
+        using namespace AsmJit;
+        boundVars.clear();
+        for(const auto &binding : b)
+            boundVars[binding.first] = eval(binding.second);
+        for(size_t i = 0; i < c.size(); ++i){
+            Mem m(ptr(outVars[i], rowVar, 3, rowOffset*sizeof(double)));
+            if(packed) store(m, eval(c[i]));
+            else compiler.movsd(m, eval(c[i]));
+        }
+        for(auto &bound : boundVars)
+            compiler.unuse(bound.second);
+        boundVars.clear();
+    }
+
+    void advance(sysint_t rows){
+        using namespace AsmJit;
+        compiler.add(rowVar, imm(rows));
+        if(!layout.isColumns())
+            compiler.add(recordVar, imm(rows*layout.stride));
+    }
+
+    void store(const AsmJit::Mem &m, const AsmJit::XmmVar &v){
+        if(options.nonTemporalStores)
+            compiler.movntpd(m, v);
+        else
+            compiler.movupd(m, v);
+    }
+
+    // One prefetch per cache line the iteration advances through, per column.
+    // generate() unrolls prefetching loops to at least one line per
+    // iteration, so short steps don't prefetch the same line repeatedly.
+    void emitPrefetches(sysint_t step){
+        using namespace AsmJit;
+        if(options.prefetchDistance == 0)
+            return;
+        if(layout.isColumns()){
+            sysint_t distance = options.prefetchDistance*sizeof(double);
+            for(auto &column : columnVars)
+                for(sysint_t line = 0; line < sysint_t(step*sizeof(double)); line += 64)
+                    compiler.prefetch(ptr(column.second, rowVar, 3, distance + line), imm(kX86PrefetchT0));
+        }else{
+            sysint_t distance = options.prefetchDistance*layout.stride;
+            for(sysint_t line = 0; line < sysint_t(step*layout.stride); line += 64)
+                compiler.prefetch(ptr(recordVar, distance + line), imm(kX86PrefetchT0));
+        }
+    }
+
+    void hoistLoopInvariants(const Cell &c, const AsmJit::GpVar &columns){
+        using namespace AsmJit;
+        if(c.type == Cell::Symbol){
+            if(!layout.isColumns() || !argNameToIndex.count(c.val))
+                return; // Records need no pointers, bindings are not columns.
+            int index = argNameToIndex.at(c.val);
+            if(columnVars.find(index) == columnVars.end()){
+                GpVar p(compiler.newGpVar());
+                compiler.mov(p, ptr(columns, index*sizeof(double *)));
+                columnVars[index] = p;
+            }
+        }else if(c.type == Cell::Number){
+            hoistConstant(std::atof(c.val.c_str()));
+        }else if(c.type == Cell::List){
+            if(options.fastMath && (c.list[0].val == "/" || c.list[0].val == "sqrt")){
+                hoistConstant(INFINITY);
+                hoistConstant(-0.0);
+            }
+            if(options.fastMath && c.list[0].val == "/")
+                hoistConstant(2.0);
+            if(options.fastMath && c.list[0].val == "sqrt"){
+                hoistConstant(0.5);
+                hoistConstant(1.5);
+            }
+            for(size_t i = 1; i < c.list.size(); ++i)
+                hoistLoopInvariants(c.list[i], columns);
+        }
+    }
+
+    static uint64_t doubleBits(double x){
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    void hoistConstant(double x){
+        using namespace AsmJit;
+        if(constants.find(doubleBits(x)) != constants.end())
+            return;
+        XmmVar v(compiler.newXmmVar());
+        GpVar gpreg(compiler.newGpVar());
+        compiler.mov(gpreg, doubleBits(x));
+        compiler.movq(v, gpreg);
+        compiler.unuse(gpreg);
+        compiler.unpcklpd(v, v);
+        constants[doubleBits(x)] = v;
+    }
+};
+
+
+// Pick BatchOptions for an expression on this host by timing candidate
+// kernels on synthetic data. rows is the expected batch size: it decides
+// whether the sample spills out of the last level cache (where prefetching
+// and streaming stores matter) and whether streaming stores are tried.
+// Candidates are described by the unroll their kernels actually use, and
+// ones that prefetching unrolls into an already timed kernel are skipped.
+BatchOptions autotuneBatchOptions(const std::vector<std::string> &names, const Cell &cell, size_t rows,
+                                  bool flushDenormals = false){
+    size_t llc = lastLevelCacheSize();
+    bool bigOutput = rows*sizeof(double) > llc;
+    size_t sampleRows = std::min(rows, std::max<size_t>(1 << 16,
+                                 2*llc / ((names.size() + 1)*sizeof(double))));
+    sampleRows = std::max<size_t>(sampleRows, 2);
+
+    // Values in [1, 2): no denormals, overflow or division by zero.
+    std::vector<std::vector<double>> data(names.size(), std::vector<double>(sampleRows));
+    std::vector<const double *> columns;
+    for(size_t i = 0; i < data.size(); ++i){
+        for(size_t r = 0; r < sampleRows; ++r)
+            data[i][r] = 1.0 + double((r*7919 + i*104729) % 1000) / 1000.0;
+        columns.push_back(data[i].data());
+    }
+    std::vector<double> out(sampleRows);
+
+    BatchOptions best;
+    best.flushDenormals = flushDenormals;
+    auto bestTime = std::chrono::steady_clock::duration::max();
+    std::vector<BatchOptions> timed;
+    for(size_t unroll : {1, 2, 4}){
+        for(size_t prefetchDistance : {0, 64, 256}){
+            for(bool nonTemporal : {false, true}){
+                if(nonTemporal && !bigOutput)
+                    continue;
+                BatchOptions candidate;
+                candidate.flushDenormals = flushDenormals;
+                candidate.unroll = unroll;
+                candidate.prefetchDistance = prefetchDistance;
+                candidate.nonTemporalStores = nonTemporal;
+                candidate.unroll = effectiveUnroll(candidate);
+                bool duplicate = false;
+                for(const BatchOptions &t : timed)
+                    duplicate = duplicate || (t.unroll == candidate.unroll &&
+                                              t.prefetchDistance == prefetchDistance &&
+                                              t.nonTemporalStores == nonTemporal);
+                if(duplicate)
+                    continue;
+                timed.push_back(candidate);
+                CodeGenBatchFunction f(names, cell, candidate);
+
+                // Best of three, after a warm up run.
+                f(columns.data(), out.data(), sampleRows);
+                auto time = std::chrono::steady_clock::duration::max();
+                for(int i = 0; i < 3; ++i){
+                    auto start = std::chrono::steady_clock::now();
+                    f(columns.data(), out.data(), sampleRows);
+                    time = std::min(time, std::chrono::steady_clock::now() - start);
+                }
+                if(time < bestTime){
+                    bestTime = time;
+                    best = candidate;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+
+// Validity (null) bitmaps in the Apache Arrow layout: bit r%64 of word
+// r/64 is set when row r holds a value. A null bitmap pointer means the
+// column has no nulls. This kernel ANDs the bitmaps of the arguments an
+// expression reads into the output bitmap, 128 rows per pand and without
+// branching on individual rows.
+class CodeGenValidityFunction{
+private:
+    AsmJit::X86Compiler compiler;
+    std::vector<int> referenced; // Argument indices read by the expression.
+
+    typedef void (*FuncPtrType)(const uint64_t * const *bitmaps, uint64_t *out, size_t words);
+    FuncPtrType generatedFunction;
+public:
+    CodeGenValidityFunction(const std::vector<std::string> &names, const Cell &cell){
+        collectArguments(names, cell);
+        generatedFunction = generate();
+    }
+
+    // bitmaps has one entry per function argument; rows must start on a
+    // multiple of 64 so whole words line up.
+    void operator()(const uint64_t * const *bitmaps, uint64_t *out, size_t rows) const {
+        size_t words = (rows + 63) / 64;
+        // A null bitmap is all ones, which leaves the AND unchanged: stand
+        // in any bitmap that is present, since ANDing one twice is harmless.
+        const uint64_t *present = nullptr;
+        for(int index : referenced)
+            if(bitmaps[index] != nullptr)
+                present = bitmaps[index];
+        if(present == nullptr){
+            std::fill(out, out + words, ~uint64_t(0));
+            return;
+        }
+        std::vector<const uint64_t *> used;
+        for(int index : referenced)
+            used.push_back(bitmaps[index] != nullptr ? bitmaps[index] : present);
+        generatedFunction(used.data(), out, words);
+    }
+
+    ~CodeGenValidityFunction(){
+        AsmJit::MemoryManager::getGlobal()->free((void*)generatedFunction);
+    }
+
+private:
+    void collectArguments(const std::vector<std::string> &names, const Cell &c){
+        if(c.type == Cell::Symbol){
+            int index = std::find(names.begin(), names.end(), c.val) - names.begin();
+            if(index == int(names.size()))
+                throw std::runtime_error("Cannot handle symbol: " + c.val);
+            if(std::find(referenced.begin(), referenced.end(), index) == referenced.end())
+                referenced.push_back(index);
+        }else if(c.type == Cell::List){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                collectArguments(names, c.list[i]);
+        }
+    }
+
+    // used[k] is the bitmap of referenced[k].
+    FuncPtrType generate(){
+        using namespace AsmJit;
+        TraceScope trace("compile validity", "compiler");
+        compiler.setProperty(kX86PropertyEmitInPlace, true);
+        compiler.newFunc(kX86FuncConvDefault,
+                FuncBuilder3<Void, const uint64_t * const *, uint64_t *, size_t>());
+
+        GpVar used(compiler.getGpArg(0));
+        GpVar out(compiler.getGpArg(1));
+        GpVar words(compiler.getGpArg(2));
+
+        std::vector<GpVar> bitmapVars;
+        for(size_t i = 0; i < referenced.size(); ++i){
+            GpVar p(compiler.newGpVar());
+            compiler.mov(p, ptr(used, i*sizeof(uint64_t *)));
+            bitmapVars.push_back(p);
+        }
+
+        GpVar word(compiler.newGpVar());
+        GpVar limit(compiler.newGpVar());
+        compiler.xor_(word, word);
+        compiler.mov(limit, words);
+        compiler.sub(limit, imm(1));
+
+        Label L_Loop(compiler.newLabel());
+        Label L_Tail(compiler.newLabel());
+        Label L_Exit(compiler.newLabel());
+
+        // Two words per iteration.
+        compiler.cmp(word, limit);
+        compiler.jge(L_Tail);
+        compiler.bind(L_Loop);
+        XmmVar acc(compiler.newXmmVar());
+        if(bitmapVars.empty())
+            compiler.pcmpeqd(acc, acc);
+        else
+            compiler.movdqu(acc, ptr(bitmapVars[0], word, 3));
+        for(size_t i = 1; i < bitmapVars.size(); ++i){
+            // Legacy SSE pand needs aligned memory operands, load first.
+            XmmVar bits(compiler.newXmmVar());
+            compiler.movdqu(bits, ptr(bitmapVars[i], word, 3));
+            compiler.pand(acc, bits);
+            compiler.unuse(bits);
+        }
+        compiler.movdqu(ptr(out, word, 3), acc);
+        compiler.unuse(acc);
+        compiler.add(word, imm(2));
+        compiler.cmp(word, limit);
+        compiler.jl(L_Loop);
+
+        // Odd final word.
+        compiler.bind(L_Tail);
+        compiler.cmp(word, words);
+        compiler.jge(L_Exit);
+        GpVar bits(compiler.newGpVar());
+        if(bitmapVars.empty())
+            compiler.mov(bits, imm(-1));
+        else
+            compiler.mov(bits, ptr(bitmapVars[0], word, 3));
+        for(size_t i = 1; i < bitmapVars.size(); ++i)
+            compiler.and_(bits, ptr(bitmapVars[i], word, 3));
+        compiler.mov(ptr(out, word, 3), bits);
+
+        compiler.bind(L_Exit);
+        compiler.endFunc();
+        return reinterpret_cast<FuncPtrType>(compiler.make());
+    }
+};
+
+// Batch function over nullable columns: values are computed for every row
+// (invalid rows hold whatever the inputs held) and the output validity
+// bitmap is the AND of the input bitmaps the expression reads. The bitmaps
+// go through their own kernel after the values rather than being fused
+// into the value loop: they are 1/64th the size of the values, so the
+// second pass costs a few cache lines per 64 rows, where fusing would put
+// a word-granular loop inside the row-pair unrolling and tails.
+class NullableBatchFunction{
+private:
+    CodeGenBatchFunction values;
+    CodeGenValidityFunction validity;
+public:
+    NullableBatchFunction(const std::vector<std::string> &names, const Cell &cell,
+                          const BatchOptions &options = BatchOptions())
+        : values(names, cell, options), validity(names, cell) {}
+
+    void operator()(const double * const *columns, const uint64_t * const *bitmaps,
+                    double *out, uint64_t *outValidity, size_t rows) const {
+        values(columns, out, rows);
+        validity(bitmaps, outValidity, rows);
+    }
+};
+
+
+// Cache blocked evaluation for wide expressions. A batch kernel reading
+// dozens of columns walks dozens of memory streams at once, more than the
+// hardware prefetchers track. Here the expression is cut into stages that
+// each read at most maxStreams columns; inner stages write to small scratch
+// buffers ("$0", "$1", ...) that later stages read as ordinary columns.
+// Rows are processed one tile at a time through every stage, so the tile's
+// scratch buffers stay resident in cache between stages.
+class TiledBatchFunction{
+private:
+    std::vector<std::unique_ptr<CodeGenBatchFunction>> stages; // Last one is the root.
+    size_t argCount;
+    size_t tileRows;
+
+public:
+    // maxStreams limits the distinct columns (inputs or scratch) read by any
+    // stage. tileRows == 0 picks a tile size from the cache sizes. Every
+    // stage is compiled with options.
+    TiledBatchFunction(const std::vector<std::string> &names, const Cell &cell,
+                       size_t maxStreams = 8, size_t tileRows = 0,
+                       const BatchOptions &options = BatchOptions())
+        : argCount(names.size()), tileRows(tileRows){
+        std::vector<Cell> stageCells;
+        Cell root = split(cell, std::max<size_t>(maxStreams, 2), stageCells);
+        stageCells.push_back(root);
+
+        // Every stage sees the inputs followed by all scratch columns.
+        std::vector<std::string> stageNames(names);
+        for(size_t i = 0; i + 1 < stageCells.size(); ++i)
+            stageNames.push_back(scratchName(i));
+        for(const Cell &c : stageCells)
+            stages.push_back(std::unique_ptr<CodeGenBatchFunction>(
+                new CodeGenBatchFunction(stageNames, c, options)));
+
+        if(this->tileRows == 0)
+            this->tileRows = defaultTileRows(maxStreams, stages.size());
+    }
+
+    size_t getStageCount() const { return stages.size(); }
+    size_t getTileRows() const { return tileRows; }
+
+    void operator()(const double * const *columns, double *out, size_t rows) const {
+        size_t scratchCount = stages.size() - 1;
+        std::vector<double> scratch(scratchCount * tileRows);
+        std::vector<const double *> tileColumns(argCount + scratchCount);
+        for(size_t i = 0; i < scratchCount; ++i)
+            tileColumns[argCount + i] = &scratch[i * tileRows];
+
+        for(size_t begin = 0; begin < rows; begin += tileRows){
+            size_t n = std::min(tileRows, rows - begin);
+            for(size_t i = 0; i < argCount; ++i)
+                tileColumns[i] = columns[i] + begin;
+            for(size_t i = 0; i < scratchCount; ++i)
+                (*stages[i])(tileColumns.data(), &scratch[i * tileRows], n);
+            (*stages.back())(tileColumns.data(), out + begin, n);
+        }
+    }
+
+private:
+    static std::string scratchName(size_t i){
+        return "$" + std::to_string(i);
+    }
+
+    // Distinct symbols (columns) read by an expression.
+    static void streams(const Cell &c, std::vector<std::string> &names){
+        if(c.type == Cell::Symbol){
+            if(std::find(names.begin(), names.end(), c.val) == names.end())
+                names.push_back(c.val);
+        }else if(c.type == Cell::List){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                streams(c.list[i], names);
+        }
+    }
+
+    static size_t streamCount(const Cell &c){
+        std::vector<std::string> names;
+        streams(c, names);
+        return names.size();
+    }
+
+    // Rewrite c bottom up so it reads at most maxStreams columns, moving
+    // its widest list operands into new stages until it fits.
+    static Cell split(const Cell &c, size_t maxStreams, std::vector<Cell> &stageCells){
+        if(c.type != Cell::List)
+            return c;
+
+        Cell result(c);
+        for(size_t i = 1; i < result.list.size(); ++i)
+            result.list[i] = split(result.list[i], maxStreams, stageCells);
+
+        while(streamCount(result) > maxStreams){
+            size_t widest = 0, widestCount = 0;
+            for(size_t i = 1; i < result.list.size(); ++i){
+                size_t count = streamCount(result.list[i]);
+                if(result.list[i].type == Cell::List && count > widestCount){
+                    widest = i;
+                    widestCount = count;
+                }
+            }
+            if(widest == 0)
+                break; // Only leaves left, nothing more to cut.
+
+            stageCells.push_back(result.list[widest]);
+            result.list[widest] = Cell(Cell::Symbol, scratchName(stageCells.size() - 1));
+        }
+        return result;
+    }
+
+    // One stage's streams (plus its output) should fit in L1 and all of a
+    // tile's scratch buffers in L2.
+    static size_t defaultTileRows(size_t maxStreams, size_t stageCount){
+        size_t l1 = cacheSize(0, 32*1024);
+        size_t l2 = cacheSize(2, 256*1024);
+        size_t rows = std::min(l1 / ((maxStreams + 1) * sizeof(double)),
+                               l2 / 2 / (stageCount * sizeof(double)));
+        return std::max<size_t>(64, rows & ~size_t(7));
+    }
+};
+
+
+// Fused evaluation of chained formulas, e.g. a discount factor feeding
+// several present values. Formulas are named and read the inputs and each
+// other's results by name; they compile into a single kernel that computes
+// every requested output in one pass over the inputs. Formulas read by other
+// formulas stay in registers instead of round tripping through an
+// intermediate array, and formulas no output depends on are not evaluated.
+class FusedBatchFunction{
+public:
+    typedef std::vector<std::pair<std::string, Cell>> Formulas;
+
+private:
+    std::unique_ptr<CodeGenBatchFunction> kernel;
+
+public:
+    FusedBatchFunction(const std::vector<std::string> &inputs, const Formulas &formulas,
+                       const std::vector<std::string> &outputs,
+                       const BatchOptions &options = BatchOptions()){
+        std::map<std::string, const Cell *> byName;
+        for(const auto &f : formulas){
+            if(std::find(inputs.begin(), inputs.end(), f.first) != inputs.end())
+                throw std::runtime_error("Formula shadows input: " + f.first);
+            if(!byName.insert(std::make_pair(f.first, &f.second)).second)
+                throw std::runtime_error("Duplicate formula: " + f.first);
+        }
+
+        // Formulas read by other formulas become bindings, in dependency
+        // order. An output that nothing else reads is compiled in place.
+        CodeGenBatchFunction::Bindings bindings;
+        std::map<std::string, int> state; // 1 while visiting, 2 once bound.
+        std::vector<Cell> outputCells;
+        for(const std::string &name : outputs){
+            auto f = byName.find(name);
+            if(f == byName.end())
+                throw std::runtime_error("Unknown output formula: " + name);
+            if(isRead(name, formulas)){
+                order(name, byName, state, bindings);
+                outputCells.push_back(Cell(Cell::Symbol, name));
+            }else{
+                visit(*f->second, byName, state, bindings);
+                outputCells.push_back(*f->second);
+            }
+        }
+
+        kernel.reset(new CodeGenBatchFunction(inputs, bindings, outputCells, options));
+    }
+
+    size_t getOutputCount() const { return kernel->getOutputCount(); }
+
+    // outs[k] receives output k for every row.
+    void operator()(const double * const *columns, double * const *outs, size_t rows) const {
+        kernel->evaluateOutputs(columns, outs, rows);
+    }
+
+    // See CodeGenBatchFunction::evaluateChecked.
+    FloatExceptions evaluateChecked(const double * const *columns, double * const *outs, size_t rows,
+                                    size_t maxRows = 64) const {
+        return kernel->evaluateChecked(columns, outs, rows, maxRows);
+    }
+
+private:
+    static bool reads(const Cell &c, const std::string &name){
+        if(c.type == Cell::Symbol)
+            return c.val == name;
+        if(c.type == Cell::List)
+            for(size_t i = 1; i < c.list.size(); ++i)
+                if(reads(c.list[i], name))
+                    return true;
+        return false;
+    }
+
+    static bool isRead(const std::string &name, const Formulas &formulas){
+        for(const auto &f : formulas)
+            if(f.first != name && reads(f.second, name))
+                return true;
+        return false;
+    }
+
+    // Bind the formulas c reads, dependencies first.
+    static void visit(const Cell &c, const std::map<std::string, const Cell *> &byName,
+                      std::map<std::string, int> &state, CodeGenBatchFunction::Bindings &bindings){
+        if(c.type == Cell::Symbol){
+            if(byName.count(c.val))
+                order(c.val, byName, state, bindings);
+        }else if(c.type == Cell::List){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                visit(c.list[i], byName, state, bindings);
+        }
+    }
+
+    static void order(const std::string &name, const std::map<std::string, const Cell *> &byName,
+                      std::map<std::string, int> &state, CodeGenBatchFunction::Bindings &bindings){
+        if(state[name] == 2)
+            return;
+        if(state[name] == 1)
+            throw std::runtime_error("Formula depends on itself: " + name);
+        state[name] = 1;
+        const Cell &c = *byName.at(name);
+        visit(c, byName, state, bindings);
+        bindings.push_back(std::make_pair(name, c));
+        state[name] = 2;
+    }
+};
+
+
+// Time series kernels. Rows are consecutive observations, and besides the
+// batch operators the expression may use window operators whose value
+// depends on earlier rows:
+//   (lag x k)          x from k rows back, NaN for the first k rows
+//   (diff x)           x minus the previous x, NaN for the first row
+//   (ema x alpha)      exponential moving average, starting at the first x;
+//                      a NaN average restarts at the next row
+//   (rolling-sum x n)  sum of the last n values of x (fewer at the start),
+//                      NaN or infinite while such values are among them
+//   (cumsum x)         running sum of x
+// k, n and alpha must be numbers. Running sums and averages live in
+// registers and lag/rolling-sum windows in ring buffers for the whole loop,
+// and are written back to a State when the kernel returns. Consecutive calls
+// continue where the previous one stopped, so a stream can be processed a
+// batch at a time with the same results as one call over the whole series.
+// Rows are evaluated one at a time (each depends on the one before), only
+// CompileOptions::flushDenormals applies.
+class CodeGenSeriesFunction : public Visitor<AsmJit::XmmVar>{
+public:
+    // Carried values of every window operator, see newState.
+    typedef std::vector<double> State;
+
+private:
+    enum WindowKind {Lag, Diff, Ema, RollingSum, CumSum};
+
+    // Window operator instance, in evaluation order. Offsets index the state
+    // in doubles; ring indexes are stored as integers in their double slot.
+    struct Window{
+        WindowKind kind;
+        size_t length; // Ring length of lag and rolling-sum.
+        double alpha;
+        size_t indexOffset;
+        size_t accOffset;
+        size_t ringOffset;
+        AsmJit::GpVar index;
+        AsmJit::XmmVar acc;
+        // Rolling-sum state after acc, kept in memory rather than registers:
+        // the sum of the values since the ring last wrapped, then the counts
+        // of NaN, +inf and -inf inside the window.
+        size_t freshOffset() const { return accOffset + 1; }
+        size_t countOffset(size_t k) const { return accOffset + 2 + k; }
+    };
+
+    AsmJit::X86Compiler compiler;
+    std::map<std::string, int> argNameToIndex;
+    CompileOptions options;
+    std::vector<Window> windows;
+    State initialState;
+    State state;
+
+    // Per-generation state used by the handlers below.
+    size_t nextWindow;
+    std::map<int, AsmJit::GpVar> columnVars;
+    AsmJit::GpVar rowVar;
+    AsmJit::GpVar stateVar;
+    std::map<uint64_t, AsmJit::XmmVar> constants; // Keyed by bit pattern.
+
+    typedef void (*FuncPtrType)(const double * const *columns, double *out, size_t rows, double *state);
+    FuncPtrType generatedFunction;
+public:
+    CodeGenSeriesFunction(const std::vector<std::string> &names, const Cell &cell,
+                          const CompileOptions &options = CompileOptions())
+        : options(options), nextWindow(0){
+        using namespace AsmJit;
+
+        functionMap["+"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.addsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["-"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.subsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["*"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.mulsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["/"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.divsd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["sqrt"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.sqrtsd(args[0], args[0]);
+            return args[0];
+        };
+
+        // Constants are materialised once before the loop, hand out a copy.
+        numberHandler = [&](const std::string &number) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            compiler.movapd(v, constants.at(doubleBits(std::atof(number.c_str()))));
+            return v;
+        };
+
+        for(size_t i = 0; i < names.size(); ++i)
+            argNameToIndex[names[i]] = i;
+
+        symbolHandler = [&](const std::string name) -> XmmVar{
+            XmmVar v(compiler.newXmmVar());
+            compiler.movsd(v, ptr(columnVars.at(argNameToIndex.at(name)), rowVar, 3));
+            return v;
+        };
+
+        collectWindows(cell);
+        state = initialState;
+        generatedFunction = generate(cell);
+    }
+
+    FuncPtrType generate(const Cell &c){
+        using namespace AsmJit;
+        TraceScope trace("compile series", "compiler");
+        compiler.setProperty(kX86PropertyEmitInPlace, options.emitInPlace);
+        compiler.newFunc(kX86FuncConvDefault,
+                FuncBuilder4<Void, const double * const *, double *, size_t, double *>());
+
+        GpVar columns(compiler.getGpArg(0));
+        GpVar out(compiler.getGpArg(1));
+        GpVar rows(compiler.getGpArg(2));
+        stateVar = compiler.getGpArg(3);
+
+        GpVar savedMxcsr;
+        if(options.flushDenormals)
+            savedMxcsr = emitFlushDenormals(compiler);
+
+        hoistLoopInvariants(c, columns);
+        for(Window &w : windows){
+            if(w.kind == Lag || w.kind == RollingSum){
+                w.index = compiler.newGpVar();
+                compiler.mov(w.index, ptr(stateVar, w.indexOffset*sizeof(double)));
+            }
+            if(w.kind != Lag){
+                w.acc = compiler.newXmmVar();
+                compiler.movsd(w.acc, ptr(stateVar, w.accOffset*sizeof(double)));
+            }
+        }
+
+        rowVar = compiler.newGpVar();
+        compiler.xor_(rowVar, rowVar);
+        Label L_Loop(compiler.newLabel());
+        Label L_Exit(compiler.newLabel());
+        compiler.cmp(rowVar, rows);
+        compiler.jae(L_Exit);
+        compiler.bind(L_Loop);
+        nextWindow = 0;
+        XmmVar v = eval(c);
+        compiler.movsd(ptr(out, rowVar, 3), v);
+        compiler.unuse(v);
+        compiler.add(rowVar, imm(1));
+        compiler.cmp(rowVar, rows);
+        compiler.jb(L_Loop);
+
+        compiler.bind(L_Exit);
+        for(const Window &w : windows){
+            if(w.kind == Lag || w.kind == RollingSum)
+                compiler.mov(ptr(stateVar, w.indexOffset*sizeof(double)), w.index);
+            if(w.kind != Lag)
+                compiler.movsd(ptr(stateVar, w.accOffset*sizeof(double)), w.acc);
+        }
+        if(options.flushDenormals)
+            emitRestoreMxcsr(compiler, savedMxcsr);
+        compiler.endFunc();
+        TraceScope assemble("assemble", "compiler");
+        return reinterpret_cast<FuncPtrType>(compiler.make());
+    }
+
+    // Continue the function's own stream.
+    void operator()(const double * const *columns, double *out, size_t rows){
+        generatedFunction(columns, out, rows, state.data());
+    }
+
+    // Continue the stream whose state is s, for several independent streams
+    // through one function.
+    void operator()(State &s, const double * const *columns, double *out, size_t rows) const {
+        if(s.size() != initialState.size())
+            throw std::runtime_error("Series state does not belong to this function");
+        generatedFunction(columns, out, rows, s.data());
+    }
+
+    // State before the first row.
+    State newState() const { return initialState; }
+
+    // Restart the function's own stream.
+    void reset() { state = initialState; }
+
+    ~CodeGenSeriesFunction(){
+        AsmJit::MemoryManager::getGlobal()->free((void*)generatedFunction);
+    }
+
+    // Window operators evaluate their series argument only.
+    AsmJit::XmmVar eval(const Cell &c){
+        if(c.type == Cell::List && isWindow(c.list[0].val)){
+            AsmJit::XmmVar x = eval(c.list[1]);
+            return emitWindow(windows.at(nextWindow++), x);
+        }
+        return Visitor<AsmJit::XmmVar>::eval(c);
+    }
+
+private:
+    static bool isWindow(const std::string &op){
+        return op == "lag" || op == "diff" || op == "ema" || op == "rolling-sum" || op == "cumsum";
+    }
+
+    // Assign state slots in the order eval visits the window operators:
+    // arguments first, left to right.
+    void collectWindows(const Cell &c){
+        if(c.type != Cell::List)
+            return;
+        const std::string &op = c.list[0].val;
+        if(!isWindow(op)){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                collectWindows(c.list[i]);
+            return;
+        }
+        bool hasParameter = op == "lag" || op == "ema" || op == "rolling-sum";
+        if(c.list.size() != (hasParameter ? 3u : 2u))
+            throw std::runtime_error("Wrong number of arguments: " + formatCell(c));
+        collectWindows(c.list[1]);
+
+        double parameter = 0;
+        if(hasParameter){
+            if(c.list[2].type != Cell::Number)
+                throw std::runtime_error("Window parameter must be a number: " + formatCell(c));
+            parameter = std::atof(c.list[2].val.c_str());
+        }
+
+        const double nan = std::nan("");
+        Window w;
+        w.length = 0;
+        w.alpha = 0;
+        w.indexOffset = w.accOffset = w.ringOffset = initialState.size();
+        if(op == "lag" || op == "rolling-sum"){
+            if(parameter < 1 || parameter != std::floor(parameter) || parameter > 1e8)
+                throw std::runtime_error("Window length must be a positive integer: " + formatCell(c));
+            w.kind = op == "lag" ? Lag : RollingSum;
+            w.length = size_t(parameter);
+            initialState.push_back(0); // Ring index 0 has the bits of +0.0.
+            if(w.kind == RollingSum){
+                w.accOffset = initialState.size();
+                initialState.push_back(0); // Sum of the finite values.
+                initialState.push_back(0); // The same since the ring wrapped.
+                initialState.resize(initialState.size() + 3, 0.0); // NaN and infinity counts.
+            }
+            w.ringOffset = initialState.size();
+            initialState.resize(initialState.size() + w.length, w.kind == Lag ? nan : 0.0);
+        }else if(op == "ema"){
+            if(!(parameter > 0 && parameter <= 1))
+                throw std::runtime_error("Smoothing factor must be in (0, 1]: " + formatCell(c));
+            w.kind = Ema;
+            w.alpha = parameter;
+            initialState.push_back(nan);
+        }else{
+            w.kind = op == "diff" ? Diff : CumSum;
+            initialState.push_back(op == "diff" ? nan : 0.0);
+        }
+        windows.push_back(w);
+    }
+
+    AsmJit::XmmVar emitWindow(Window &w, AsmJit::XmmVar x){
+        using namespace AsmJit;
+        XmmVar r(compiler.newXmmVar());
+        switch(w.kind){
+            case Lag:{
+                Mem slot(ptr(stateVar, w.index, 3, w.ringOffset*sizeof(double)));
+                compiler.movsd(r, slot);
+                compiler.movsd(slot, x);
+                advanceRing(w);
+                break;
+            }case RollingSum:{
+                Mem slot(ptr(stateVar, w.index, 3, w.ringOffset*sizeof(double)));
+                // NaNs and infinities are counted rather than summed, so
+                // one leaving the window doesn't leave the sum NaN.
+                XmmVar old(compiler.newXmmVar());
+                compiler.movsd(old, slot);
+                compiler.movsd(slot, x);
+                accumulateRolling(w, x, true);
+                accumulateRolling(w, old, false);
+                compiler.unuse(old);
+                advanceRing(w);
+                restartRollingSum(w);
+
+                // sum + (NaN if NaNs) + (+inf if +infs) + (-inf if -infs),
+                // where an all ones mask is a NaN and +inf + -inf is NaN.
+                static const double special[3] = {0.0, INFINITY, -INFINITY};
+                compiler.movapd(r, w.acc);
+                for(size_t k = 0; k < 3; ++k){
+                    XmmVar m(compiler.newXmmVar());
+                    compiler.movsd(m, stateSlot(w.countOffset(k)));
+                    compiler.cmpsd(m, constants.at(doubleBits(0.0)), imm(6)); // Greater than.
+                    if(k > 0)
+                        compiler.andpd(m, constants.at(doubleBits(special[k])));
+                    compiler.addsd(r, m);
+                    compiler.unuse(m);
+                }
+                break;
+            }case Diff:{
+                compiler.movapd(r, x);
+                compiler.subsd(r, w.acc);
+                compiler.movapd(w.acc, x);
+                break;
+            }case Ema:{
+                // r = acc + alpha*(x - acc), or x where that is NaN (the
+                // first row), selected without branching.
+                XmmVar t(compiler.newXmmVar());
+                compiler.movapd(t, x);
+                compiler.subsd(t, w.acc);
+                compiler.mulsd(t, constants.at(doubleBits(w.alpha)));
+                compiler.addsd(t, w.acc);
+                compiler.movapd(r, t);
+                compiler.cmpsd(r, t, imm(3)); // Unordered: all ones if NaN.
+                compiler.andpd(x, r);
+                compiler.andnpd(r, t);
+                compiler.orpd(r, x);
+                compiler.unuse(t);
+                compiler.movapd(w.acc, r);
+                break;
+            }case CumSum:{
+                compiler.addsd(w.acc, x);
+                compiler.movapd(r, w.acc);
+                break;
+            }
+        }
+        compiler.unuse(x);
+        return r;
+    }
+
+    // Add (or remove) v to the sum if it is finite, otherwise 1 to the count
+    // of NaNs, +infs or -infs.
+    void accumulateRolling(Window &w, const AsmJit::XmmVar &v, bool add){
+        using namespace AsmJit;
+        XmmVar mask(compiler.newXmmVar());
+        XmmVar tmp(compiler.newXmmVar());
+        for(size_t k = 0; k < 3; ++k){
+            compiler.movapd(mask, v);
+            if(k == 0)
+                compiler.cmpsd(mask, v, imm(3)); // Unordered: NaN.
+            else
+                compiler.cmpsd(mask, constants.at(doubleBits(k == 1 ? INFINITY : -INFINITY)), imm(0));
+            compiler.andpd(mask, constants.at(doubleBits(1.0)));
+            compiler.movsd(tmp, stateSlot(w.countOffset(k)));
+            if(add) compiler.addsd(tmp, mask);
+            else compiler.subsd(tmp, mask);
+            compiler.movsd(stateSlot(w.countOffset(k)), tmp);
+        }
+        emitFinite(mask, v, tmp);
+        if(add){
+            compiler.addsd(w.acc, mask);
+            compiler.movsd(tmp, stateSlot(w.freshOffset()));
+            compiler.addsd(tmp, mask);
+            compiler.movsd(stateSlot(w.freshOffset()), tmp);
+        }else{
+            compiler.subsd(w.acc, mask);
+        }
+        compiler.unuse(mask);
+        compiler.unuse(tmp);
+    }
+
+    // finite = v if v is finite, else 0. Clobbers tmp.
+    void emitFinite(const AsmJit::XmmVar &finite, const AsmJit::XmmVar &v, const AsmJit::XmmVar &tmp){
+        using namespace AsmJit;
+        compiler.movapd(tmp, v);
+        compiler.andpd(tmp, constants.at(0x7fffffffffffffffull)); // |v|
+        compiler.cmpsd(tmp, constants.at(doubleBits(INFINITY)), imm(1)); // Less than.
+        compiler.movapd(finite, v);
+        compiler.andpd(finite, tmp);
+    }
+
+    // Adding new values and subtracting old ones accumulates rounding
+    // errors. When the ring wraps the window holds exactly the values added
+    // since it last wrapped, so the running sum restarts from their plain
+    // sum: the error never spans more than 2n rows. Selected with cmov
+    // rather than a branch.
+    void restartRollingSum(Window &w){
+        using namespace AsmJit;
+        GpVar sum(compiler.newGpVar());
+        GpVar fresh(compiler.newGpVar());
+        GpVar zero(compiler.newGpVar());
+        compiler.movq(sum, w.acc);
+        compiler.mov(fresh, stateSlot(w.freshOffset()));
+        compiler.xor_(zero, zero);
+        compiler.cmp(w.index, imm(0));
+        compiler.cmove(sum, fresh);
+        compiler.cmove(fresh, zero);
+        compiler.movq(w.acc, sum);
+        compiler.mov(stateSlot(w.freshOffset()), fresh);
+        compiler.unuse(sum);
+        compiler.unuse(fresh);
+        compiler.unuse(zero);
+    }
+
+    AsmJit::Mem stateSlot(size_t offset) const {
+        return AsmJit::ptr(stateVar, offset*sizeof(double));
+    }
+
+    void advanceRing(Window &w){
+        using namespace AsmJit;
+        GpVar zero(compiler.newGpVar());
+        compiler.xor_(zero, zero);
+        compiler.add(w.index, imm(1));
+        compiler.cmp(w.index, imm(w.length));
+        compiler.cmove(w.index, zero);
+        compiler.unuse(zero);
+    }
+
+    void hoistLoopInvariants(const Cell &c, const AsmJit::GpVar &columns){
+        using namespace AsmJit;
+        if(c.type == Cell::Symbol){
+            int index = argNameToIndex.at(c.val);
+            if(columnVars.find(index) == columnVars.end()){
+                GpVar p(compiler.newGpVar());
+                compiler.mov(p, ptr(columns, index*sizeof(double *)));
+                columnVars[index] = p;
+            }
+        }else if(c.type == Cell::Number){
+            hoistConstant(std::atof(c.val.c_str()));
+        }else if(c.type == Cell::List && isWindow(c.list[0].val)){
+            if(c.list[0].val == "ema")
+                hoistConstant(std::atof(c.list[2].val.c_str()));
+            if(c.list[0].val == "rolling-sum"){
+                hoistConstant(0.0);
+                hoistConstant(1.0);
+                hoistConstant(INFINITY);
+                hoistConstant(-INFINITY);
+                hoistConstantBits(0x7fffffffffffffffull);
+            }
+            hoistLoopInvariants(c.list[1], columns);
+        }else if(c.type == Cell::List){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                hoistLoopInvariants(c.list[i], columns);
+        }
+    }
+
+    static uint64_t doubleBits(double x){
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    void hoistConstant(double x){
+        hoistConstantBits(doubleBits(x));
+    }
+
+    void hoistConstantBits(uint64_t bits){
+        using namespace AsmJit;
+        if(constants.find(bits) != constants.end())
+            return;
+        XmmVar v(compiler.newXmmVar());
+        GpVar gpreg(compiler.newGpVar());
+        compiler.mov(gpreg, bits);
+        compiler.movq(v, gpreg);
+        compiler.unuse(gpreg);
+        constants[bits] = v;
+    }
+};
+
+
+// Minimum and maximum of each column over blocks of rows (a "zone map").
+// NaNs are ignored since a NaN row fails every predicate; a block holding
+// only NaNs has an empty zone (low > high).
+class ZoneMap{
+private:
+    size_t rows;
+    size_t blockRows;
+    std::vector<std::vector<double>> lows;
+    std::vector<std::vector<double>> highs;
+
+public:
+    ZoneMap(const double * const *columns, size_t columnCount, size_t rows, size_t blockRows = 4096)
+        : rows(rows), blockRows(std::max<size_t>(blockRows, 1)){
+        size_t blocks = (rows + this->blockRows - 1) / this->blockRows;
+        for(size_t i = 0; i < columnCount; ++i){
+            lows.push_back(std::vector<double>(blocks));
+            highs.push_back(std::vector<double>(blocks));
+            for(size_t b = 0; b < blocks; ++b){
+                double low = INFINITY, high = -INFINITY;
+                size_t end = std::min(rows, (b + 1)*this->blockRows);
+                for(size_t r = b*this->blockRows; r < end; ++r){
+                    double x = columns[i][r];
+                    low = x < low ? x : low;
+                    high = x > high ? x : high;
+                }
+                lows[i][b] = low;
+                highs[i][b] = high;
+            }
+        }
+    }
+
+    size_t getRowCount() const { return rows; }
+    size_t getBlockRows() const { return blockRows; }
+    size_t getBlockCount() const { return lows.empty() ? 0 : lows[0].size(); }
+    size_t getColumnCount() const { return lows.size(); }
+
+    const double *getLows(size_t column) const { return lows.at(column).data(); }
+    const double *getHighs(size_t column) const { return highs.at(column).data(); }
+
+    bool isEmpty(size_t column, size_t block) const { return lows[column][block] > highs[column][block]; }
+};
+
+
+// Interval arithmetic version of an expression: given the range of every
+// argument over a block of rows it computes a range holding the expression's
+// value for every row of the block, so filters can skip blocks whose range
+// cannot satisfy a predicate.
+//
+// An interval [lo, hi] is held as (-lo, hi) in the two lanes of a register
+// and the kernel runs with MXCSR rounding toward +inf (and FTZ/DAZ off),
+// which rounds the upper bound up and, through the negation, the lower bound
+// down: addition is one addpd and the bounds stay sound under rounding. The
+// bounds are for the computed doubles, they are not widened for constants
+// that aren't exactly representable. Division by an interval holding zero
+// gives the whole real line. sqrt only bounds the non-negative part of its
+// argument (rows with a negative argument are NaN and match no predicate).
+class CodeGenIntervalFunction : public Visitor<AsmJit::XmmVar>{
+private:
+    AsmJit::X86Compiler compiler;
+    std::map<std::string, int> argNameToIndex;
+
+    // Per-generation state used by the handlers below.
+    std::map<int, std::pair<AsmJit::GpVar, AsmJit::GpVar>> columnVars; // Low and high arrays.
+    AsmJit::GpVar blockVar;
+    std::map<std::pair<uint64_t, uint64_t>, AsmJit::XmmVar> constants; // Lanes, by bit pattern.
+    std::vector<int> usedColumns;
+
+    // lows/highs hold one array of block bounds per argument.
+    typedef void (*FuncPtrType)(const double * const *lows, const double * const *highs,
+                                double *outLows, double *outHighs, size_t blocks);
+    FuncPtrType generatedFunction;
+public:
+    CodeGenIntervalFunction(const std::vector<std::string> &names, const Cell &cell){
+        using namespace AsmJit;
+
+        functionMap["+"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.addpd(args[0], args[1]);
+            return args[0];
+        };
+
+        // a - b = [a.lo - b.hi, a.hi - b.lo]: add b with its lanes swapped.
+        functionMap["-"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            compiler.shufpd(args[1], args[1], imm(1));
+            compiler.addpd(args[0], args[1]);
+            return args[0];
+        };
+
+        functionMap["*"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            return emitMultiply(args[0], args[1]);
+        };
+
+        // a * [1/b.hi, 1/b.lo], or the whole line if b holds zero.
+        functionMap["/"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            XmmVar r(compiler.newXmmVar());
+            XmmVar d(compiler.newXmmVar());
+            compiler.movapd(d, args[1]);
+            compiler.shufpd(d, d, imm(1));
+            compiler.xorpd(d, constant(-0.0, -0.0));
+            compiler.movapd(r, constant(1.0, 1.0));
+            compiler.divpd(r, d); // (-1/b.hi, 1/b.lo), rounded up.
+            compiler.unuse(d);
+            XmmVar q = emitMultiply(args[0], r);
+
+            // -b.lo >= 0 and b.hi >= 0 (or NaN) in both lanes.
+            XmmVar m(compiler.newXmmVar());
+            XmmVar s(compiler.newXmmVar());
+            compiler.movapd(m, args[1]);
+            compiler.cmppd(m, constant(0.0, 0.0), imm(5)); // Not less than.
+            compiler.movapd(s, m);
+            compiler.shufpd(s, s, imm(1));
+            compiler.andpd(m, s);
+            compiler.movapd(s, constant(INFINITY, INFINITY));
+            compiler.andpd(s, m);
+            compiler.andnpd(m, q);
+            compiler.orpd(m, s);
+            compiler.unuse(s);
+            compiler.unuse(q);
+            return m;
+        };
+
+        // Both bounds are rounded up by sqrtpd, the lower one is then
+        // stepped down by one ulp.
+        functionMap["sqrt"] = [&](const std::vector<XmmVar> &args) -> XmmVar{
+            XmmVar x(args[0]);
+            compiler.xorpd(x, constant(-0.0, 0.0));
+            compiler.maxpd(x, constant(0.0, 0.0));
+            compiler.sqrtpd(x, x);
+            compiler.psubq(x, constantBits(1, 0));
+            compiler.maxpd(x, constant(0.0, 0.0)); // 0 - 1ulp wrapped to a NaN.
+            compiler.xorpd(x, constant(-0.0, 0.0));
+            return x;
+        };
+
+        numberHandler = [&](const std::string &number) -> XmmVar{
+            double x = std::atof(number.c_str());
+            XmmVar v(compiler.newXmmVar());
+            compiler.movapd(v, constant(-x, x));
+            return v;
+        };
+
+        for(size_t i = 0; i < names.size(); ++i)
+            argNameToIndex[names[i]] = i;
+
+        symbolHandler = [&](const std::string name) -> XmmVar{
+            const auto &bounds = columnVars.at(argNameToIndex.at(name));
+            XmmVar v(compiler.newXmmVar());
+            compiler.movsd(v, ptr(bounds.first, blockVar, 3));
+            compiler.movhpd(v, ptr(bounds.second, blockVar, 3));
+            compiler.xorpd(v, constant(-0.0, 0.0));
+            return v;
+        };
+
+        generatedFunction = generate(cell);
+    }
+
+    FuncPtrType generate(const Cell &c){
+        using namespace AsmJit;
+        TraceScope trace("compile interval", "compiler");
+        compiler.setProperty(kX86PropertyEmitInPlace, true);
+        compiler.newFunc(kX86FuncConvDefault,
+                FuncBuilder5<Void, const double * const *, const double * const *, double *, double *, size_t>());
+
+        GpVar lows(compiler.getGpArg(0));
+        GpVar highs(compiler.getGpArg(1));
+        GpVar outLows(compiler.getGpArg(2));
+        GpVar outHighs(compiler.getGpArg(3));
+        GpVar blocks(compiler.getGpArg(4));
+
+        GpVar savedMxcsr = emitUpdateMxcsr(compiler, mxcsrRoundingMask | mxcsrFlushDenormals, mxcsrRoundUp);
+
+        constant(-0.0, 0.0);
+        hoistLoopInvariants(c, lows, highs);
+        for(const auto &column : columnVars)
+            usedColumns.push_back(column.first);
+
+        blockVar = compiler.newGpVar();
+        compiler.xor_(blockVar, blockVar);
+        Label L_Loop(compiler.newLabel());
+        Label L_Exit(compiler.newLabel());
+        compiler.cmp(blockVar, blocks);
+        compiler.jae(L_Exit);
+        compiler.bind(L_Loop);
+        XmmVar v = eval(c);
+        compiler.xorpd(v, constant(-0.0, 0.0));
+        compiler.movlpd(ptr(outLows, blockVar, 3), v);
+        compiler.movhpd(ptr(outHighs, blockVar, 3), v);
+        compiler.unuse(v);
+        compiler.add(blockVar, imm(1));
+        compiler.cmp(blockVar, blocks);
+        compiler.jb(L_Loop);
+
+        compiler.bind(L_Exit);
+        emitRestoreMxcsr(compiler, savedMxcsr);
+        compiler.endFunc();
+        TraceScope assemble("assemble", "compiler");
+        return reinterpret_cast<FuncPtrType>(compiler.make());
+    }
+
+    // Bounds of the expression over every block of zones. A NaN bound means
+    // the range is unknown.
+    void operator()(const ZoneMap &zones, double *outLows, double *outHighs) const {
+        if(zones.getColumnCount() < argNameToIndex.size())
+            throw std::runtime_error("Zone map has fewer columns than arguments");
+        std::vector<const double *> lows, highs;
+        for(size_t i = 0; i < argNameToIndex.size(); ++i){
+            lows.push_back(zones.getLows(i));
+            highs.push_back(zones.getHighs(i));
+        }
+        generatedFunction(lows.data(), highs.data(), outLows, outHighs, zones.getBlockCount());
+    }
+
+    // Blocks of zones where the expression may take a value in [low, high]
+    // (either may be infinite). Rows of the other blocks can be skipped.
+    std::vector<size_t> candidateBlocks(const ZoneMap &zones, double low, double high) const {
+        size_t blocks = zones.getBlockCount();
+        std::vector<double> outLows(blocks), outHighs(blocks);
+        (*this)(zones, outLows.data(), outHighs.data());
+
+        std::vector<size_t> candidates;
+        for(size_t b = 0; b < blocks; ++b){
+            bool empty = false;
+            for(int column : usedColumns)
+                empty = empty || zones.isEmpty(column, b);
+            if(!empty && !(outHighs[b] < low || outLows[b] > high))
+                candidates.push_back(b);
+        }
+        return candidates;
+    }
+
+    ~CodeGenIntervalFunction(){
+        AsmJit::MemoryManager::getGlobal()->free((void*)generatedFunction);
+    }
+
+private:
+    // The bounds of a product are the least and greatest of the four
+    // products of bounds. With a = (-a.lo, a.hi) and b = (-b.lo, b.hi):
+    //   a * swap(b) and (-a) * b hold the four negated products (rounded up
+    //   for the lower bound), a * b and (-a) * swap(b) the four products.
+    AsmJit::XmmVar emitMultiply(AsmJit::XmmVar a, AsmJit::XmmVar b){
+        using namespace AsmJit;
+        XmmVar bs(compiler.newXmmVar());
+        XmmVar na(compiler.newXmmVar());
+        XmmVar lo(compiler.newXmmVar());
+        XmmVar lo2(compiler.newXmmVar());
+        compiler.movapd(bs, b);
+        compiler.shufpd(bs, bs, imm(1));
+        compiler.movapd(na, a);
+        compiler.xorpd(na, constant(-0.0, -0.0));
+        compiler.movapd(lo, a);
+        compiler.mulpd(lo, bs);
+        compiler.movapd(lo2, na);
+        compiler.mulpd(lo2, b);
+        compiler.mulpd(a, b);
+        compiler.mulpd(na, bs);
+        compiler.maxpd(lo, lo2);
+        compiler.maxpd(a, na);
+        compiler.unuse(lo2);
+        compiler.unuse(na);
+        compiler.unuse(bs);
+
+        // (max(lo), max(hi)) from the lanes of lo and a.
+        XmmVar r(compiler.newXmmVar());
+        compiler.movapd(r, lo);
+        compiler.unpcklpd(r, a);
+        compiler.unpckhpd(lo, a);
+        compiler.maxpd(r, lo);
+        compiler.unuse(lo);
+        compiler.unuse(a);
+        compiler.unuse(b);
+        return r;
+    }
+
+    void hoistLoopInvariants(const Cell &c, const AsmJit::GpVar &lows, const AsmJit::GpVar &highs){
+        using namespace AsmJit;
+        if(c.type == Cell::Symbol){
+            int index = argNameToIndex.at(c.val);
+            if(columnVars.find(index) == columnVars.end()){
+                GpVar low(compiler.newGpVar());
+                GpVar high(compiler.newGpVar());
+                compiler.mov(low, ptr(lows, index*sizeof(double *)));
+                compiler.mov(high, ptr(highs, index*sizeof(double *)));
+                columnVars[index] = std::make_pair(low, high);
+            }
+        }else if(c.type == Cell::Number){
+            double x = std::atof(c.val.c_str());
+            constant(-x, x);
+        }else if(c.type == Cell::List){
+            const std::string &op = c.list[0].val;
+            if(op == "*" || op == "/")
+                constant(-0.0, -0.0);
+            if(op == "/"){
+                constant(1.0, 1.0);
+                constant(0.0, 0.0);
+                constant(INFINITY, INFINITY);
+            }
+            if(op == "sqrt"){
+                constant(0.0, 0.0);
+                constantBits(1, 0);
+            }
+            for(size_t i = 1; i < c.list.size(); ++i)
+                hoistLoopInvariants(c.list[i], lows, highs);
+        }
+    }
+
+    static uint64_t doubleBits(double x){
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    AsmJit::XmmVar constant(double low, double high){
+        return constantBits(doubleBits(low), doubleBits(high));
+    }
+
+    // Lane constants are materialised before the loop on first use (the
+    // hoisting pass requests every one the loop body uses).
+    AsmJit::XmmVar constantBits(uint64_t low, uint64_t high){
+        using namespace AsmJit;
+        auto key = std::make_pair(low, high);
+        auto found = constants.find(key);
+        if(found != constants.end())
+            return found->second;
+        XmmVar v(compiler.newXmmVar());
+        XmmVar h(compiler.newXmmVar());
+        GpVar gpreg(compiler.newGpVar());
+        compiler.mov(gpreg, low);
+        compiler.movq(v, gpreg);
+        compiler.mov(gpreg, high);
+        compiler.movq(h, gpreg);
+        compiler.unuse(gpreg);
+        compiler.unpcklpd(v, h);
+        compiler.unuse(h);
+        constants[key] = v;
+        return v;
+    }
+};
+
+
+// Memory from malloc is released with free.
+struct FreeDeleter{
+    void operator()(void *p) const { std::free(p); }
+};
+typedef std::unique_ptr<double[], FreeDeleter> Column;
+
+// NUMA layout of the machine, read from sysfs and restricted to the CPUs
+// the calling thread may run on (taskset, cgroup cpusets). Machines without
+// NUMA information are treated as a single node holding every allowed CPU.
+struct NumaTopology{
+    std::vector<std::vector<int>> nodeCpus;
+
+    NumaTopology(){
+        std::vector<int> allowed = allowedCpus();
+        for(int node = 0; ; ++node){
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if(!f)
+                break;
+            std::string list;
+            std::getline(f, list);
+            std::vector<int> cpus;
+            for(int cpu : parseCpuList(list))
+                if(std::binary_search(allowed.begin(), allowed.end(), cpu))
+                    cpus.push_back(cpu);
+            if(!cpus.empty())
+                nodeCpus.push_back(cpus);
+        }
+
+        if(nodeCpus.empty())
+            nodeCpus.push_back(allowed);
+    }
+
+    // CPUs in the calling thread's affinity mask, ascending. Without one,
+    // the first hardware_concurrency CPUs.
+    static std::vector<int> allowedCpus(){
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == 0)
+            for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if(CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+#endif
+        if(cpus.empty()){
+            unsigned int n = std::max(1u, std::thread::hardware_concurrency());
+            for(unsigned int i = 0; i < n; ++i)
+                cpus.push_back(i);
+        }
+        return cpus;
+    }
+
+    // Parse lists such as "0-3,8-11".
+    static std::vector<int> parseCpuList(const std::string &list){
+        std::vector<int> cpus;
+        const char *s = list.c_str();
+        while(std::isdigit(*s)){
+            char *end;
+            int first = std::strtol(s, &end, 10);
+            int last = first;
+            if(*end == '-')
+                last = std::strtol(end + 1, &end, 10);
+            for(int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+            s = *end == ',' ? end + 1 : end;
+        }
+        return cpus;
+    }
+};
+
+// Runs batch kernels on a pool of worker threads pinned to CPUs, node by
+// node. Rows are split into one contiguous, page aligned range per worker
+// and the same split is used to first-touch the buffers handed out by
+// allocateColumn, so on Linux each worker reads and writes pages that live
+// on its own node.
+//
+// Code is not replicated per node: kernels are a few hundred bytes, stay
+// resident in every core's instruction cache and so gain nothing from it.
+class BatchExecutor{
+private:
+    std::vector<std::thread> workers;
+    std::vector<int> workerNodes;
+    std::vector<bool> workerPinned;
+
+    std::mutex runMutex; // Held by the caller for a whole run.
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void (size_t worker)> *job;
+    std::exception_ptr error; // First exception thrown by a worker this run.
+    size_t generation;
+    size_t pending;
+    bool stopping;
+
+    // Keep partition boundaries on 4KB pages so no page is shared between
+    // workers (and hence nodes).
+    static const size_t rowsPerPage = 4096 / sizeof(double);
+
+public:
+    // threads == 0 uses every CPU of every node.
+    explicit BatchExecutor(size_t threads = 0) : job(nullptr), generation(0), pending(0), stopping(false){
+        NumaTopology topology;
+        std::vector<std::pair<int, int>> cpus; // (node, cpu), node major.
+        for(size_t node = 0; node < topology.nodeCpus.size(); ++node)
+            for(int cpu : topology.nodeCpus[node])
+                cpus.push_back(std::make_pair(int(node), cpu));
+
+        if(threads == 0)
+            threads = cpus.size();
+
+        for(size_t i = 0; i < threads; ++i){
+            // Spread workers evenly over the node major CPU list.
+            const std::pair<int, int> &placement = cpus[i * cpus.size() / threads];
+            workerNodes.push_back(placement.first);
+            workers.push_back(std::thread(&BatchExecutor::workerLoop, this, i));
+            workerPinned.push_back(pin(workers.back(), placement.second));
+        }
+    }
+
+    ~BatchExecutor(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(std::thread &t : workers)
+            t.join();
+    }
+
+    size_t getWorkerCount() const { return workers.size(); }
+    int getWorkerNode(size_t worker) const { return workerNodes[worker]; }
+    // Workers that could not be pinned (e.g. the CPU was taken out of the
+    // process' cpuset meanwhile) run wherever the scheduler puts them.
+    bool isWorkerPinned(size_t worker) const { return workerPinned[worker]; }
+
+    // Rows [first, second) owned by the given worker.
+    std::pair<size_t, size_t> partition(size_t rows, size_t worker) const {
+        size_t pages = (rows + rowsPerPage - 1) / rowsPerPage;
+        size_t begin = std::min(rows, pages * worker / workers.size() * rowsPerPage);
+        size_t end = std::min(rows, pages * (worker + 1) / workers.size() * rowsPerPage);
+        return std::make_pair(begin, end);
+    }
+
+    // Call f(begin, end) on every worker with that worker's partition.
+    void parallelFor(size_t rows, const std::function<void (size_t begin, size_t end)> &f){
+        run([&](size_t worker){
+            std::pair<size_t, size_t> range = partition(rows, worker);
+            if(range.first < range.second)
+                f(range.first, range.second);
+        });
+    }
+
+    // Allocate a column whose pages are first touched (and so placed) by
+    // the workers that will later process them. Fill it with parallelFor
+    // to keep that placement for input data.
+    Column allocateColumn(size_t rows){
+        void *p = nullptr;
+        if(posix_memalign(&p, 4096, std::max<size_t>(rows, 1) * sizeof(double)) != 0)
+            throw std::bad_alloc();
+        Column column(static_cast<double *>(p));
+        double *data = column.get();
+        parallelFor(rows, [=](size_t begin, size_t end){
+            std::fill(data + begin, data + end, 0.0);
+        });
+        return column;
+    }
+
+    // BatchFunction is any callable taking (columns, out, rows), e.g.
+    // CodeGenBatchFunction or TiledBatchFunction.
+    template <typename BatchFunction>
+    void evaluate(const BatchFunction &f, const std::vector<const double *> &columns,
+                  double *out, size_t rows){
+        parallelFor(rows, [&](size_t begin, size_t end){
+            std::vector<const double *> offsetColumns(columns);
+            for(const double *&c : offsetColumns)
+                c += begin;
+            f(offsetColumns.data(), out + begin, end - begin);
+        });
+    }
+
+    // Nullable columns, see CodeGenValidityFunction. Partitions start on page
+    // boundaries, which are also bitmap word boundaries.
+    void evaluateNullable(const NullableBatchFunction &f, const std::vector<const double *> &columns,
+                          const std::vector<const uint64_t *> &bitmaps,
+                          double *out, uint64_t *outValidity, size_t rows){
+        parallelFor(rows, [&](size_t begin, size_t end){
+            std::vector<const double *> offsetColumns(columns);
+            for(const double *&c : offsetColumns)
+                c += begin;
+            std::vector<const uint64_t *> offsetBitmaps(bitmaps);
+            for(const uint64_t *&b : offsetBitmaps)
+                if(b)
+                    b += begin / 64;
+            f(offsetColumns.data(), offsetBitmaps.data(), out + begin, outValidity + begin / 64, end - begin);
+        });
+    }
+
+    // Array-of-structs input, f compiled with a RowLayout.
+    void evaluateRecords(const CodeGenBatchFunction &f, const void *records, double *out, size_t rows){
+        const char *base = static_cast<const char *>(records);
+        size_t stride = f.getLayout().stride;
+        parallelFor(rows, [&](size_t begin, size_t end){
+            f.evaluateRecords(base + begin*stride, out + begin, end - begin);
+        });
+    }
+
+    // Call f(worker) once on every worker and wait for all of them. Calls
+    // from several threads run one after another; a call from inside a job
+    // would deadlock. The first exception thrown by f is rethrown here once
+    // every worker has finished, the same applies to every method above.
+    void runOnWorkers(const std::function<void (size_t worker)> &f){
+        run(f);
+    }
+
+private:
+    void run(const std::function<void (size_t worker)> &f){
+        std::lock_guard<std::mutex> serialize(runMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        job = &f;
+        error = nullptr;
+        pending = workers.size();
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [&]{ return pending == 0; });
+        job = nullptr;
+        if(error){
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    void workerLoop(size_t index){
+        size_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;){
+            wake.wait(lock, [&]{ return stopping || generation != seen; });
+            if(stopping)
+                return;
+            seen = generation;
+            const std::function<void (size_t)> *current = job;
+            lock.unlock();
+            std::exception_ptr thrown;
+            try{
+                TraceScope trace("batch worker", "executor");
+                (*current)(index);
+            }catch(...){
+                thrown = std::current_exception();
+            }
+            lock.lock();
+            if(thrown && !error)
+                error = thrown;
+            if(--pending == 0)
+                done.notify_one();
+        }
+    }
+
+    // Returns whether t now runs on cpu only; if not, t keeps the affinity
+    // it inherited and a warning is printed.
+    static bool pin(std::thread &t, int cpu){
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int result = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+        if(result == 0)
+            return true;
+        std::cerr << "BatchExecutor: cannot pin a worker to CPU " << cpu << " (" <<
+                     std::strerror(result) << "), it runs unpinned\n";
+#else
+        (void)t; (void)cpu;
+#endif
+        return false;
+    }
+};
+
+
+// Network of named formulas reading the inputs and each other's results.
+// Each formula gets its own batch kernel; the network is levelled
+// topologically and rows are cut into blocks, giving one task per formula
+// and block. A task becomes ready once the formulas it reads have finished
+// the same block, so downstream formulas stream behind upstream ones instead
+// of waiting for them to cover the whole dataset, and independent formulas
+// run side by side.
+//
+// Tasks run on the workers of a BatchExecutor. Every worker owns a deque: it
+// pushes the tasks its completions make ready and pops the newest one (whose
+// inputs are still in its cache), while idle workers steal the oldest task
+// of another worker.
+class FormulaNetwork{
+public:
+    typedef FusedBatchFunction::Formulas Formulas;
+
+private:
+    struct Node{
+        std::string name;
+        std::unique_ptr<CodeGenBatchFunction> kernel;
+        std::vector<int> args;       // Inputs are >= 0, formula f is -1 - f.
+        std::vector<size_t> readers; // Formulas reading this one.
+        size_t formulaArgs;          // Distinct formulas this one reads.
+        size_t level;
+    };
+
+    struct WorkQueue{
+        std::mutex mutex;
+        std::deque<size_t> tasks; // formula * blockCount + block
+        char padding[64];
+    };
+
+    size_t inputCount;
+    size_t blockRows;
+    std::vector<Node> nodes;
+    std::vector<std::vector<size_t>> levels;
+
+public:
+    // blockRows is rounded up to whole 4KB pages of doubles.
+    FormulaNetwork(const std::vector<std::string> &inputs, const Formulas &formulas,
+                   size_t blockRows = 16384, const BatchOptions &options = BatchOptions())
+        : inputCount(inputs.size()), blockRows((std::max<size_t>(blockRows, 1) + 511) & ~size_t(511)),
+          nodes(formulas.size()){
+        std::map<std::string, size_t> formulaIndex;
+        for(size_t f = 0; f < formulas.size(); ++f){
+            if(std::find(inputs.begin(), inputs.end(), formulas[f].first) != inputs.end())
+                throw std::runtime_error("Formula shadows input: " + formulas[f].first);
+            if(!formulaIndex.insert(std::make_pair(formulas[f].first, f)).second)
+                throw std::runtime_error("Duplicate formula: " + formulas[f].first);
+        }
+
+        for(size_t f = 0; f < formulas.size(); ++f){
+            Node &node = nodes[f];
+            node.name = formulas[f].first;
+            node.formulaArgs = 0;
+            std::vector<std::string> names;
+            symbols(formulas[f].second, names);
+            for(const std::string &name : names){
+                auto input = std::find(inputs.begin(), inputs.end(), name);
+                if(input != inputs.end()){
+                    node.args.push_back(int(input - inputs.begin()));
+                }else if(formulaIndex.count(name)){
+                    size_t dependency = formulaIndex[name];
+                    node.args.push_back(-1 - int(dependency));
+                    nodes[dependency].readers.push_back(f);
+                    ++node.formulaArgs;
+                }else{
+                    throw std::runtime_error("Cannot handle symbol: " + name);
+                }
+            }
+            node.kernel.reset(new CodeGenBatchFunction(names, formulas[f].second, options));
+        }
+
+        levelNodes();
+    }
+
+    size_t getFormulaCount() const { return nodes.size(); }
+    size_t getBlockRows() const { return blockRows; }
+    // Formulas by level: level 0 reads only inputs, level n reads level n-1.
+    const std::vector<std::vector<size_t>> &getLevels() const { return levels; }
+
+    // inputs has one column per input, outs one array per formula. A null
+    // out is a formula only other formulas need; it goes to a scratch array.
+    void operator()(BatchExecutor &executor, const double * const *inputs,
+                    double * const *outs, size_t rows) const {
+        size_t blockCount = (rows + blockRows - 1) / blockRows;
+        size_t workerCount = executor.getWorkerCount();
+        if(blockCount == 0 || nodes.empty())
+            return;
+
+        std::vector<double *> results(outs, outs + nodes.size());
+        std::vector<std::vector<double>> scratch(nodes.size());
+        for(size_t f = 0; f < nodes.size(); ++f){
+            if(!results[f]){
+                scratch[f].resize(rows);
+                results[f] = scratch[f].data();
+            }
+        }
+
+        std::unique_ptr<std::atomic<size_t>[]> waiting(new std::atomic<size_t>[nodes.size()*blockCount]);
+        for(size_t f = 0; f < nodes.size(); ++f)
+            for(size_t b = 0; b < blockCount; ++b)
+                waiting[f*blockCount + b] = nodes[f].formulaArgs;
+        std::atomic<size_t> remaining(nodes.size()*blockCount);
+        std::atomic<bool> failed(false); // Stops the others if a task throws.
+
+        // Seed level 0, block b on worker b % workerCount. Deques are popped
+        // from the back, so push the highest block (and level) first.
+        std::unique_ptr<WorkQueue[]> queues(new WorkQueue[workerCount]);
+        for(size_t b = blockCount; b-- > 0;)
+            for(size_t i = levels[0].size(); i-- > 0;)
+                queues[b % workerCount].tasks.push_back(levels[0][i]*blockCount + b);
+
+        executor.runOnWorkers([&](size_t worker){
+            TraceScope trace("network worker", "executor");
+            while(remaining.load() > 0 && !failed.load()){
+                size_t task;
+                if(!pop(queues[worker], task) && !steal(queues.get(), workerCount, worker, task)){
+                    std::this_thread::yield();
+                    continue;
+                }
+                size_t f = task / blockCount, b = task % blockCount;
+                try{
+                    runBlock(f, b, rows, inputs, results);
+                }catch(...){
+                    failed = true;
+                    throw;
+                }
+
+                // Readers of this formula may now run on this block.
+                for(size_t reader : nodes[f].readers){
+                    if(--waiting[reader*blockCount + b] == 0){
+                        std::lock_guard<std::mutex> lock(queues[worker].mutex);
+                        queues[worker].tasks.push_back(reader*blockCount + b);
+                    }
+                }
+                --remaining;
+            }
+        });
+    }
+
+private:
+    // Distinct symbols read by c, in order of first use.
+    static void symbols(const Cell &c, std::vector<std::string> &names){
+        if(c.type == Cell::Symbol){
+            if(std::find(names.begin(), names.end(), c.val) == names.end())
+                names.push_back(c.val);
+        }else if(c.type == Cell::List){
+            for(size_t i = 1; i < c.list.size(); ++i)
+                symbols(c.list[i], names);
+        }
+    }
+
+    // Kahn's algorithm; formulas left over are part of a cycle.
+    void levelNodes(){
+        std::vector<size_t> waiting(nodes.size());
+        std::vector<size_t> current;
+        for(size_t f = 0; f < nodes.size(); ++f){
+            waiting[f] = nodes[f].formulaArgs;
+            if(waiting[f] == 0)
+                current.push_back(f);
+        }
+
+        size_t levelled = 0;
+        while(!current.empty()){
+            std::vector<size_t> next;
+            for(size_t f : current){
+                nodes[f].level = levels.size();
+                for(size_t reader : nodes[f].readers)
+                    if(--waiting[reader] == 0)
+                        next.push_back(reader);
+            }
+            levelled += current.size();
+            levels.push_back(current);
+            current.swap(next);
+        }
+
+        if(levelled != nodes.size()){
+            for(size_t f = 0; f < nodes.size(); ++f)
+                if(waiting[f] != 0)
+                    throw std::runtime_error("Formula depends on itself: " + nodes[f].name);
+        }
+    }
+
+    void runBlock(size_t f, size_t block, size_t rows, const double * const *inputs,
+                  const std::vector<double *> &results) const {
+        const Node &node = nodes[f];
+        size_t begin = block*blockRows;
+        size_t n = std::min(blockRows, rows - begin);
+        std::vector<const double *> columns;
+        for(int arg : node.args)
+            columns.push_back((arg >= 0 ? inputs[arg] : results[-1 - arg]) + begin);
+        (*node.kernel)(columns.data(), results[f] + begin, n);
+    }
+
+    static bool pop(WorkQueue &queue, size_t &task){
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty())
+            return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    static bool steal(WorkQueue *queues, size_t workerCount, size_t thief, size_t &task){
+        for(size_t i = 1; i < workerCount; ++i){
+            WorkQueue &victim = queues[(thief + i) % workerCount];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if(!victim.tasks.empty()){
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+// Collects scalar calls from any number of threads into batches for a batch
+// kernel, for callers that only have one argument tuple at a time. A batch
+// runs on the batcher's own thread as soon as it holds maxRows calls or its
+// oldest call has waited maxDelay, and every call's future completes when
+// its batch has run. Calls arriving while a batch runs join the next one, so
+// under load batches may exceed maxRows. The kernel must outlive the
+// batcher; pending calls still run when it is destroyed.
+class MicroBatcher{
+private:
+    const CodeGenBatchFunction &kernel;
+    size_t arity;
+    size_t maxRows;
+    std::chrono::microseconds maxDelay;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<double> pendingArgs; // Row major.
+    std::vector<std::promise<double>> pending;
+    std::chrono::steady_clock::time_point oldest;
+    bool stopping;
+    uint64_t batches;
+    uint64_t calls;
+    std::thread flusher;
+
+public:
+    MicroBatcher(const CodeGenBatchFunction &kernel, size_t maxRows = 256,
+                 std::chrono::microseconds maxDelay = std::chrono::microseconds(50))
+        : kernel(kernel), arity(kernel.getArgCount()), maxRows(std::max<size_t>(maxRows, 1)),
+          maxDelay(maxDelay), stopping(false), batches(0), calls(0){
+        if(kernel.getOutputCount() != 1)
+            throw std::runtime_error("Micro-batched kernels must have one output");
+        flusher = std::thread(&MicroBatcher::flushLoop, this);
+    }
+
+    ~MicroBatcher(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+    }
+
+    std::future<double> submit(const std::vector<double> &args){
+        if(args.size() != arity)
+            throw std::runtime_error("Wrong number of arguments");
+        std::promise<double> result;
+        std::future<double> future = result.get_future();
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(pending.empty())
+                oldest = std::chrono::steady_clock::now();
+            pendingArgs.insert(pendingArgs.end(), args.begin(), args.end());
+            pending.push_back(std::move(result));
+            // The flusher only needs waking to start the timeout or when
+            // the batch is full.
+            notify = pending.size() == 1 || pending.size() == maxRows;
+        }
+        if(notify)
+            wake.notify_one();
+        return future;
+    }
+
+    // Average calls per batch so far.
+    double averageBatchRows(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return batches ? double(calls) / double(batches) : 0.0;
+    }
+
+private:
+    void flushLoop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;){
+            if(pending.empty()){
+                if(stopping)
+                    return;
+                wake.wait(lock);
+                continue;
+            }
+            auto deadline = oldest + maxDelay;
+            if(pending.size() < maxRows && !stopping && std::chrono::steady_clock::now() < deadline){
+                wake.wait_until(lock, deadline);
+                continue;
+            }
+
+            std::vector<double> args;
+            std::vector<std::promise<double>> results;
+            args.swap(pendingArgs);
+            results.swap(pending);
+            ++batches;
+            calls += results.size();
+            lock.unlock();
+            run(args, results);
+            lock.lock();
+        }
+    }
+
+    void run(const std::vector<double> &args, std::vector<std::promise<double>> &results) const {
+        size_t rows = results.size();
+        std::vector<double> data(arity*rows);
+        std::vector<const double *> columns(arity);
+        for(size_t i = 0; i < arity; ++i){
+            columns[i] = &data[i*rows];
+            for(size_t r = 0; r < rows; ++r)
+                data[i*rows + r] = args[r*arity + i];
+        }
+        std::vector<double> out(rows);
+        kernel(columns.data(), out.data(), rows);
+        for(size_t r = 0; r < rows; ++r)
+            results[r].set_value(out[r]);
+    }
+};
+
+
+// Estimates what each execution tier would cost for an expression and
+// workload, so callers get a sensible tier without per-formula tuning.
+// Costs are nanoseconds; the defaults were measured on a ~3GHz x86-64 and
+// only their ratios matter, callers with better numbers can overwrite them.
+enum ExecutionTier {InterpreterTier, BytecodeTier, ScalarJitTier, BatchJitTier};
+
+const char *tierName(ExecutionTier tier){
+    switch(tier){
+        case InterpreterTier: return "interpreter";
+        case BytecodeTier: return "bytecode";
+        case ScalarJitTier: return "scalar JIT";
+        case BatchJitTier: return "batch JIT";
+    }
+    return "unknown";
+}
+
+// What the caller expects to do with the function.
+struct Workload{
+    size_t evaluations; // Total rows expected over the function's lifetime.
+    size_t batchRows;   // Rows per call when the caller evaluates batches, <= 1 for scalar calls.
+
+    Workload(size_t evaluations = 1, size_t batchRows = 1) : evaluations(evaluations), batchRows(batchRows) {}
+};
+
+struct CostModel{
+    // Per tree node, per evaluation.
+    double interpreterNodeCost;
+    double bytecodeNodeCost;
+    // Machine code per operator in scalar (latency bound) code; packed batch
+    // code runs two rows per instruction and overlaps rows, batchSpeedup
+    // accounts for both.
+    double addCost, mulCost, divCost, sqrtCost, loadCost;
+    double callCost;
+    double batchSpeedup;
+    // Compilation: a fixed setup cost plus a cost per node.
+    double bytecodeCompileNodeCost;
+    double jitCompileCost, jitCompileNodeCost;
+    double batchCompileCost, batchCompileNodeCost;
+
+    CostModel() : interpreterNodeCost(60), bytecodeNodeCost(5),
+                  addCost(0.3), mulCost(0.3), divCost(1.5), sqrtCost(2), loadCost(0.1),
+                  callCost(3), batchSpeedup(3),
+                  bytecodeCompileNodeCost(100),
+                  jitCompileCost(40000), jitCompileNodeCost(1500),
+                  batchCompileCost(60000), batchCompileNodeCost(2500) {}
+
+    // Total cost of running the workload on a tier, compilation included.
+    double estimate(ExecutionTier tier, const Cell &c, const Workload &workload) const {
+        double nodes = nodeCount(c);
+        double n = double(workload.evaluations);
+        switch(tier){
+            case InterpreterTier:
+                return n * nodes * interpreterNodeCost;
+            case BytecodeTier:
+                return nodes * bytecodeCompileNodeCost + n * (callCost + nodes * bytecodeNodeCost);
+            case ScalarJitTier:
+                return jitCompileCost + nodes * jitCompileNodeCost + n * (callCost + machineCost(c));
+            case BatchJitTier:{
+                double calls = std::ceil(n / std::max<size_t>(workload.batchRows, 1));
+                return batchCompileCost + nodes * batchCompileNodeCost +
+                       calls * callCost + n * machineCost(c) / batchSpeedup;
+            }
+        }
+        return 0;
+    }
+
+    // Cheapest tier. Batch code is only considered for batched workloads.
+    ExecutionTier choose(const Cell &c, const Workload &workload) const {
+        ExecutionTier best = InterpreterTier;
+        for(ExecutionTier tier : {BytecodeTier, ScalarJitTier, BatchJitTier}){
+            if(tier == BatchJitTier && workload.batchRows <= 1)
+                continue;
+            if(estimate(tier, c, workload) < estimate(best, c, workload))
+                best = tier;
+        }
+        return best;
+    }
+
+    static double nodeCount(const Cell &c){
+        double count = 1;
+        if(c.type == Cell::List)
+            for(size_t i = 1; i < c.list.size(); ++i)
+                count += nodeCount(c.list[i]);
+        return count;
+    }
+
+    double machineCost(const Cell &c) const {
+        if(c.type != Cell::List)
+            return loadCost;
+        const std::string &op = c.list[0].val;
+        double cost = op == "/" ? divCost : op == "sqrt" ? sqrtCost : op == "*" ? mulCost : addCost;
+        for(size_t i = 1; i < c.list.size(); ++i)
+            cost += machineCost(c.list[i]);
+        return cost;
+    }
+};
+
+// A function evaluated on whichever tier the cost model picks for the
+// expected workload. Both the scalar and the batch interfaces work on every
+// tier; they are simply fastest on their own.
+class AutoFunction{
+private:
+    ExecutionTier tier;
+    size_t argCount;
+    std::unique_ptr<CalculatorFunction> interpreted;
+    std::unique_ptr<BytecodeFunction> bytecode;
+    std::unique_ptr<CodeGenCalculatorFunction> jit;
+    std::unique_ptr<CodeGenBatchFunction> batch;
+
+public:
+    AutoFunction(const std::vector<std::string> &names, const Cell &c, const Workload &workload,
+                 const BatchOptions &options = BatchOptions(), const CostModel &model = CostModel())
+        : tier(model.choose(c, workload)), argCount(names.size()){
+        switch(tier){
+            case InterpreterTier: interpreted.reset(new CalculatorFunction(names, c, options)); break;
+            case BytecodeTier: bytecode.reset(new BytecodeFunction(names, c, options)); break;
+            case ScalarJitTier: jit.reset(new CodeGenCalculatorFunction(names, c, options)); break;
+            case BatchJitTier: batch.reset(new CodeGenBatchFunction(names, c, options)); break;
+        }
+    }
+
+    ExecutionTier getTier() const { return tier; }
+
+    double operator()(const std::vector<double> &args){
+        switch(tier){
+            case InterpreterTier: return (*interpreted)(args);
+            case BytecodeTier: return (*bytecode)(args);
+            case ScalarJitTier: return (*jit)(args);
+            case BatchJitTier:{
+                std::vector<const double *> columns;
+                for(const double &arg : args)
+                    columns.push_back(&arg);
+                double out;
+                (*batch)(columns.data(), &out, 1);
+                return out;
+            }
+        }
+        return 0;
+    }
+
+    void operator()(const double * const *columns, double *out, size_t rows){
+        if(tier == BatchJitTier){
+            (*batch)(columns, out, rows);
+            return;
+        }
+        std::vector<double> args(argCount);
+        for(size_t r = 0; r < rows; ++r){
+            for(size_t i = 0; i < argCount; ++i)
+                args[i] = columns[i][r];
+            out[r] = (*this)(args);
+        }
+    }
+};
+
+
+// Hit and miss totals of a MemoizedFunction.
+struct MemoStats{
+    uint64_t hits;
+    uint64_t misses;
+
+    double hitRate() const {
+        return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+    }
+};
+
+// Small direct mapped cache of results in front of a scalar function, for
+// callers where the same argument tuples recur within short windows. Keys
+// are the raw bits of the arguments (so 0 and -0, or NaN payloads, differ)
+// hashed with multiply-xorshift rounds. Each thread uses its own cache, picked
+// like KernelProfile slots; a thread that finds its cache in use by another
+// thread sharing the slot calls the function directly, so results are never
+// torn. Only worth it for expensive formulas: a hit still costs a hash and a
+// key compare.
+class MemoizedFunction{
+public:
+    typedef std::function<double (const std::vector<double> &)> Function;
+
+private:
+    static const size_t slotCount = 64;
+
+    // Entries are [valid, key bits..., result] words.
+    struct alignas(64) Cache{
+        std::atomic_flag busy;
+        std::vector<uint64_t> entries;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    Function f;
+    size_t arity;
+    size_t capacity;
+    Cache *caches;
+
+    MemoizedFunction(const MemoizedFunction &);
+    MemoizedFunction &operator=(const MemoizedFunction &);
+public:
+    // capacity is the number of cached tuples per thread, rounded up to a
+    // power of two. f must stay valid for the lifetime of the cache.
+    MemoizedFunction(const Function &f, size_t arity, size_t capacity = 1024)
+        : f(f), arity(arity), capacity(1), caches(nullptr){
+        while(this->capacity < capacity)
+            this->capacity *= 2;
+        // new does not honour alignas(64) before C++17.
+        void *p = nullptr;
+        if(posix_memalign(&p, 64, slotCount * sizeof(Cache)) != 0)
+            throw std::bad_alloc();
+        caches = static_cast<Cache *>(p);
+        for(size_t i = 0; i < slotCount; ++i){
+            new (&caches[i]) Cache();
+            caches[i].busy.clear();
+            caches[i].hits = caches[i].misses = 0;
+        }
+    }
+
+    ~MemoizedFunction(){
+        for(size_t i = 0; i < slotCount; ++i)
+            caches[i].~Cache();
+        std::free(caches);
+    }
+
+    double operator()(const std::vector<double> &args) const {
+        if(args.size() != arity)
+            throw std::runtime_error("Wrong number of arguments");
+        Cache &cache = slot();
+        if(cache.busy.test_and_set(std::memory_order_acquire))
+            return f(args);
+
+        size_t stride = arity + 2;
+        if(cache.entries.empty())
+            cache.entries.resize(capacity*stride);
+
+        uint64_t hash = 0;
+        for(double arg : args)
+            hash = (hash ^ doubleBits(arg)) * 0x9e3779b97f4a7c15ull;
+        // The multiplies only carry bits upwards and small numbers differ in
+        // the top bits, so fold those back down.
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        uint64_t *entry = &cache.entries[(hash & (capacity - 1))*stride];
+
+        bool hit = entry[0] != 0;
+        for(size_t i = 0; hit && i < arity; ++i)
+            hit = entry[i + 1] == doubleBits(args[i]);
+
+        double result;
+        if(hit){
+            ++cache.hits;
+            std::memcpy(&result, &entry[arity + 1], sizeof(double));
+        }else{
+            ++cache.misses;
+            try{
+                result = f(args);
+            }catch(...){
+                cache.busy.clear(std::memory_order_release);
+                throw;
+            }
+            entry[0] = 1;
+            for(size_t i = 0; i < arity; ++i)
+                entry[i + 1] = doubleBits(args[i]);
+            std::memcpy(&entry[arity + 1], &result, sizeof(double));
+        }
+        cache.busy.clear(std::memory_order_release);
+        return result;
+    }
+
+    size_t getCapacity() const { return capacity; }
+
+    // Counters are read without synchronisation and may lag calls in flight.
+    MemoStats snapshotStats() const {
+        MemoStats total = {0, 0};
+        for(size_t i = 0; i < slotCount; ++i){
+            total.hits += caches[i].hits;
+            total.misses += caches[i].misses;
+        }
+        return total;
+    }
+
+    // Drop every cached result and zero the counters, e.g. after the
+    // function's inputs changed meaning. Not safe during calls.
+    void reset(){
+        for(size_t i = 0; i < slotCount; ++i){
+            std::fill(caches[i].entries.begin(), caches[i].entries.end(), 0);
+            caches[i].hits = caches[i].misses = 0;
+        }
+    }
+
+private:
+    Cache &slot() const {
+        static std::atomic<size_t> nextThread(0);
+        static thread_local size_t thread = nextThread++;
+        return caches[thread % slotCount];
+    }
+
+    static uint64_t doubleBits(double x){
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+};
+
+
+// Holds a growing catalogue of formulas while bounding the executable
+// memory their compiled code uses. Formulas start on the bytecode tier and
+// are compiled once they have been called recompileThreshold times; when
+// compiled code exceeds the budget the least recently called functions are
+// evicted back to bytecode and compiled again if they get hot. Freeing
+// code lets the memory manager return chunks that become empty to the OS.
+// Safe to call from several threads. Calls take no lock: they read an
+// immutable snapshot of the catalogue and each entry's code atomically. A
+// formula turning hot is compiled by the calling thread outside the lock
+// while other callers keep running its bytecode; the lock only guards
+// adding formulas and the budget bookkeeping. A function evicted during a
+// call stays alive until that call returns.
+class CodeCache{
+public:
+    typedef size_t Handle;
+
+private:
+    struct Entry{
+        std::vector<std::string> names;
+        Cell cell;
+        std::unique_ptr<BytecodeFunction> bytecode;
+        // Accessed with std::atomic_load / std::atomic_store only.
+        std::shared_ptr<CodeGenCalculatorFunction> jit;
+        std::atomic<uint64_t> lastUse;
+        std::atomic<size_t> coldCalls;
+        // Set while a thread compiles the entry.
+        std::atomic<bool> compiling;
+    };
+    typedef std::vector<Entry *> Table;
+
+    CompileOptions options;
+    size_t budget;
+    size_t recompileThreshold;
+    size_t usedBytes;
+    size_t evictions;
+    std::atomic<uint64_t> clock;
+    std::vector<std::unique_ptr<Entry>> entries;
+    // Copy of entries for lock-free lookup, replaced by add().
+    std::shared_ptr<const Table> table;
+    mutable std::mutex mutex;
+
+    Entry &entry(Handle h) const {
+        std::shared_ptr<const Table> t = std::atomic_load(&table);
+        if(!t || h >= t->size())
+            throw std::out_of_range("CodeCache: unknown handle");
+        return *(*t)[h];
+    }
+
+    void compile(Entry &e){
+        std::shared_ptr<CodeGenCalculatorFunction> jit;
+        try{
+            jit = std::make_shared<CodeGenCalculatorFunction>(e.names, e.cell, options);
+        }catch(...){
+            e.compiling = false;
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        usedBytes += jit->getCodeSize();
+        std::atomic_store(&e.jit, jit);
+        e.coldCalls = 0;
+        e.compiling = false;
+        evict(&e);
+    }
+
+    // Evict least recently used functions other than keep until within
+    // budget. Called with the lock held.
+    void evict(const Entry *keep){
+        while(usedBytes > budget){
+            Entry *coldest = nullptr;
+            for(const std::unique_ptr<Entry> &e : entries)
+                if(e.get() != keep && std::atomic_load(&e->jit) && (!coldest || e->lastUse < coldest->lastUse))
+                    coldest = e.get();
+            if(!coldest)
+                return;
+            usedBytes -= std::atomic_load(&coldest->jit)->getCodeSize();
+            std::atomic_store(&coldest->jit, std::shared_ptr<CodeGenCalculatorFunction>());
+            ++evictions;
+        }
+    }
+
+public:
+    explicit CodeCache(size_t budget, size_t recompileThreshold = 16,
+                       const CompileOptions &options = CompileOptions())
+        : options(options), budget(budget), recompileThreshold(recompileThreshold),
+          usedBytes(0), evictions(0), clock(0) {}
+
+    Handle add(const std::vector<std::string> &names, const Cell &c){
+        std::unique_ptr<Entry> e(new Entry());
+        e->names = names;
+        e->cell = c;
+        e->bytecode.reset(new BytecodeFunction(names, c, options));
+        e->lastUse = 0;
+        e->coldCalls = 0;
+        e->compiling = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Table> t(table ? new Table(*table) : new Table());
+        t->push_back(e.get());
+        entries.push_back(std::move(e));
+        std::atomic_store(&table, std::shared_ptr<const Table>(t));
+        return entries.size() - 1;
+    }
+
+    double operator()(Handle h, const std::vector<double> &args){
+        Entry &e = entry(h);
+        e.lastUse.store(++clock, std::memory_order_relaxed);
+        std::shared_ptr<CodeGenCalculatorFunction> jit = std::atomic_load(&e.jit);
+        if(!jit && ++e.coldCalls >= recompileThreshold && !e.compiling.exchange(true)){
+            compile(e);
+            jit = std::atomic_load(&e.jit);
+        }
+        return jit ? (*jit)(args) : (*e.bytecode)(args);
+    }
+
+    // A smaller budget takes effect immediately.
+    void setBudget(size_t bytes){
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict(nullptr);
+    }
+
+    bool isCompiled(Handle h) const {
+        return bool(std::atomic_load(&entry(h).jit));
+    }
+
+    size_t getUsedBytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return usedBytes;
+    }
+
+    size_t getEvictions() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return evictions;
+    }
+};
+
+
+// Convert given string to list of tokens.
+// originally from: 
+// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
+std::list<std::string> tokenize(const std::string & str){
+    std::list<std::string> tokens;
+    const char * s = str.c_str();
+    while (*s) {
+        while (*s == ' ')
+            ++s;
+        if (*s == '(' || *s == ')')
+            tokens.push_back(*s++ == '(' ? "(" : ")");
+        else {
+            const char * t = s;
+            while (*t && *t != ' ' && *t != '(' && *t != ')')
+                ++t;
+            tokens.push_back(std::string(s, t));
+            s = t;
+        }
+    }
+    return tokens;
+}
+
+// Numbers become Numbers; every other token is a Symbol.
+// Originally from: 
+// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
+Cell atom(const std::string & token)
+{
+    if (std::isdigit(token[0]) || (token[0] == '-' && std::isdigit(token[1])))
+        return Cell(Cell::Number, token);
+    return Cell(Cell::Symbol, token);
+}
+
+// Return the s-expression in the given tokens.
+// Originally from: 
+// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
+Cell readFrom(std::list<std::string> & tokens)
+{
+    const std::string token(tokens.front());
+    tokens.pop_front();
+    if (token == "(") {
+        Cell c(Cell::List);
+        while (tokens.front() != ")")
+            c.list.push_back(readFrom(tokens));
+        tokens.pop_front();
+        return c;
+    }
+    else
+        return atom(token);
+}
+
+// Return the Lisp expression represented by the given string.
+// Originally from: 
+// http://howtowriteaprogram.blogspot.co.uk/2010/11/lisp-interpreter-in-90-lines-of-c.html
 Cell read(const std::string & s)
 {
+    TraceScope trace("parse", "parser");
     std::list<std::string> tokens(tokenize(s));
     return readFrom(tokens);
 }
 
+// Forwards to another memory manager, tracing each call. The time includes
+// waiting for the forwarded manager's lock. Installed on the global
+// JitContext it sees every compiler's allocations (functions free their
+// code through the global manager directly).
+class TracingMemoryManager : public AsmJit::MemoryManager{
+private:
+    AsmJit::MemoryManager *target;
+public:
+    explicit TracingMemoryManager(AsmJit::MemoryManager *target) : target(target) {}
+
+    void *alloc(size_t size, uint32_t type){
+        TraceScope trace("alloc", "memory");
+        return target->alloc(size, type);
+    }
+
+    bool free(void *address){
+        TraceScope trace("free", "memory");
+        return target->free(address);
+    }
+
+    bool shrink(void *address, size_t used){
+        TraceScope trace("shrink", "memory");
+        return target->shrink(address, used);
+    }
+
+    void freeAll(){ target->freeAll(); }
+    size_t getUsedBytes(){ return target->getUsedBytes(); }
+    size_t getAllocatedBytes(){ return target->getAllocatedBytes(); }
+};
+
+// Relative error of fast-math batch results against exact ones.
+struct FastMathAccuracy{
+    size_t rows;
+    double maxError;
+    double meanError;
+};
+
+// Compare fast-math batch results against exact ones on arguments jittered
+// around the given values.
+FastMathAccuracy measureFastMathAccuracy(const std::vector<std::string> &argNames, const Cell &expr,
+                                         const std::vector<double> &args, const BatchOptions &options){
+    BatchOptions exactOptions(options);
+    exactOptions.fastMath = false;
+    CodeGenBatchFunction exact(argNames, expr, exactOptions);
+    CodeGenBatchFunction fast(argNames, expr, options);
+
+    size_t rows = 100000;
+    std::vector<std::vector<double>> data(args.size(), std::vector<double>(rows));
+    std::vector<const double *> columns;
+    for(size_t i = 0; i < args.size(); ++i){
+        for(size_t r = 0; r < rows; ++r)
+            data[i][r] = args[i] * (0.5 + double((r*7919 + i*104729) % 10007) / 10007.0);
+        columns.push_back(data[i].data());
+    }
+    std::vector<double> exactOut(rows), fastOut(rows);
+    exact(columns.data(), exactOut.data(), rows);
+    fast(columns.data(), fastOut.data(), rows);
+
+    double maxError = 0, sumError = 0;
+    for(size_t r = 0; r < rows; ++r){
+        double error = exactOut[r] == fastOut[r] ? 0 :
+                       std::fabs((fastOut[r] - exactOut[r]) / exactOut[r]);
+        maxError = std::max(maxError, error);
+        sumError += error;
+    }
+    FastMathAccuracy accuracy = {rows, maxError, sumError / rows};
+    return accuracy;
+}
+
+void reportFastMathAccuracy(const std::vector<std::string> &argNames, const Cell &expr,
+                            const std::vector<double> &args, const BatchOptions &options){
+    FastMathAccuracy accuracy = measureFastMathAccuracy(argNames, expr, args, options);
+    std::cout << " - Fast-math accuracy (" << options.fastMathRefinements << " refinement steps, " <<
+                 accuracy.rows << " rows): max relative error " << accuracy.maxError <<
+                 " (" << (accuracy.maxError > 0 ? -std::log2(accuracy.maxError) : 53.0) << " bits), mean " <<
+                 accuracy.meanError << "\n";
+}
+
+// Self checks run by the "-selftest" switch. Each compares a feature against
+// the interpreter (or a plain batch kernel) on deterministic data and throws
+// std::runtime_error describing the first mismatch.
+namespace selfcheck{
+
+// Values in [0.5, 1.5), different for every seed.
+std::vector<double> column(size_t rows, size_t seed){
+    std::vector<double> c(rows);
+    for(size_t r = 0; r < rows; ++r)
+        c[r] = 0.5 + double((r*7919 + seed*104729 + 13) % 10007) / 10007.0;
+    return c;
+}
+
+// Equal to a relative tolerance (0 for bit identical), NaN matches NaN.
+void expect(double actual, double expected, double tolerance, const std::string &what){
+    bool same = std::isnan(expected) ? std::isnan(actual) :
+                actual == expected || std::fabs(actual - expected) <= tolerance*std::fabs(expected);
+    if(!same){
+        std::ostringstream message;
+        message << what << ": " << actual << " instead of " << expected;
+        throw std::runtime_error(message.str());
+    }
+}
+
+void expect(bool condition, const std::string &what){
+    if(!condition)
+        throw std::runtime_error(what);
+}
+
+// Same bits, except that any NaN matches any NaN.
+void expectBits(double actual, double expected, const std::string &what){
+    bool same = std::isnan(expected) ? std::isnan(actual) : std::memcmp(&actual, &expected, sizeof(double)) == 0;
+    if(!same){
+        std::ostringstream message;
+        message << what << ": " << std::setprecision(17) << actual << " instead of " << expected;
+        throw std::runtime_error(message.str());
+    }
+}
+
+std::string row(size_t r){
+    return "row " + std::to_string(r);
+}
+
+// Values as the interpreter computes them, validity as the AND of the
+// argument bitmaps, with null and partial bitmaps.
+void nullableBatch(){
+    std::vector<std::string> names{"a", "b", "c"};
+    Cell expr = read("(+ a (/ b c))");
+    size_t rows = 1000, words = (rows + 63) / 64;
+    std::vector<std::vector<double>> data;
+    std::vector<const double *> columns;
+    for(size_t i = 0; i < names.size(); ++i){
+        data.push_back(column(rows, i));
+        columns.push_back(data.back().data());
+    }
+    std::vector<uint64_t> a(words), c(words);
+    for(size_t w = 0; w < words; ++w){
+        a[w] = 0x9e3779b97f4a7c15ull * (w + 1);
+        c[w] = 0xc2b2ae3d27d4eb4full * (w + 7);
+    }
+
+    NullableBatchFunction f(names, expr);
+    CalculatorFunction interpreted(names, expr);
+    std::vector<double> out(rows);
+    std::vector<uint64_t> validity(words);
+    const uint64_t *patterns[][3] = {{a.data(), nullptr, c.data()}, {nullptr, nullptr, c.data()},
+                                     {nullptr, nullptr, nullptr}};
+    for(const auto &bitmaps : patterns){
+        f(columns.data(), bitmaps, out.data(), validity.data(), rows);
+        for(size_t w = 0; w < words; ++w){
+            uint64_t expected = ~uint64_t(0);
+            for(const uint64_t *bitmap : bitmaps)
+                if(bitmap)
+                    expected &= bitmap[w];
+            expect(validity[w] == expected, "validity word " + std::to_string(w));
+        }
+        for(size_t r = 0; r < rows; ++r)
+            expect(out[r], interpreted({data[0][r], data[1][r], data[2][r]}), 0, row(r));
+    }
+}
+
+// Results stay those of the interpreter as functions move between bytecode
+// and compiled code, and compiled code stays within the budget.
+void codeCacheEviction(){
+    std::vector<std::string> names{"x", "y"};
+    CodeCache cache(4096, 2);
+    std::vector<CodeCache::Handle> handles;
+    std::vector<std::unique_ptr<CalculatorFunction>> interpreted;
+    for(int i = 0; i < 200; ++i){
+        Cell expr = read("(+ (* x y) " + std::to_string(i) + ")");
+        handles.push_back(cache.add(names, expr));
+        interpreted.push_back(std::unique_ptr<CalculatorFunction>(new CalculatorFunction(names, expr)));
+    }
+    std::vector<double> args{3, 4};
+    for(size_t i = 0; i < handles.size(); ++i){
+        for(int call = 0; call < 3; ++call)
+            expect(cache(handles[i], args), (*interpreted[i])(args), 0, "function " + std::to_string(i));
+        expect(cache.getUsedBytes() <= 4096, "code over budget after function " + std::to_string(i));
+    }
+    expect(cache.getEvictions() > 0, "nothing evicted");
+    expect(cache.isCompiled(handles.back()), "most recent function not compiled");
+    expect(!cache.isCompiled(handles.front()), "least recent function not evicted");
+
+    cache.setBudget(0);
+    expect(cache.getUsedBytes() == 0, "code left after a zero budget");
+    for(size_t i = 0; i < handles.size(); ++i)
+        expect(cache(handles[i], args), (*interpreted[i])(args), 0, "evicted function " + std::to_string(i));
+
+    // Threads calling (and so compiling and evicting) the same functions
+    // concurrently still get the interpreter's results.
+    // The interpreter isn't thread safe, so expected values come first.
+    cache.setBudget(4096);
+    std::vector<double> expected;
+    for(size_t i = 0; i < handles.size(); ++i)
+        expected.push_back((*interpreted[i])(args));
+    std::atomic<size_t> wrong(0);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]{
+            for(int pass = 0; pass < 5; ++pass)
+                for(size_t i = 0; i < handles.size(); ++i){
+                    size_t f = (i * 7 + t * 13) % handles.size();
+                    if(cache(handles[f], args) != expected[f])
+                        ++wrong;
+                }
+        });
+    for(std::thread &t : threads)
+        t.join();
+    expect(wrong == 0, std::to_string(wrong) + " wrong results from concurrent calls");
+    expect(cache.getUsedBytes() <= 4096, "code over budget after concurrent calls");
+}
+
+// Every output of a fused kernel equals running one kernel per formula
+// through intermediate columns, with and without unrolling.
+void fusedBatch(){
+    std::vector<std::string> inputs{"r", "c1", "c2"};
+    FusedBatchFunction::Formulas formulas{
+        {"pv1", read("(* c1 df)")},
+        {"df", read("(/ 1 (+ 1 r))")},
+        {"pv2", read("(* c2 (* df df))")},
+        {"unused", read("(+ r pv1)")},
+    };
+    size_t rows = 1001;
+    std::vector<double> r(column(rows, 0)), c1(column(rows, 1)), c2(column(rows, 2));
+    const double *columns[] = {r.data(), c1.data(), c2.data()};
+
+    std::vector<double> df(rows), pv1(rows), pv2(rows);
+    CodeGenBatchFunction dfKernel({"r"}, formulas[1].second);
+    CodeGenBatchFunction pv1Kernel({"c1", "df"}, formulas[0].second);
+    CodeGenBatchFunction pv2Kernel({"c2", "df"}, formulas[2].second);
+    const double *dfArgs[] = {r.data()};
+    const double *pv1Args[] = {c1.data(), df.data()};
+    const double *pv2Args[] = {c2.data(), df.data()};
+    dfKernel(dfArgs, df.data(), rows);
+    pv1Kernel(pv1Args, pv1.data(), rows);
+    pv2Kernel(pv2Args, pv2.data(), rows);
+
+    for(size_t unroll : {1, 4}){
+        BatchOptions options;
+        options.unroll = unroll;
+        FusedBatchFunction fused(inputs, formulas, {"pv2", "df", "pv1"}, options);
+        std::vector<double> outPv2(rows), outDf(rows), outPv1(rows);
+        double *outs[] = {outPv2.data(), outDf.data(), outPv1.data()};
+        fused(columns, outs, rows);
+        for(size_t i = 0; i < rows; ++i){
+            expect(outPv2[i], pv2[i], 0, "pv2 " + row(i));
+            expect(outDf[i], df[i], 0, "df " + row(i));
+            expect(outPv1[i], pv1[i], 0, "pv1 " + row(i));
+        }
+    }
+}
+
+// A network of 40 formulas, each reading two earlier ones or inputs, gives
+// the interpreter's results on every row, including blocks that end part
+// way and a formula only other formulas read.
+void formulaNetwork(){
+    std::vector<std::string> inputs{"a", "b"};
+    std::vector<std::string> names(inputs);
+    FormulaNetwork::Formulas formulas;
+    const char *ops[] = {"+", "-", "*"};
+    for(size_t i = 0; i < 40; ++i){
+        std::string x = names[(i*7 + 1) % names.size()], y = names[(i*3) % names.size()];
+        std::string name = "f" + std::to_string(i);
+        formulas.push_back(std::make_pair(name,
+            read(std::string("(") + ops[i % 3] + " (* 0.5 " + x + ") (+ 0.25 " + y + "))")));
+        names.push_back(name);
+    }
+
+    size_t rows = 5003;
+    std::vector<double> a(column(rows, 0)), b(column(rows, 1));
+    const double *columns[] = {a.data(), b.data()};
+    std::vector<std::vector<double>> results(formulas.size(), std::vector<double>(rows));
+    std::vector<double *> outs;
+    for(std::vector<double> &result : results)
+        outs.push_back(result.data());
+    outs[7] = nullptr;
+
+    FormulaNetwork network(inputs, formulas, 1000);
+    BatchExecutor executor(4);
+    network(executor, columns, outs.data(), rows);
+
+    // Formulas only read earlier ones, so list order is a valid order.
+    std::vector<std::unique_ptr<CalculatorFunction>> interpreted;
+    for(const auto &f : formulas)
+        interpreted.push_back(std::unique_ptr<CalculatorFunction>(new CalculatorFunction(names, f.second)));
+    for(size_t r = 0; r < rows; ++r){
+        std::vector<double> values{a[r], b[r]};
+        for(size_t f = 0; f < formulas.size(); ++f){
+            values.push_back((*interpreted[f])(values));
+            if(outs[f])
+                expect(outs[f][r], values.back(), 0, formulas[f].first + " " + row(r));
+        }
+    }
+}
+
+// A series fed in uneven chunks, through the function's own state and a
+// separate one, equals one call over the whole series. Rolling sums also
+// match a plain sum of their window, recovering once an infinity leaves it.
+void seriesChunks(){
+    Cell expr = read("(+ (rolling-sum x 5) (+ (ema (diff x) 0.25) (- (lag x 3) (cumsum x))))");
+    size_t rows = 2000;
+    std::vector<double> x(column(rows, 0));
+    x[100] = INFINITY;
+    x[700] = NAN;
+
+    CodeGenSeriesFunction whole({"x"}, expr), chunked({"x"}, expr);
+    CodeGenSeriesFunction::State state = chunked.newState();
+    std::vector<double> expected(rows), own(rows), separate(rows);
+    const double *all[] = {x.data()};
+    whole(all, expected.data(), rows);
+    for(size_t begin = 0, chunk = 1; begin < rows; begin += chunk, chunk = chunk*3 % 97 + 1){
+        size_t n = std::min(chunk, rows - begin);
+        const double *part[] = {x.data() + begin};
+        chunked(part, own.data() + begin, n);
+        chunked(state, part, separate.data() + begin, n);
+    }
+    for(size_t r = 0; r < rows; ++r){
+        expect(own[r], expected[r], 0, row(r));
+        expect(separate[r], expected[r], 0, "separate state " + row(r));
+    }
+
+    CodeGenSeriesFunction rolling({"x"}, read("(rolling-sum x 5)"));
+    std::vector<double> sums(rows);
+    rolling(all, sums.data(), rows);
+    for(size_t r = 0; r < rows; ++r){
+        double sum = 0;
+        for(size_t i = r < 4 ? 0 : r - 4; i <= r; ++i)
+            sum += x[i];
+        expect(sums[r], sum, 1e-12, "rolling sum " + row(r));
+    }
+}
+
+// Interval bounds over every block contain the interpreter's value of
+// every row of the block, and blocks holding a row that satisfies a range
+// predicate are never pruned.
+void intervalBounds(){
+    std::vector<std::string> names{"a", "b", "c"};
+    Cell expr = read("(- (/ a (+ b 0.3)) (* (sqrt c) (- a b)))");
+    size_t rows = 3000;
+    // Smooth trends so block ranges are narrow, with noise from c.
+    std::vector<double> a(rows), b(rows), c(column(rows, 2));
+    for(size_t r = 0; r < rows; ++r){
+        a[r] = 10.0*r/rows - 5;  // Crosses zero.
+        b[r] = 2.0*r/rows - 0.5; // So does b + 0.3.
+    }
+    const double *columns[] = {a.data(), b.data(), c.data()};
+    ZoneMap zones(columns, 3, rows, 64);
+    CodeGenIntervalFunction bounds(names, expr);
+    std::vector<double> lows(zones.getBlockCount()), highs(zones.getBlockCount());
+    bounds(zones, lows.data(), highs.data());
+
+    CalculatorFunction interpreted(names, expr);
+    std::vector<double> values(rows);
+    for(size_t r = 0; r < rows; ++r){
+        values[r] = interpreted({a[r], b[r], c[r]});
+        size_t block = r / zones.getBlockRows();
+        bool unknown = std::isnan(lows[block]) || std::isnan(highs[block]);
+        expect(unknown || (lows[block] <= values[r] && values[r] <= highs[block]),
+               row(r) + " outside the bounds of its block");
+    }
+
+    std::vector<size_t> candidates = bounds.candidateBlocks(zones, 1, 2);
+    expect(candidates.size() < zones.getBlockCount(), "no block pruned");
+    for(size_t r = 0; r < rows; ++r)
+        if(values[r] >= 1 && values[r] <= 2)
+            expect(std::binary_search(candidates.begin(), candidates.end(), r / zones.getBlockRows()),
+                   "block of " + row(r) + " pruned");
+}
+
+// Worker partitions tile the rows on page boundaries, the first exception
+// thrown by a worker reaches the caller and leaves the executor usable, and
+// the topology only lists CPUs the thread may run on.
+void batchExecutor(){
+    for(size_t threads : {1, 3, 4}){
+        BatchExecutor executor(threads);
+        expect(executor.getWorkerCount() == threads, std::to_string(threads) + " workers requested");
+        for(size_t rows : {0, 1, 511, 512, 513, 5000, 100000}){
+            size_t next = 0;
+            for(size_t w = 0; w < threads; ++w){
+                std::pair<size_t, size_t> range = executor.partition(rows, w);
+                std::string what = std::to_string(rows) + " rows, worker " + std::to_string(w);
+                expect(range.first == next && range.first <= range.second, "gap or overlap, " + what);
+                expect(range.first % 512 == 0 || range.first == rows, "partition not page aligned, " + what);
+                next = range.second;
+            }
+            expect(next == rows, std::to_string(rows) + " rows not covered");
+        }
+
+        std::vector<std::atomic<int>> calls(threads);
+        for(std::atomic<int> &c : calls)
+            c = 0;
+        std::string message;
+        try{
+            executor.runOnWorkers([&](size_t worker){
+                ++calls[worker];
+                if(worker == threads - 1)
+                    throw std::runtime_error("worker failed");
+            });
+        }catch(const std::runtime_error &e){
+            message = e.what();
+        }
+        expect(message == "worker failed", "worker exception not rethrown");
+        for(size_t w = 0; w < threads; ++w)
+            expect(calls[w] == 1, "worker " + std::to_string(w) + " not run once");
+
+        std::vector<double> x(column(5000, 0)), out(5000);
+        CodeGenBatchFunction f({"x"}, read("(* x x)"));
+        executor.evaluate(f, {x.data()}, out.data(), x.size());
+        for(size_t r = 0; r < x.size(); ++r)
+            expect(out[r], x[r] * x[r], 0, row(r) + " after an exception");
+    }
+
+#ifdef __linux__
+    // Restrict this thread to one CPU, as taskset would.
+    cpu_set_t saved, one;
+    expect(sched_getaffinity(0, sizeof(saved), &saved) == 0, "sched_getaffinity failed");
+    int cpu = NumaTopology::allowedCpus().front();
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    expect(sched_setaffinity(0, sizeof(one), &one) == 0, "sched_setaffinity failed");
+    NumaTopology topology;
+    sched_setaffinity(0, sizeof(saved), &saved);
+    expect(topology.nodeCpus.size() == 1 && topology.nodeCpus[0] == std::vector<int>{cpu},
+           "topology lists CPUs outside the affinity mask");
+#endif
+}
+
+// Fast-math results stay within the documented bits for each number of
+// refinement steps, and fast-math kernels refuse exception reporting.
+void fastMathAccuracy(){
+    std::vector<std::string> names{"a", "b", "c"};
+    Cell expr = read("(+ (/ a b) (sqrt (/ c (* a b))))");
+    const int bits[] = {11, 22, 44, 50};
+    for(int steps = 0; steps < 4; ++steps){
+        BatchOptions options;
+        options.fastMath = true;
+        options.fastMathRefinements = steps;
+        FastMathAccuracy accuracy = measureFastMathAccuracy(names, expr, {1.5, 2.5, 3.5}, options);
+        expect(accuracy.maxError <= std::ldexp(1.0, 1 - bits[steps]),
+               "max relative error " + std::to_string(accuracy.maxError) + " with " +
+               std::to_string(steps) + " refinement steps");
+    }
+
+    BatchOptions options;
+    options.fastMath = true;
+    CodeGenBatchFunction f(names, expr, options);
+    std::vector<double> a(column(4, 0)), b(column(4, 1)), c(column(4, 2)), out(4);
+    const double *columns[] = {a.data(), b.data(), c.data()};
+    double *outs[] = {out.data()};
+    bool refused = false;
+    try{
+        f.evaluateChecked(columns, outs, 4);
+    }catch(const std::runtime_error &){
+        refused = true;
+    }
+    expect(refused, "evaluateChecked accepted a fast-math kernel");
+}
+
+// evaluateChecked reports exactly the rows whose arguments raise invalid
+// operation or division by zero, stops at maxRows, and reports nothing for
+// a clean batch. Values are the interpreter's either way.
+void exceptionRows(){
+    std::vector<std::string> names{"a", "b"};
+    Cell expr = read("(+ (/ a b) (sqrt a))");
+    size_t rows = 1000;
+    std::vector<double> a(column(rows, 0)), b(column(rows, 1));
+    CodeGenBatchFunction f(names, expr);
+    const double *columns[] = {a.data(), b.data()};
+    std::vector<double> out(rows);
+    double *outs[] = {out.data()};
+
+    FloatExceptions clean = f.evaluateChecked(columns, outs, rows);
+    expect(!clean.any() && clean.rows.empty(), "exceptions reported for a clean batch");
+
+    b[123] = 0;
+    a[500] = -1;
+    b[777] = 0;
+    FloatExceptions report = f.evaluateChecked(columns, outs, rows);
+    expect(report.flags == (FloatExceptions::Invalid | FloatExceptions::DivideByZero),
+           "flags " + std::to_string(report.flags));
+    expect(report.rows == std::vector<size_t>{123, 500, 777}, "wrong rows reported");
+    CalculatorFunction interpreted(names, expr);
+    for(size_t r = 0; r < rows; ++r)
+        expect(out[r], interpreted({a[r], b[r]}), 0, row(r));
+
+    FloatExceptions limited = f.evaluateChecked(columns, outs, rows, 2);
+    expect(limited.rows == std::vector<size_t>{123, 500}, "maxRows not respected");
+
+    // Results written over the divisors: the reruns still see the zeros.
+    std::vector<double> original(b);
+    double *inPlace[] = {b.data()};
+    FloatExceptions overwritten = f.evaluateChecked(columns, inPlace, rows);
+    expect(overwritten.rows == std::vector<size_t>{123, 500, 777}, "wrong rows reported in place");
+    for(size_t r = 0; r < rows; ++r)
+        expect(b[r], interpreted({a[r], original[r]}), 0, "in place " + row(r));
+}
+
+// Sum of squares of 16 arguments, built by hand so a test can assemble it
+// with a reservation of its choice.
+void buildSumOfSquares(AsmJit::X86Compiler &c){
+    using namespace AsmJit;
+    c.newFunc(kX86FuncConvDefault, FuncBuilder1<double, const double *>());
+    GpVar args(c.getGpArg(0));
+    XmmVar sum(c.newXmmVar());
+    c.xorpd(sum, sum);
+    for(int i = 0; i < 16; ++i){
+        XmmVar t(c.newXmmVar());
+        c.movsd(t, qword_ptr(args, i * sizeof(double)));
+        c.mulsd(t, t);
+        c.addsd(sum, t);
+        c.unuse(t);
+    }
+    c.ret(sum);
+    c.endFunc();
+}
+
+// Code assembled in place matches the copied code, whether the size
+// estimate holds or the code outgrows the reservation and falls back to
+// the copy; kernels compiled either way give bit identical results.
+void inPlaceCode(){
+    using namespace AsmJit;
+    typedef double (*SumFunc)(const double *);
+    std::vector<double> args(column(16, 0));
+    double expected = 0;
+    for(double a : args)
+        expected += a * a;
+
+    // Reservation 0 assembles into a growing buffer and copies.
+    for(size_t reserve : {size_t(0), size_t(16), size_t(0) - 1}){
+        X86Compiler compiler;
+        buildSumOfSquares(compiler);
+        X86Assembler a(compiler.getContext());
+        if(reserve){
+            size_t bytes = reserve == size_t(0) - 1 ? compiler.getCodeSizeEstimate() : reserve;
+            a.setProperty(kX86PropertyEmitInPlace, true);
+            expect(a.reserveCode(bytes), "reserving " + std::to_string(bytes) + " bytes");
+        }
+        compiler.serialize(a);
+        std::string what = reserve == 0 ? "copied code" : reserve == 16 ? "overflowed reservation" : "estimated reservation";
+        expect(a.isEmittingInPlace() == (reserve == size_t(0) - 1), "in place state of " + what);
+        SumFunc f = reinterpret_cast<SumFunc>(a.make());
+        expect(f != nullptr, "no code for " + what);
+        expectBits(f(args.data()), expected, what);
+        MemoryManager::getGlobal()->free((void*)f);
+    }
+
+    std::vector<std::string> names{"a", "b", "c"};
+    Cell expr = read("(+ (/ a b) (sqrt (* c (- a b))))");
+    CompileOptions copied;
+    copied.emitInPlace = false;
+    CodeGenCalculatorFunction inPlaceScalar(names, expr), copiedScalar(names, expr, copied);
+    expect(inPlaceScalar.getCodeSize() == copiedScalar.getCodeSize(), "scalar code sizes differ");
+    BatchOptions copiedBatch;
+    copiedBatch.emitInPlace = false;
+    CodeGenBatchFunction inPlaceBatch(names, expr), copiedBatchFunction(names, expr, copiedBatch);
+    size_t rows = 1000;
+    std::vector<double> a(column(rows, 0)), b(column(rows, 1)), c(column(rows, 2));
+    std::vector<double> inPlaceOut(rows), copiedOut(rows);
+    const double *columns[] = {a.data(), b.data(), c.data()};
+    inPlaceBatch(columns, inPlaceOut.data(), rows);
+    copiedBatchFunction(columns, copiedOut.data(), rows);
+    for(size_t r = 0; r < rows; ++r){
+        expectBits(inPlaceScalar({a[r], b[r], c[r]}), copiedScalar({a[r], b[r], c[r]}), "scalar " + row(r));
+        expectBits(inPlaceOut[r], copiedOut[r], "batch " + row(r));
+    }
+}
+
+// Memoized results, hits included, equal the interpreter's from several
+// threads at once, and keys tell 0 from -0.
+void memoHits(){
+    std::vector<std::string> names{"x", "y"};
+    Cell expr = read("(/ (sqrt (+ (* x x) (* y y))) y)");
+    BytecodeFunction bytecode(names, expr);
+    MemoizedFunction memo([&](const std::vector<double> &args){ return bytecode(args); }, 2, 1024);
+
+    std::vector<double> xs(column(200, 0)), ys(column(200, 1));
+    std::vector<double> expected;
+    CalculatorFunction interpreted(names, expr);
+    for(size_t i = 0; i < xs.size(); ++i)
+        expected.push_back(interpreted({xs[i], ys[i]}));
+
+    // One thread first, so every call is counted.
+    for(size_t round = 0; round < 5; ++round)
+        for(size_t i = 0; i < xs.size(); ++i)
+            expect(memo({xs[i], ys[i]}), expected[i], 0, "tuple " + std::to_string(i));
+    MemoStats stats = memo.snapshotStats();
+    expect(stats.hits + stats.misses == 5*xs.size(), "calls not counted");
+    expect(stats.hits >= 4*xs.size() / 2, "hit rate below half of the repeated calls");
+
+    // Threads sharing a cache slot call the function directly instead.
+    memo.reset();
+    std::vector<std::string> errors(4);
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < errors.size(); ++t){
+        threads.push_back(std::thread([&, t]{
+            try{
+                for(size_t round = 0; round < 5; ++round)
+                    for(size_t i = 0; i < xs.size(); ++i)
+                        expect(memo({xs[i], ys[i]}), expected[i], 0, "tuple " + std::to_string(i));
+            }catch(const std::exception &e){
+                errors[t] = e.what();
+            }
+        }));
+    }
+    for(std::thread &t : threads)
+        t.join();
+    for(const std::string &error : errors)
+        expect(error.empty(), error);
+
+    expect(memo({1, 0.0}), INFINITY, 0, "y = 0");
+    expect(memo({1, -0.0}), -INFINITY, 0, "y = -0");
+}
+
+// Futures of calls submitted from several threads, batched together, hold
+// the interpreter's result for their own arguments; a lone call completes
+// through the timeout.
+void microBatches(){
+    std::vector<std::string> names{"x", "y"};
+    Cell expr = read("(+ (* x 3) (/ y x))");
+    CodeGenBatchFunction kernel(names, expr);
+    CalculatorFunction interpreted(names, expr);
+    MicroBatcher batcher(kernel, 64);
+
+    std::vector<double> xs(column(500, 0)), ys(column(500, 1)), expected;
+    for(size_t i = 0; i < xs.size(); ++i)
+        expected.push_back(interpreted({xs[i], ys[i]}));
+
+    std::vector<std::string> errors(4);
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < errors.size(); ++t){
+        threads.push_back(std::thread([&, t]{
+            try{
+                std::vector<std::future<double>> results;
+                for(size_t i = t; i < xs.size(); i += errors.size())
+                    results.push_back(batcher.submit({xs[i], ys[i]}));
+                for(size_t k = 0; k < results.size(); ++k)
+                    expect(results[k].get(), expected[t + k*errors.size()], 0,
+                           "call " + std::to_string(t + k*errors.size()));
+            }catch(const std::exception &e){
+                errors[t] = e.what();
+            }
+        }));
+    }
+    for(std::thread &t : threads)
+        t.join();
+    for(const std::string &error : errors)
+        expect(error.empty(), error);
+    expect(batcher.averageBatchRows() > 1, "calls were not batched");
+
+    expect(batcher.submit({2, 1}).get(), interpreted({2, 1}), 0, "lone call");
+}
+
+// A wide expression cut into stages gives the plain batch kernel's bits,
+// for tiles that do and don't divide the rows.
+void tiledBatch(){
+    std::vector<std::string> names;
+    std::string text = "0";
+    for(int i = 0; i < 24; ++i){
+        names.push_back("x" + std::to_string(i));
+        if(i % 2)
+            text = "(+ " + text + " (* x" + std::to_string(i - 1) + " (/ x" + std::to_string(i) + " 3)))";
+    }
+    Cell expr = read(text);
+    size_t rows = 1000;
+    std::vector<std::vector<double>> data;
+    std::vector<const double *> columns;
+    for(size_t i = 0; i < names.size(); ++i){
+        data.push_back(column(rows, i));
+        columns.push_back(data.back().data());
+    }
+    CodeGenBatchFunction plain(names, expr);
+    std::vector<double> expected(rows), out(rows);
+    plain(columns.data(), expected.data(), rows);
+
+    for(size_t tileRows : {size_t(0), size_t(64), size_t(333)}){
+        TiledBatchFunction tiled(names, expr, 4, tileRows);
+        expect(tiled.getStageCount() > 1, "expression was not split");
+        std::fill(out.begin(), out.end(), 0.0);
+        tiled(columns.data(), out.data(), rows);
+        for(size_t r = 0; r < rows; ++r)
+            expectBits(out[r], expected[r], "tile " + std::to_string(tiled.getTileRows()) + ", " + row(r));
+    }
+}
+
+// Arguments read from records (out of order, with padding between them)
+// give the column kernel's bits, unrolled, prefetched and streamed, into
+// aligned and unaligned outputs.
+void recordLayout(){
+    std::vector<std::string> names{"x", "y", "z"};
+    Cell expr = read("(+ (* x y) (/ z (- x 0.25)))");
+    size_t rows = 999, fields = 5;
+    std::vector<size_t> slots{3, 1, 4};
+    std::vector<std::vector<double>> data;
+    std::vector<const double *> columns;
+    std::vector<double> records(rows*fields, -1.0);
+    for(size_t i = 0; i < names.size(); ++i){
+        data.push_back(column(rows, i));
+        columns.push_back(data.back().data());
+        for(size_t r = 0; r < rows; ++r)
+            records[r*fields + slots[i]] = data[i][r];
+    }
+    CodeGenBatchFunction plain(names, expr);
+    std::vector<double> expected(rows), out(rows + 1);
+    plain(columns.data(), expected.data(), rows);
+
+    RowLayout layout(fields*sizeof(double), {slots[0]*sizeof(double), slots[1]*sizeof(double),
+                                             slots[2]*sizeof(double)});
+    std::vector<BatchOptions> variants(4);
+    variants[1].unroll = 3;
+    variants[2].prefetchDistance = 64;
+    variants[3].nonTemporalStores = true;
+    for(size_t v = 0; v < variants.size(); ++v){
+        CodeGenBatchFunction f(names, expr, variants[v], layout);
+        for(size_t shift = 0; shift < 2; ++shift){
+            f.evaluateRecords(records.data(), out.data() + shift, rows);
+            for(size_t r = 0; r < rows; ++r)
+                expectBits(out[r + shift], expected[r], "options " + std::to_string(v) + ", shift " +
+                           std::to_string(shift) + ", " + row(r));
+        }
+    }
+}
+
+// Denormal results (FTZ) and operands (DAZ) become zero in every engine
+// when flushing, stay exact otherwise, and the caller's MXCSR survives.
+void flushedDenormals(){
+    std::vector<std::string> names{"x", "y"};
+    Cell expr = read("(* x y)");
+    std::vector<double> xs{1e-160, 1e-310, 3}, ys{1e-160, 1e300, 0.5};
+    std::vector<const double *> columns{xs.data(), ys.data()};
+    std::vector<double> exact, out(xs.size());
+    for(size_t r = 0; r < xs.size(); ++r){
+        exact.push_back(xs[r]*ys[r]);
+        expect(exact[r] != 0, "denormals are flushed by the caller");
+    }
+    unsigned int mode = _mm_getcsr() & ~mxcsrExceptionFlags;
+    for(bool flush : {false, true}){
+        BatchOptions options;
+        options.flushDenormals = flush;
+        CalculatorFunction interpreted(names, expr, options);
+        BytecodeFunction bytecode(names, expr, options);
+        CodeGenCalculatorFunction scalar(names, expr, options);
+        CodeGenBatchFunction batch(names, expr, options);
+        batch(columns.data(), out.data(), out.size());
+        for(size_t r = 0; r < xs.size(); ++r){
+            double expected = flush && r < 2 ? 0.0 : exact[r];
+            std::string what = (flush ? "flushed " : "exact ") + row(r);
+            expectBits(interpreted({xs[r], ys[r]}), expected, "interpreter, " + what);
+            expectBits(bytecode({xs[r], ys[r]}), expected, "bytecode, " + what);
+            expectBits(scalar({xs[r], ys[r]}), expected, "scalar JIT, " + what);
+            expectBits(out[r], expected, "batch, " + what);
+        }
+        expect((_mm_getcsr() & ~mxcsrExceptionFlags) == mode, "MXCSR not restored");
+    }
+}
+
+// Minimal JSON reader for checking the trace output: any syntax error
+// throws, strings are unescaped (\\u escapes become '?').
+struct Json{
+    enum Type {Null, Bool, Number, String, Array, Object};
+    Type type;
+    double number;
+    std::string string;
+    std::vector<Json> items;
+    std::map<std::string, Json> members;
+
+    Json() : type(Null), number(0) {}
+};
+
+class JsonReader{
+private:
+    const std::string &text;
+    size_t at;
+
+    std::runtime_error error(const std::string &what) const {
+        return std::runtime_error("JSON at offset " + std::to_string(at) + ": " + what);
+    }
+
+    char peek(){
+        while(at < text.size() && std::strchr(" \t\r\n", text[at]))
+            ++at;
+        if(at == text.size())
+            throw error("unexpected end");
+        return text[at];
+    }
+
+    void take(char c){
+        if(peek() != c)
+            throw error(std::string("expected '") + c + "'");
+        ++at;
+    }
+
+    void digits(){
+        if(at == text.size() || !std::isdigit(text[at]))
+            throw error("expected a digit");
+        while(at < text.size() && std::isdigit(text[at]))
+            ++at;
+    }
+
+    std::string readString(){
+        take('"');
+        std::string s;
+        for(;;){
+            if(at == text.size())
+                throw error("unterminated string");
+            char c = text[at++];
+            if(c == '"')
+                return s;
+            if(static_cast<unsigned char>(c) < 0x20)
+                throw error("control character in string");
+            if(c != '\\'){
+                s += c;
+                continue;
+            }
+            if(at == text.size())
+                throw error("unterminated escape");
+            c = text[at++];
+            switch(c){
+            case '"': case '\\': case '/': s += c; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u':
+                for(int i = 0; i < 4; ++i)
+                    if(at == text.size() || !std::isxdigit(text[at++]))
+                        throw error("bad \\u escape");
+                s += '?';
+                break;
+            default:
+                throw error("bad escape");
+            }
+        }
+    }
+
+    Json readValue(){
+        Json v;
+        char c = peek();
+        if(c == '{'){
+            v.type = Json::Object;
+            take('{');
+            while(peek() != '}'){
+                if(!v.members.empty())
+                    take(',');
+                std::string key = readString();
+                take(':');
+                v.members[key] = readValue();
+            }
+            take('}');
+        }else if(c == '['){
+            v.type = Json::Array;
+            take('[');
+            while(peek() != ']'){
+                if(!v.items.empty())
+                    take(',');
+                v.items.push_back(readValue());
+            }
+            take(']');
+        }else if(c == '"'){
+            v.type = Json::String;
+            v.string = readString();
+        }else if(c == '-' || std::isdigit(c)){
+            // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+            size_t begin = at;
+            if(text[at] == '-')
+                ++at;
+            if(at < text.size() && text[at] == '0')
+                ++at;
+            else
+                digits();
+            if(at < text.size() && text[at] == '.'){
+                ++at;
+                digits();
+            }
+            if(at < text.size() && (text[at] == 'e' || text[at] == 'E')){
+                ++at;
+                if(at < text.size() && (text[at] == '+' || text[at] == '-'))
+                    ++at;
+                digits();
+            }
+            v.type = Json::Number;
+            v.number = std::strtod(text.substr(begin, at - begin).c_str(), nullptr);
+        }else{
+            static const char *words[] = {"null", "true", "false"};
+            for(const char *word : words){
+                if(text.compare(at, std::strlen(word), word) == 0){
+                    at += std::strlen(word);
+                    v.type = word[0] == 'n' ? Json::Null : Json::Bool;
+                    v.number = word[0] == 't';
+                    return v;
+                }
+            }
+            throw error("unexpected character");
+        }
+        return v;
+    }
+
+public:
+    explicit JsonReader(const std::string &text) : text(text), at(0) {}
+
+    // The whole text as one value.
+    Json read(){
+        Json v = readValue();
+        while(at < text.size() && std::strchr(" \t\r\n", text[at]))
+            ++at;
+        if(at != text.size())
+            throw error("trailing characters");
+        return v;
+    }
+};
+
+// The trace of parsing, compiling and batch workers is valid trace-event
+// JSON, and each assembly nests inside the compilation on its thread.
+void traceJson(){
+    Tracer &tracer = Tracer::global();
+    bool wasEnabled = tracer.isEnabled();
+    if(!wasEnabled)
+        tracer.start(std::string()); // No file at exit.
+    {
+        CodeGenCalculatorFunction f({"x", "y"}, read("(+ (* x y) 2)"));
+        BatchExecutor executor(3);
+        executor.runOnWorkers([](size_t){});
+    }
+    std::ostringstream out;
+    tracer.write(out);
+    if(!wasEnabled)
+        tracer.stop();
+
+    Json trace = JsonReader(out.str()).read();
+    expect(trace.type == Json::Object && trace.members.count("traceEvents") &&
+           trace.members["traceEvents"].type == Json::Array, "no traceEvents array");
+    std::set<std::string> names;
+    std::set<double> threads;
+    std::vector<const Json *> compiles, assemblies;
+    for(const Json &e : trace.members["traceEvents"].items){
+        expect(e.type == Json::Object, "event is not an object");
+        for(const char *key : {"name", "cat", "ph"})
+            expect(e.members.count(key) && e.members.at(key).type == Json::String,
+                   std::string("event without a string ") + key);
+        for(const char *key : {"ts", "dur", "pid", "tid"})
+            expect(e.members.count(key) && e.members.at(key).type == Json::Number && e.members.at(key).number >= 0,
+                   std::string("event without a number ") + key);
+        expect(e.members.at("ph").string == "X", "event is not complete (ph X)");
+        const std::string &name = e.members.at("name").string;
+        names.insert(name);
+        threads.insert(e.members.at("tid").number);
+        if(name.compare(0, 8, "compile ") == 0)
+            compiles.push_back(&e);
+        else if(name == "assemble")
+            assemblies.push_back(&e);
+    }
+    for(const char *name : {"parse", "compile scalar", "assemble", "batch worker"})
+        expect(names.count(name) > 0, std::string("no ") + name + " event");
+    expect(threads.size() > 1, "events of one thread only");
+    for(const Json *a : assemblies){
+        bool nested = false;
+        for(const Json *c : compiles){
+            const std::map<std::string, Json> &outer = c->members, &inner = a->members;
+            nested = nested || (outer.at("tid").number == inner.at("tid").number &&
+                                outer.at("ts").number <= inner.at("ts").number &&
+                                inner.at("ts").number + inner.at("dur").number <=
+                                outer.at("ts").number + outer.at("dur").number);
+        }
+        expect(nested, "assemble outside compilation");
+    }
+}
+
+// Random expressions for the code generator checks: operators at inner
+// nodes, argument names and small constants at leaves. Binary operators get
+// two operands of the same shape half of the time, which the scalar JIT
+// packs into lane pairs.
+class ExpressionGenerator{
+private:
+    std::vector<std::string> names;
+    uint32_t seed;
+
+    uint32_t next(uint32_t n){
+        seed = seed*1103515245u + 12345u;
+        return (seed >> 16) % n;
+    }
+
+    Cell leaf(){
+        static const char *numbers[] = {"0.5", "3", "-1.25", "7.75"};
+        if(next(3) == 0)
+            return Cell(Cell::Number, numbers[next(4)]);
+        return Cell(Cell::Symbol, names[next(names.size())]);
+    }
+
+    // Same operators, new leaves.
+    Cell relabel(const Cell &c){
+        if(c.type != Cell::List)
+            return leaf();
+        Cell copy(c);
+        for(size_t i = 1; i < copy.list.size(); ++i)
+            copy.list[i] = relabel(c.list[i]);
+        return copy;
+    }
+
+public:
+    ExpressionGenerator(const std::vector<std::string> &names, uint32_t seed) : names(names), seed(seed) {}
+
+    Cell operator()(int depth){
+        static const char *ops[] = {"+", "-", "*", "/", "sqrt"};
+        if(depth == 0 || next(4) == 0)
+            return leaf();
+        Cell c(Cell::List);
+        std::string op = ops[next(5)];
+        c.list.push_back(Cell(Cell::Symbol, op));
+        c.list.push_back((*this)(depth - 1));
+        if(op != "sqrt")
+            c.list.push_back(next(2) ? relabel(c.list[1]) : (*this)(depth - 1));
+        return c;
+    }
+};
+
+// Random expressions give the interpreter's bits with and without subtree
+// pairing.
+void pairedSubtrees(){
+    std::vector<std::string> names{"a", "b", "c", "d"};
+    ExpressionGenerator generate(names, 83);
+    std::vector<double> args{1.5, -0.375, 2.25, 0.1};
+    CompileOptions paired;
+    paired.vectorizeSubtrees = true;
+    for(int i = 0; i < 300; ++i){
+        Cell expr = generate(5);
+        CalculatorFunction interpreted(names, expr);
+        CodeGenCalculatorFunction scalar(names, expr), vectorized(names, expr, paired);
+        double expected = interpreted(args);
+        expectBits(scalar(args), expected, formatCell(expr));
+        expectBits(vectorized(args), expected, "paired " + formatCell(expr));
+    }
+}
+
+void subexpressions(const Cell &c, std::vector<std::string> &out){
+    out.push_back(formatCell(c));
+    if(c.type == Cell::List)
+        for(size_t i = 1; i < c.list.size(); ++i)
+            subexpressions(c.list[i], out);
+}
+
+// The source map's lines tile the code, every node owns some of them, and
+// every sub-expression is a node or one side of a "low | high" pair node.
+void sourceMapCoverage(){
+    std::vector<std::string> names{"a", "b", "c", "d"};
+    ExpressionGenerator generate(names, 29);
+    size_t pairNodes = 0;
+    for(int i = 0; i < 100; ++i){
+        Cell expr = generate(5);
+        std::vector<std::string> expected;
+        subexpressions(expr, expected);
+        for(bool vectorize : {false, true}){
+            CompileOptions options;
+            options.sourceMap = true;
+            options.vectorizeSubtrees = vectorize;
+            CodeGenCalculatorFunction f(names, expr, options);
+            const SourceMap &map = f.getSourceMap();
+            std::string what = (vectorize ? "paired " : "") + formatCell(expr);
+
+            std::vector<size_t> owned(map.nodes.size());
+            size_t end = 0;
+            for(const SourceMap::Line &l : map.lines){
+                expect(l.begin == end, what + ": gap before " + l.text);
+                end = l.end;
+                if(l.node >= 0)
+                    ++owned[l.node];
+            }
+            expect(end == map.codeSize, what + ": code after the last line");
+            expect(!map.nodes.empty() && map.nodes[0].expr == formatCell(expr), what + ": root is not node 0");
+
+            std::set<std::string> covered;
+            for(size_t n = 0; n < map.nodes.size(); ++n){
+                const std::string &node = map.nodes[n].expr;
+                expect(owned[n] > 0, what + ": no code for " + node);
+                size_t bar = node.find(" | ");
+                if(bar == std::string::npos){
+                    covered.insert(node);
+                }else{
+                    ++pairNodes;
+                    covered.insert(node.substr(0, bar));
+                    covered.insert(node.substr(bar + 3));
+                }
+            }
+            for(const std::string &sub : expected)
+                expect(covered.count(sub) > 0, what + ": " + sub + " is not mapped");
+        }
+    }
+    expect(pairNodes > 0, "no pair nodes");
+}
+
+int run(){
+    static const struct{
+        const char *name;
+        void (*check)();
+    } checks[] = {
+        {"batch executor", batchExecutor},
+        {"tiled batch", tiledBatch},
+        {"record layout", recordLayout},
+        {"flushed denormals", flushedDenormals},
+        {"fast-math accuracy", fastMathAccuracy},
+        {"paired subtrees", pairedSubtrees},
+        {"source map coverage", sourceMapCoverage},
+        {"nullable batch", nullableBatch},
+        {"code cache eviction", codeCacheEviction},
+        {"fused batch", fusedBatch},
+        {"formula network", formulaNetwork},
+        {"series chunks", seriesChunks},
+        {"interval bounds", intervalBounds},
+        {"exception rows", exceptionRows},
+        {"in-place code", inPlaceCode},
+        {"memo hits", memoHits},
+        {"micro-batches", microBatches},
+        {"trace JSON", traceJson},
+    };
+    int failures = 0;
+    for(const auto &c : checks){
+        try{
+            c.check();
+            std::cout << "ok      " << c.name << "\n";
+        }catch(const std::exception &e){
+            ++failures;
+            std::cout << "FAILED  " << c.name << ": " << e.what() << "\n";
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+}
+
 int main (int argc, char *argv[])
 {
+    if(argc == 2 && std::string(argv[1]) == "-selftest")
+        return selfcheck::run();
+
     if(argc <= 2){
         std::cout << "Error: Not enough arguments.\n";
         std::cout << "Usage: \n\n   $ calc \"((args1 ... argsn) (expr))\" arg1 ... argn\n\n"; 
         std::cout << "Example: \n\n   $ calc \"((x y) (+ (* x y) 10.5))\" 4 2\n\n"; 
         std::cout << "Use the \"-benchmark\" switch to bechmark interpreted vs JIT evaluation.\n";
+        std::cout << "Use the \"-ftz\" switch to flush denormals to zero (FTZ/DAZ).\n";
+        std::cout << "Use the \"-fast-math[=steps]\" switch for approximate division and square root.\n";
+        std::cout << "Use the \"-vectorize\" switch to evaluate identically shaped subtrees in SSE lane pairs.\n";
+        std::cout << "Use the \"-annotate\" switch to print the JIT code annotated with its sub-expressions.\n";
+        std::cout << "Use the \"-trace=file.json\" switch to write a Chrome trace of parsing, compilation and evaluation.\n";
+        std::cout << "Use the \"-profile[=period]\" switch to count calls and time one call per period (rounded up to a power of two) of JIT code.\n";
+        std::cout << "Run \"calc -selftest\" to check the batch, series and caching features against the interpreter.\n";
         return 0;
     }
 
 
     size_t codeIndex = 1;
     bool benchmark = false;
-    if(std::string(argv[1]) == "-benchmark"){
-        codeIndex++;
-        benchmark = true;
+    BatchOptions options;
+    for(; codeIndex < size_t(argc) - 1 && argv[codeIndex][0] == '-' &&
+          !std::isdigit(argv[codeIndex][1]); ++codeIndex){
+        std::string option(argv[codeIndex]);
+        if(option == "-benchmark")
+            benchmark = true;
+        else if(option == "-ftz")
+            options.flushDenormals = true;
+        else if(option == "-annotate")
+            options.sourceMap = true;
+        else if(option.compare(0, 7, "-trace=") == 0)
+            Tracer::global().start(option.substr(7));
+        else if(option == "-profile")
+            options.profile = CompileOptions::ProfileCycles;
+        else if(option.compare(0, 9, "-profile=") == 0){
+            options.profile = CompileOptions::ProfileCycles;
+            unsigned long period = std::strtoul(option.c_str() + 9, nullptr, 10);
+            options.profileSamplePeriod = 1;
+            while(options.profileSamplePeriod < period && options.profileSamplePeriod < (1u << 31))
+                options.profileSamplePeriod <<= 1;
+        }
+        else if(option == "-vectorize")
+            options.vectorizeSubtrees = true;
+        else if(option == "-fast-math")
+            options.fastMath = true;
+        else if(option.compare(0, 11, "-fast-math=") == 0){
+            options.fastMath = true;
+            options.fastMathRefinements = std::atoi(option.c_str() + 11);
+        }
+        else{
+            std::cout << "Error: Unknown option " << option << "\n";
+            return 0;
+        }
     }
 
 
+    // Route JIT code memory through the tracer so allocations show up.
+    TracingMemoryManager tracingMemory(AsmJit::MemoryManager::getGlobal());
+    if(Tracer::global().isEnabled())
+        AsmJit::JitContext::getGlobal()->setMemoryManager(&tracingMemory);
+
     // Parse first command line argument.
     Cell cell = read(argv[codeIndex]); 
     if(!(cell.type == Cell::List && cell.list.size() == 2 &&
@@ -329,31 +5297,152 @@ int main (int argc, char *argv[])
 
     // Run the code
     namespace sc = std::chrono;
-    CalculatorFunction interpretedFunction(argNames, expr);
-    CodeGenCalculatorFunction jitFunction(argNames, expr);
+    CalculatorFunction interpretedFunction(argNames, expr, options);
+    CodeGenCalculatorFunction jitFunction(argNames, expr, options);
     std::cout << "Interpreted output: " << interpretedFunction(numericArgs) << std::endl;
     std::cout << "Code gen output: " << jitFunction(numericArgs) << std::endl;
+    if(options.sourceMap){
+        std::cout << "\n" << jitFunction.getSourceMap().annotate();
+        jitFunction.getSourceMap().writePerfMap("jitcalc_expression");
+    }
 
 
     if(benchmark){
         std::cout << "\nBenchmarking...\n";
         size_t repetitions = 10000000;
         auto startInterp = sc::high_resolution_clock::now();
-        for(size_t i = 0; i < repetitions; ++i)
-            interpretedFunction(numericArgs);
+        {
+            TraceScope trace("interpreted loop", "evaluate");
+            for(size_t i = 0; i < repetitions; ++i)
+                interpretedFunction(numericArgs);
+        }
         auto endInterp = sc::high_resolution_clock::now();
 
         auto startJit = sc::high_resolution_clock::now();
-        for(size_t i = 0; i < repetitions; ++i)
-            jitFunction(numericArgs);
+        {
+            TraceScope trace("jit loop", "evaluate");
+            for(size_t i = 0; i < repetitions; ++i)
+                jitFunction(numericArgs);
+        }
         auto endJit = sc::high_resolution_clock::now();
 
         std::cout << "Duration for " << repetitions << " repeated evaluations:\n\n";
         std::cout << " - Interpreted: " << 
                      sc::duration_cast<sc::milliseconds>(endInterp-startInterp).count() << "ms\n";
 
-        std::cout << " - JIT: " << 
+        std::cout << " - JIT: " <<
                      sc::duration_cast<sc::milliseconds>(endJit-startJit).count() << "ms \n";
+        if(options.profile != CompileOptions::ProfileOff){
+            ProfileSnapshot p = jitFunction.snapshotProfile();
+            std::cout << "   (" << p.calls << " calls, ~" << p.estimatedCycles() / p.calls
+                      << " cycles per call)\n";
+        }
+
+        // Latency rather than throughput: every call's first argument
+        // depends on the previous result, with and without subtree pairing.
+        if(!numericArgs.empty()){
+            CompileOptions pairedOptions(options), scalarOptions(options);
+            pairedOptions.vectorizeSubtrees = true;
+            scalarOptions.vectorizeSubtrees = false;
+            CodeGenCalculatorFunction pairedFunction(argNames, expr, pairedOptions);
+            CodeGenCalculatorFunction scalarFunction(argNames, expr, scalarOptions);
+            auto dependentCalls = [&](const CodeGenCalculatorFunction &f){
+                std::vector<double> args(numericArgs);
+                double result = 0;
+                auto start = sc::high_resolution_clock::now();
+                for(size_t i = 0; i < repetitions; ++i){
+                    args[0] = numericArgs[0] + result*0;
+                    result = f(args);
+                }
+                return sc::duration_cast<sc::milliseconds>(sc::high_resolution_clock::now() - start).count();
+            };
+            std::cout << " - JIT dependent calls: " << dependentCalls(scalarFunction) << "ms, " <<
+                         "with paired subtrees: " << dependentCalls(pairedFunction) << "ms\n";
+        }
+
+        BytecodeFunction bytecodeFunction(argNames, expr, options);
+        auto startBytecode = sc::high_resolution_clock::now();
+        for(size_t i = 0; i < repetitions; ++i)
+            bytecodeFunction(numericArgs);
+        auto endBytecode = sc::high_resolution_clock::now();
+
+        std::cout << " - Bytecode: " <<
+                     sc::duration_cast<sc::milliseconds>(endBytecode-startBytecode).count() << "ms\n";
+
+        CostModel costModel;
+        std::cout << " - Cost model picks: " << tierName(costModel.choose(expr, Workload(1))) <<
+                     " for 1 evaluation, " << tierName(costModel.choose(expr, Workload(repetitions))) <<
+                     " for " << repetitions << " scalar calls, " <<
+                     tierName(costModel.choose(expr, Workload(repetitions, repetitions))) << " for one batch\n";
+
+        // Same number of evaluations as one batch of rows, spread over all
+        // CPUs. Columns are filled by the workers that later read them.
+        BatchExecutor executor;
+        CodeGenBatchFunction batchFunction(argNames, expr, options);
+        std::vector<Column> columnStorage;
+        std::vector<const double *> columns;
+        for(double arg : numericArgs){
+            columnStorage.push_back(executor.allocateColumn(repetitions));
+            double *data = columnStorage.back().get();
+            executor.parallelFor(repetitions, [=](size_t begin, size_t end){
+                std::fill(data + begin, data + end, arg);
+            });
+            columns.push_back(data);
+        }
+        Column out(executor.allocateColumn(repetitions));
+
+        auto startBatch = sc::high_resolution_clock::now();
+        executor.evaluate(batchFunction, columns, out.get(), repetitions);
+        auto endBatch = sc::high_resolution_clock::now();
+
+        std::cout << " - Batch JIT (" << executor.getWorkerCount() << " threads): " <<
+                     sc::duration_cast<sc::milliseconds>(endBatch-startBatch).count() << "ms" <<
+                     " (output " << out[repetitions - 1] << ")\n";
+
+        BatchOptions tuned = autotuneBatchOptions(argNames, expr, repetitions, options.flushDenormals);
+        CodeGenBatchFunction tunedFunction(argNames, expr, tuned);
+        auto startTuned = sc::high_resolution_clock::now();
+        executor.evaluate(tunedFunction, columns, out.get(), repetitions);
+        auto endTuned = sc::high_resolution_clock::now();
+
+        std::cout << " - Batch JIT autotuned (unroll " << tuned.unroll <<
+                     ", prefetch " << tuned.prefetchDistance <<
+                     (tuned.nonTemporalStores ? ", streaming stores" : "") << "): " <<
+                     sc::duration_cast<sc::milliseconds>(endTuned-startTuned).count() << "ms\n";
+
+        // The same rows as interleaved records: struct { double args[n]; }.
+        size_t argCount = numericArgs.size();
+        RowLayout layout(argCount*sizeof(double), std::vector<size_t>());
+        for(size_t i = 0; i < argCount; ++i)
+            layout.offsets.push_back(i*sizeof(double));
+        CodeGenBatchFunction recordFunction(argNames, expr, options, layout);
+        Column records(executor.allocateColumn(repetitions*argCount));
+        double *recordData = records.get();
+        executor.parallelFor(repetitions, [&](size_t begin, size_t end){
+            for(size_t r = begin; r < end; ++r)
+                std::copy(numericArgs.begin(), numericArgs.end(), recordData + r*argCount);
+        });
+        auto startRecords = sc::high_resolution_clock::now();
+        executor.evaluateRecords(recordFunction, recordData, out.get(), repetitions);
+        auto endRecords = sc::high_resolution_clock::now();
+
+        std::cout << " - Batch JIT array-of-structs input: " <<
+                     sc::duration_cast<sc::milliseconds>(endRecords-startRecords).count() << "ms\n";
+
+        if(options.fastMath)
+            reportFastMathAccuracy(argNames, expr, numericArgs, options);
+
+        // Only differs from the plain batch kernel for wide expressions.
+        TiledBatchFunction tiledFunction(argNames, expr, 8, 0, options);
+        if(tiledFunction.getStageCount() > 1){
+            auto startTiled = sc::high_resolution_clock::now();
+            executor.evaluate(tiledFunction, columns, out.get(), repetitions);
+            auto endTiled = sc::high_resolution_clock::now();
+
+            std::cout << " - Tiled batch JIT (" << tiledFunction.getStageCount() << " stages, " <<
+                         tiledFunction.getTileRows() << " row tiles): " <<
+                         sc::duration_cast<sc::milliseconds>(endTiled-startTiled).count() << "ms\n";
+        }
     }
 
     return 0;